@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Ray.h"
+#include "RayPacket.h"
+
+enum AcceleratorType {
+	ACCEL_KD_TREE = 0,
+	ACCEL_BVH2,
+	ACCEL_BVH4,
+	ACCEL_BVH4_COMPRESSED,
+	ACCEL_COUNT
+};
+
+enum PrimitiveType {
+	PRIM_TRIANGLE = 0,
+	PRIM_SPHERE
+};
+
+// Hit queries report primitive ids: triangles by their mesh index, spheres by their index into the sphere
+// array with ACCEL_PRIM_SPHERE_BIT set.
+const uint32_t ACCEL_PRIM_SPHERE_BIT = 0x80000000u;
+
+inline PrimitiveType getPrimitiveType( uint32_t prim_id )
+{
+	return ( prim_id & ACCEL_PRIM_SPHERE_BIT ) ? PRIM_SPHERE : PRIM_TRIANGLE;
+}
+
+inline uint32_t getPrimitiveIndex( uint32_t prim_id )
+{
+	return prim_id & ~ACCEL_PRIM_SPHERE_BIT;
+}
+
+// Common interface of the acceleration structures, so the renderer can switch between them at runtime.
+class Accelerator
+{
+public:
+	virtual ~Accelerator( void ) {}
+
+	// Closest hit within [ray->TMin, ray->TMax]. u and v are the barycentrics of a triangle hit, 0 for spheres.
+	virtual bool closestHit( Ray* ray, float& t, uint32_t& prim_id, float& u, float& v ) const = 0;
+
+	// Any hit within [ray->TMin, t_max].
+	virtual bool occluded( Ray* ray, float t_max ) const = 0;
+
+	// Closest hits for a whole packet. Structures without a packet traversal trace the rays one by one.
+	virtual void closestHitPacket( RayPacket& packet ) const
+	{
+		for ( int i = 0; i < RayPacket::Size; ++i ) {
+			Ray ray = packet.GetRay( i );
+			packet.Hit[i] = closestHit( &ray, packet.T[i], packet.PrimId[i], packet.U[i], packet.V[i] );
+		}
+	}
+
+	// Spheres indexed next to the triangles. Structures that only index triangles leave spheres to the caller.
+	virtual int getNumSpheres( void ) const { return 0; }
+
+	// Bounds of everything the structure indexes, min > max if it is empty.
+	virtual void getBounds( glm::vec3& bounds_min, glm::vec3& bounds_max ) const = 0;
+
+	virtual const char* getName( void ) const = 0;
+	virtual float getBuildTime( void ) const = 0;
+	virtual size_t getMemoryBytes( void ) const = 0;
+};
@@ -0,0 +1,1174 @@
+#include "BVH2.h"
+#include "../KDAccel/Intersections.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <execution>
+#include <numeric>
+#include <thread>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if KD_USE_SSE
+#include <emmintrin.h>
+#endif
+
+#include <Walnut/Timer.h>
+
+
+////////////////////////////////////////////////////
+// Helpers.
+////////////////////////////////////////////////////
+
+namespace {
+	// Centroid bin along axis, shared by the cost evaluation and the partition so both agree on every triangle.
+	inline int getCentroidBin( const glm::vec3 &centroid, const BVHBounds &centroid_bounds, int axis )
+	{
+		float extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+		int bin = (int)( BVH_NUM_BINS * ( centroid[axis] - centroid_bounds.min[axis] ) / extent );
+		return std::min( std::max( bin, 0 ), BVH_NUM_BINS - 1 );
+	}
+
+	inline int countLeadingZeros( uint32_t x )
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		return _BitScanReverse( &index, x ) ? 31 - (int)index : 32;
+#else
+		return x ? __builtin_clz( x ) : 32;
+#endif
+	}
+
+	// Spreads the lower BVH_MORTON_BITS bits of x out to every third bit.
+	inline uint32_t expandBits( uint32_t x )
+	{
+		x = ( x * 0x00010001u ) & 0xFF0000FFu;
+		x = ( x * 0x00000101u ) & 0x0F00F00Fu;
+		x = ( x * 0x00000011u ) & 0xC30C30C3u;
+		x = ( x * 0x00000005u ) & 0x49249249u;
+		return x;
+	}
+
+	// Interleaves the quantized position of p within bounds, x in the highest bit of each triple.
+	inline uint32_t getMortonCode( const glm::vec3 &p, const BVHBounds &bounds )
+	{
+		const float max_cell = (float)( ( 1 << BVH_MORTON_BITS ) - 1 );
+
+		uint32_t code = 0;
+		for ( int axis = 0; axis < 3; ++axis ) {
+			float extent = bounds.max[axis] - bounds.min[axis];
+			float cell = extent > 0.0f ? ( p[axis] - bounds.min[axis] ) / extent * ( max_cell + 1.0f ) : 0.0f;
+			code |= expandBits( (uint32_t)std::min( std::max( cell, 0.0f ), max_cell ) ) << ( 2 - axis );
+		}
+		return code;
+	}
+
+	// LSD radix sort of the codes, carrying each code's value along. Every pass splits the input into chunks that
+	// count their digits in parallel, then scatter in parallel to disjoint ranges that keep the input order.
+	void radixSort( std::vector<uint32_t> &codes, std::vector<int> &values )
+	{
+		const int num_buckets = 1 << BVH_RADIX_BITS;
+		const uint32_t digit_mask = num_buckets - 1;
+
+		int n = (int)codes.size();
+		int num_chunks = std::max( 1, std::min( (int)std::thread::hardware_concurrency() * 4, n / BVH_RADIX_MIN_CHUNK ) );
+		int chunk_size = ( n + num_chunks - 1 ) / num_chunks;
+
+		std::vector<int> chunks( num_chunks );
+		std::iota( chunks.begin(), chunks.end(), 0 );
+
+		std::vector<int> offsets( (size_t)num_chunks * num_buckets );
+		std::vector<uint32_t> sorted_codes( n );
+		std::vector<int> sorted_values( n );
+
+		for ( int shift = 0; shift < 3 * BVH_MORTON_BITS; shift += BVH_RADIX_BITS ) {
+			std::for_each( std::execution::par, chunks.begin(), chunks.end(), [&]( int chunk ) {
+				int *histogram = &offsets[(size_t)chunk * num_buckets];
+				std::fill( histogram, histogram + num_buckets, 0 );
+				for ( int i = chunk * chunk_size; i < std::min( n, ( chunk + 1 ) * chunk_size ); ++i )
+					++histogram[( codes[i] >> shift ) & digit_mask];
+			} );
+
+			// Exclusive prefix sum, buckets outer, so each chunk's share of a bucket follows the earlier chunks'.
+			int sum = 0;
+			for ( int bucket = 0; bucket < num_buckets; ++bucket ) {
+				for ( int chunk = 0; chunk < num_chunks; ++chunk ) {
+					int &offset = offsets[(size_t)chunk * num_buckets + bucket];
+					int count = offset;
+					offset = sum;
+					sum += count;
+				}
+			}
+
+			std::for_each( std::execution::par, chunks.begin(), chunks.end(), [&]( int chunk ) {
+				int *offset = &offsets[(size_t)chunk * num_buckets];
+				for ( int i = chunk * chunk_size; i < std::min( n, ( chunk + 1 ) * chunk_size ); ++i ) {
+					int dst = offset[( codes[i] >> shift ) & digit_mask]++;
+					sorted_codes[dst] = codes[i];
+					sorted_values[dst] = values[i];
+				}
+			} );
+
+			codes.swap( sorted_codes );
+			values.swap( sorted_values );
+		}
+	}
+}
+
+
+////////////////////////////////////////////////////
+// Constructor/destructor.
+////////////////////////////////////////////////////
+
+BVH2::BVH2( int num_tris, glm::uvec3 *tris, glm::vec3 *verts, int num_spheres, const glm::vec4 *spheres, BVHBuildMode build_mode )
+{
+	Walnut::Timer timer;
+
+	this->num_tris = num_tris;
+	int num_prims = num_tris + num_spheres;
+
+	std::vector<BVHBuildPrim> prims( num_prims );
+	std::for_each( std::execution::par, prims.begin(), prims.end(), [&]( BVHBuildPrim &prim ) {
+		int i = (int)( &prim - prims.data() );
+		if ( i < num_tris ) {
+			const glm::uvec3 &tri = tris[i];
+			prim.bounds.grow( verts[tri[0]] );
+			prim.bounds.grow( verts[tri[1]] );
+			prim.bounds.grow( verts[tri[2]] );
+			prim.centroid = prim.bounds.getCenter();
+		}
+		else {
+			glm::vec3 center( spheres[i - num_tris] );
+			prim.bounds.grow( center - spheres[i - num_tris].w );
+			prim.bounds.grow( center + spheres[i - num_tris].w );
+			prim.centroid = center;
+		}
+		prim.prim_index = i;
+	} );
+
+	if ( num_prims > 0 ) {
+		nodes.reserve( 2 * num_prims );
+		if ( build_mode == BVH_BUILD_LBVH )
+			buildLBVH( prims );
+		else
+			buildRecursive( prims, 0, num_prims, 0 );
+	}
+
+	// Leaves reference ranges of the reordered primitives. Lay the records of each type out in the same order
+	// and move the leaf offsets over to them.
+	std::vector<int> record_index( num_prims );
+	int num_tri_records = 0, num_sphere_records = 0;
+	for ( int i = 0; i < num_prims; ++i ) {
+		record_index[i] = prims[i].prim_index < num_tris ? num_tri_records++ : num_sphere_records++;
+	}
+
+	leaf_tris.resize( num_tri_records );
+	leaf_spheres.resize( num_sphere_records );
+	std::for_each( std::execution::par, prims.begin(), prims.end(), [&]( const BVHBuildPrim &prim ) {
+		int i = (int)( &prim - prims.data() );
+		if ( prim.prim_index < num_tris ) {
+			const glm::uvec3 &tri = tris[prim.prim_index];
+			leaf_tris[record_index[i]] = { verts[tri[0]], verts[tri[1]] - verts[tri[0]], verts[tri[2]] - verts[tri[0]], prim.prim_index };
+		}
+		else {
+			const glm::vec4 &sphere = spheres[prim.prim_index - num_tris];
+			leaf_spheres[record_index[i]] = { glm::vec3( sphere ), sphere.w, prim.prim_index - num_tris };
+		}
+	} );
+
+	for ( BVHLinearNode &node : nodes ) {
+		if ( node.isLeaf() )
+			node.prim_offset = record_index[node.prim_offset];
+	}
+
+	initNodeLevels();
+	sah_cost = computeSAHCost();
+	build_sah_cost = sah_cost;
+	refit_time = 0.0f;
+
+	build_time = timer.ElapsedMillis();
+}
+
+BVH2::~BVH2()
+{
+}
+
+
+////////////////////////////////////////////////////
+// Getters.
+////////////////////////////////////////////////////
+
+const char* BVH2::getName( void ) const
+{
+	return "BVH2";
+}
+
+float BVH2::getBuildTime( void ) const
+{
+	return build_time;
+}
+
+size_t BVH2::getMemoryBytes( void ) const
+{
+	return nodes.size() * sizeof( BVHLinearNode ) + leaf_tris.size() * sizeof( KDTriRecord ) + leaf_spheres.size() * sizeof( BVHSphereRecord );
+}
+
+void BVH2::getBounds( glm::vec3 &bounds_min, glm::vec3 &bounds_max ) const
+{
+	BVHBounds bounds;
+	if ( !nodes.empty() ) {
+		bounds.grow( nodes[0].bounds_min );
+		bounds.grow( nodes[0].bounds_max );
+	}
+	bounds_min = bounds.min;
+	bounds_max = bounds.max;
+}
+
+int BVH2::getNumSpheres( void ) const
+{
+	return (int)leaf_spheres.size();
+}
+
+int BVH2::getNumNodes( void ) const
+{
+	return (int)nodes.size();
+}
+
+float BVH2::getRefitTime( void ) const
+{
+	return refit_time;
+}
+
+float BVH2::getSAHCost( void ) const
+{
+	return sah_cost;
+}
+
+float BVH2::computeSAHCost( void ) const
+{
+	if ( nodes.empty() )
+		return 0.0f;
+
+	float cost = 0.0f;
+	for ( const BVHLinearNode &node : nodes ) {
+		BVHBounds bounds;
+		bounds.grow( node.bounds_min );
+		bounds.grow( node.bounds_max );
+		cost += bounds.getSurfaceArea() * ( node.isLeaf() ? BVH_COST_INTERSECT * node.num_prims : BVH_COST_TRAVERSAL );
+	}
+
+	BVHBounds root;
+	root.grow( nodes[0].bounds_min );
+	root.grow( nodes[0].bounds_max );
+	float root_area = root.getSurfaceArea();
+
+	return root_area > 0.0f ? cost / root_area : 0.0f;
+}
+
+float BVH2::getBuildSAHCost( void ) const
+{
+	return build_sah_cost;
+}
+
+const std::vector<BVHLinearNode>& BVH2::getNodes( void ) const
+{
+	return nodes;
+}
+
+const std::vector<KDTriRecord>& BVH2::getLeafTris( void ) const
+{
+	return leaf_tris;
+}
+
+const std::vector<BVHSphereRecord>& BVH2::getLeafSpheres( void ) const
+{
+	return leaf_spheres;
+}
+
+
+////////////////////////////////////////////////////
+// Binned SAH build.
+////////////////////////////////////////////////////
+
+// Builds the subtree over prims[start, end) straight into the flat node array, depth first, and returns its index.
+int BVH2::buildRecursive( std::vector<BVHBuildPrim> &prims, int start, int end, int depth )
+{
+	BVHBounds bounds, centroid_bounds;
+	for ( int i = start; i < end; ++i ) {
+		bounds.grow( prims[i].bounds );
+		centroid_bounds.grow( prims[i].centroid );
+	}
+
+	int num_prims = end - start;
+	if ( num_prims == 1 ) {
+		return makeLeaf( prims, start, end, bounds );
+	}
+
+	int split_axis = centroid_bounds.getLongestAxis();
+	int mid;
+
+	// All centroids in one point, nothing left to bin.
+	if ( centroid_bounds.max[split_axis] <= centroid_bounds.min[split_axis] ) {
+		if ( num_prims <= BVH_MAX_LEAF_TRIS ) {
+			return makeLeaf( prims, start, end, bounds );
+		}
+		mid = start + num_prims / 2;
+	}
+	else if ( depth >= BVH_MAX_DEPTH ) {
+		mid = start + num_prims / 2;
+		std::nth_element( prims.begin() + start, prims.begin() + mid, prims.begin() + end, [split_axis]( const BVHBuildPrim &a, const BVHBuildPrim &b ) {
+			return a.centroid[split_axis] < b.centroid[split_axis];
+		} );
+	}
+	else {
+		int split_bin;
+		bool split = findSplitBinned( prims, start, end, bounds, centroid_bounds, split_axis, split_bin );
+
+		if ( !split ) {
+			return makeLeaf( prims, start, end, bounds );
+		}
+
+		auto it = std::partition( prims.begin() + start, prims.begin() + end, [&]( const BVHBuildPrim &prim ) {
+			return getCentroidBin( prim.centroid, centroid_bounds, split_axis ) < split_bin;
+		} );
+		mid = (int)( it - prims.begin() );
+	}
+
+	int node_index = (int)nodes.size();
+	nodes.emplace_back();
+
+	buildRecursive( prims, start, mid, depth + 1 );
+	int second_child = buildRecursive( prims, mid, end, depth + 1 );
+
+	BVHLinearNode &node = nodes[node_index];
+	node.bounds_min = bounds.min;
+	node.bounds_max = bounds.max;
+	node.second_child = second_child;
+	node.num_prims = 0;
+	node.axis = (uint8_t)split_axis;
+
+	return node_index;
+}
+
+// Finds the cheapest bin border over all three axes. Returns false if a leaf is cheaper, which is only allowed
+// for nodes small enough to become one.
+bool BVH2::findSplitBinned( const std::vector<BVHBuildPrim> &prims, int start, int end, const BVHBounds &bounds, const BVHBounds &centroid_bounds, int &split_axis, int &split_bin ) const
+{
+	int num_prims = end - start;
+	float min_cost = std::numeric_limits<float>::max();
+
+	for ( int axis = 0; axis < 3; ++axis ) {
+		if ( centroid_bounds.max[axis] <= centroid_bounds.min[axis] ) {
+			continue;
+		}
+
+		BVHBin bins[BVH_NUM_BINS];
+		for ( int i = start; i < end; ++i ) {
+			BVHBin &bin = bins[getCentroidBin( prims[i].centroid, centroid_bounds, axis )];
+			bin.bounds.grow( prims[i].bounds );
+			++bin.count;
+		}
+
+		// Sweep from the right to get the area and count of everything above each border.
+		float right_area[BVH_NUM_BINS];
+		int right_count[BVH_NUM_BINS];
+		BVHBounds acc_bounds;
+		int acc_count = 0;
+		for ( int b = BVH_NUM_BINS - 1; b > 0; --b ) {
+			acc_bounds.grow( bins[b].bounds );
+			acc_count += bins[b].count;
+			right_area[b] = acc_bounds.getSurfaceArea();
+			right_count[b] = acc_count;
+		}
+
+		acc_bounds = BVHBounds();
+		acc_count = 0;
+		for ( int b = 1; b < BVH_NUM_BINS; ++b ) {
+			acc_bounds.grow( bins[b - 1].bounds );
+			acc_count += bins[b - 1].count;
+
+			if ( acc_count == 0 || right_count[b] == 0 ) {
+				continue;
+			}
+
+			float cost = acc_bounds.getSurfaceArea() * acc_count + right_area[b] * right_count[b];
+			if ( cost < min_cost ) {
+				min_cost = cost;
+				split_axis = axis;
+				split_bin = b;
+			}
+		}
+	}
+
+	float area = bounds.getSurfaceArea();
+	float split_cost = BVH_COST_TRAVERSAL + BVH_COST_INTERSECT * ( area > 0.0f ? min_cost / area : 0.0f );
+	float leaf_cost = BVH_COST_INTERSECT * num_prims;
+
+	if ( num_prims <= BVH_MAX_LEAF_TRIS && leaf_cost <= split_cost ) {
+		return false;
+	}
+
+	return min_cost < std::numeric_limits<float>::max();
+}
+
+// Leaves hold one primitive type. A range mixing triangles and spheres becomes an inner node over a triangle
+// leaf and a sphere leaf.
+int BVH2::makeLeaf( std::vector<BVHBuildPrim> &prims, int start, int end, const BVHBounds &bounds )
+{
+	auto it = std::partition( prims.begin() + start, prims.begin() + end, [this]( const BVHBuildPrim &prim ) {
+		return prim.prim_index < num_tris;
+	} );
+	int mid = (int)( it - prims.begin() );
+
+	int node_index = (int)nodes.size();
+	nodes.emplace_back();
+
+	if ( mid > start && mid < end ) {
+		BVHBounds tri_bounds, sphere_bounds;
+		for ( int i = start; i < mid; ++i )
+			tri_bounds.grow( prims[i].bounds );
+		for ( int i = mid; i < end; ++i )
+			sphere_bounds.grow( prims[i].bounds );
+
+		makeLeaf( prims, start, mid, tri_bounds );
+		int second_child = makeLeaf( prims, mid, end, sphere_bounds );
+
+		BVHLinearNode &node = nodes[node_index];
+		node.bounds_min = bounds.min;
+		node.bounds_max = bounds.max;
+		node.second_child = second_child;
+		node.num_prims = 0;
+		node.axis = (uint8_t)bounds.getLongestAxis();
+		return node_index;
+	}
+
+	BVHLinearNode &node = nodes[node_index];
+	node.bounds_min = bounds.min;
+	node.bounds_max = bounds.max;
+	node.prim_offset = start;
+	node.num_prims = (uint16_t)( end - start );
+	node.axis = 0;
+	node.prim_type = (uint8_t)( mid > start ? BVH_PRIM_TRIANGLES : BVH_PRIM_SPHERES );
+	return node_index;
+}
+
+
+// Parents precede their children in the node array, so one forward pass hands every node its depth.
+void BVH2::initNodeLevels( void )
+{
+	node_levels.clear();
+
+	std::vector<int> depth( nodes.size(), 0 );
+	for ( int i = 0; i < (int)nodes.size(); ++i ) {
+		if ( depth[i] >= (int)node_levels.size() )
+			node_levels.resize( depth[i] + 1 );
+		node_levels[depth[i]].push_back( i );
+
+		if ( !nodes[i].isLeaf() ) {
+			depth[i + 1] = depth[i] + 1;
+			depth[nodes[i].second_child] = depth[i] + 1;
+		}
+	}
+
+	// Deepest level first, so both children are classified before their parent.
+	std::vector<uint8_t> has_spheres( nodes.size(), 0 );
+	sphere_node_levels.assign( node_levels.size(), std::vector<int>() );
+	for ( int level = (int)node_levels.size() - 1; level >= 0; --level ) {
+		for ( int i : node_levels[level] ) {
+			const BVHLinearNode &node = nodes[i];
+			has_spheres[i] = node.isLeaf() ? node.prim_type == BVH_PRIM_SPHERES : ( has_spheres[i + 1] | has_spheres[node.second_child] );
+			if ( has_spheres[i] )
+				sphere_node_levels[level].push_back( i );
+		}
+	}
+}
+
+
+////////////////////////////////////////////////////
+// LBVH build.
+////////////////////////////////////////////////////
+
+// Sorts the primitives along a Morton curve over their centroids and derives the binary radix tree of the codes,
+// every inner node in parallel and independently of the others (Karras, "Maximizing Parallelism in the
+// Construction of BVHs, Octrees, and k-d Trees"). Equal codes are told apart by position, so the tree is at most
+// 3 * BVH_MORTON_BITS + log2(num_prims) deep, within BVH_STACK_SIZE. Subtrees of up to BVH_MAX_LEAF_TRIS
+// primitives of one type become leaves.
+void BVH2::buildLBVH( std::vector<BVHBuildPrim> &prims )
+{
+	int n = (int)prims.size();
+
+	BVHBounds centroid_bounds = std::transform_reduce( std::execution::par, prims.begin(), prims.end(), BVHBounds(),
+		[]( BVHBounds a, const BVHBounds &b ) { a.grow( b ); return a; },
+		[]( const BVHBuildPrim &prim ) { BVHBounds b; b.grow( prim.centroid ); return b; } );
+
+	std::vector<uint32_t> codes( n );
+	std::vector<int> order( n );
+	std::transform( std::execution::par, prims.begin(), prims.end(), codes.begin(), [&centroid_bounds]( const BVHBuildPrim &prim ) {
+		return getMortonCode( prim.centroid, centroid_bounds );
+	} );
+	std::iota( order.begin(), order.end(), 0 );
+	radixSort( codes, order );
+
+	std::vector<BVHBuildPrim> sorted_prims( n );
+	std::transform( std::execution::par, order.begin(), order.end(), sorted_prims.begin(), [&prims]( int i ) {
+		return prims[i];
+	} );
+	prims.swap( sorted_prims );
+
+	// Length of the common prefix of the keys at i and j, -1 outside the array.
+	auto delta = [&codes, n]( int i, int j ) {
+		if ( j < 0 || j >= n )
+			return -1;
+		uint32_t diff = codes[i] ^ codes[j];
+		return diff ? countLeadingZeros( diff ) : 32 + countLeadingZeros( (uint32_t)( i ^ j ) );
+	};
+
+	// Inner node i and leaf i both start at position i, one index array serves both passes.
+	std::vector<BVHRadixNode> radix_nodes( n - 1 );
+	std::vector<int> inner_parent( n - 1, -1 );
+	std::vector<int> leaf_parent( n, -1 );
+	std::vector<int> indices( n );
+	std::iota( indices.begin(), indices.end(), 0 );
+
+	std::for_each( std::execution::par, indices.begin(), indices.end() - 1, [&]( int i ) {
+		// The range grows in the direction of the neighbor sharing the longer prefix.
+		int d = delta( i, i + 1 ) > delta( i, i - 1 ) ? 1 : -1;
+		int delta_min = delta( i, i - d );
+
+		int max_length = 2;
+		while ( delta( i, i + max_length * d ) > delta_min )
+			max_length *= 2;
+
+		int length = 0;
+		for ( int t = max_length / 2; t >= 1; t /= 2 ) {
+			if ( delta( i, i + ( length + t ) * d ) > delta_min )
+				length += t;
+		}
+		int j = i + length * d;
+
+		// Binary search for the last key sharing more than the range's common prefix with i.
+		int delta_node = delta( i, j );
+		int split = 0;
+		int t = length;
+		do {
+			t = ( t + 1 ) / 2;
+			if ( delta( i, i + ( split + t ) * d ) > delta_node )
+				split += t;
+		} while ( t > 1 );
+		int gamma = i + split * d + std::min( d, 0 );
+
+		BVHRadixNode &node = radix_nodes[i];
+		node.first = std::min( i, j );
+		node.last = std::max( i, j );
+		node.child[0] = node.first == gamma ? ~gamma : gamma;
+		node.child[1] = node.last == gamma + 1 ? ~( gamma + 1 ) : gamma + 1;
+		for ( int c = 0; c < 2; ++c ) {
+			if ( node.child[c] < 0 )
+				leaf_parent[~node.child[c]] = i;
+			else
+				inner_parent[node.child[c]] = i;
+		}
+
+		// The highest differing bit was chosen by the split, x, y and z take turns from the top.
+		uint32_t diff = codes[gamma] ^ codes[gamma + 1];
+		node.split_axis = diff ? 2 - ( 31 - countLeadingZeros( diff ) ) % 3 : 0;
+	} );
+
+	// Subtree data bottom-up, one walk per leaf. Of the two walks reaching a node the second one finds both children
+	// done, merges them and goes on to the parent, the first one stops there. A subtree of up to BVH_MAX_LEAF_TRIS
+	// primitives of one type flattens to a single leaf.
+	auto primTypes = [&]( int child ) {
+		if ( child >= 0 )
+			return radix_nodes[child].prim_types;
+		return 1 << ( prims[~child].prim_index < num_tris ? BVH_PRIM_TRIANGLES : BVH_PRIM_SPHERES );
+	};
+	auto numFlatNodes = [&]( int child ) {
+		return child < 0 ? 1 : radix_nodes[child].num_flat_nodes;
+	};
+
+	std::vector<std::atomic<int>> arrivals( n - 1 );
+	std::for_each( std::execution::par, indices.begin(), indices.end(), [&]( int leaf ) {
+		for ( int i = leaf_parent[leaf]; i >= 0; i = inner_parent[i] ) {
+			if ( arrivals[i].fetch_add( 1, std::memory_order_acq_rel ) == 0 )
+				break;
+
+			BVHRadixNode &node = radix_nodes[i];
+			node.bounds = BVHBounds();
+			for ( int c = 0; c < 2; ++c )
+				node.bounds.grow( node.child[c] < 0 ? prims[~node.child[c]].bounds : radix_nodes[node.child[c]].bounds );
+
+			node.prim_types = primTypes( node.child[0] ) | primTypes( node.child[1] );
+			bool single_type = ( node.prim_types & ( node.prim_types - 1 ) ) == 0;
+			node.num_flat_nodes = node.last - node.first < BVH_MAX_LEAF_TRIS && single_type ? 1 : 1 + numFlatNodes( node.child[0] ) + numFlatNodes( node.child[1] );
+		}
+	} );
+
+	// Flatten depth first, so first children directly follow their parent. The subtree sizes fix every node's
+	// position up front, a second child starts right after its sibling's subtree. Subtrees of up to
+	// BVH_FLATTEN_TASK_NODES nodes are left to parallel tasks, the rest of the tree is flattened first.
+	struct EmitEntry {
+		int child;
+		int node_index;
+	};
+	auto flatten = [&]( EmitEntry root_entry, std::vector<EmitEntry> *subtree_tasks ) {
+		std::vector<EmitEntry> stack( 1, root_entry );
+		while ( !stack.empty() ) {
+			EmitEntry entry = stack.back();
+			stack.pop_back();
+
+			int num_flat_nodes = numFlatNodes( entry.child );
+			if ( subtree_tasks && num_flat_nodes <= BVH_FLATTEN_TASK_NODES ) {
+				subtree_tasks->push_back( entry );
+				continue;
+			}
+
+			const BVHBounds &bounds = entry.child < 0 ? prims[~entry.child].bounds : radix_nodes[entry.child].bounds;
+
+			BVHLinearNode &node = nodes[entry.node_index];
+			node.bounds_min = bounds.min;
+			node.bounds_max = bounds.max;
+			if ( num_flat_nodes == 1 ) {
+				int first = entry.child < 0 ? ~entry.child : radix_nodes[entry.child].first;
+				int last = entry.child < 0 ? ~entry.child : radix_nodes[entry.child].last;
+				node.prim_offset = first;
+				node.num_prims = (uint16_t)( last - first + 1 );
+				node.axis = 0;
+				node.prim_type = (uint8_t)( prims[first].prim_index < num_tris ? BVH_PRIM_TRIANGLES : BVH_PRIM_SPHERES );
+				continue;
+			}
+
+			const BVHRadixNode &radix_node = radix_nodes[entry.child];
+			node.second_child = entry.node_index + 1 + numFlatNodes( radix_node.child[0] );
+			node.num_prims = 0;
+			node.axis = (uint8_t)radix_node.split_axis;
+
+			stack.push_back( { radix_node.child[1], node.second_child } );
+			stack.push_back( { radix_node.child[0], entry.node_index + 1 } );
+		}
+	};
+
+	EmitEntry root_entry = { n > 1 ? 0 : ~0, 0 };
+	nodes.resize( numFlatNodes( root_entry.child ) );
+
+	std::vector<EmitEntry> subtree_tasks;
+	flatten( root_entry, &subtree_tasks );
+	std::for_each( std::execution::par, subtree_tasks.begin(), subtree_tasks.end(), [&]( const EmitEntry &entry ) {
+		flatten( entry, NULL );
+	} );
+}
+
+
+////////////////////////////////////////////////////
+// Refit.
+////////////////////////////////////////////////////
+
+void BVH2::refit( const glm::uvec3 *tris, const glm::vec3 *verts, const glm::vec4 *spheres )
+{
+	Walnut::Timer timer;
+
+	std::for_each( std::execution::par, leaf_tris.begin(), leaf_tris.end(), [tris, verts]( KDTriRecord &tri ) {
+		const glm::uvec3 &indices = tris[tri.tri_index];
+		tri.v0 = verts[indices[0]];
+		tri.e1 = verts[indices[1]] - verts[indices[0]];
+		tri.e2 = verts[indices[2]] - verts[indices[0]];
+	} );
+
+	refitSphereRecords( spheres );
+	refitLevels( node_levels, tris, verts );
+
+	sah_cost = computeSAHCost();
+	refit_time = timer.ElapsedMillis();
+}
+
+void BVH2::refitSpheres( const glm::vec4 *spheres )
+{
+	Walnut::Timer timer;
+
+	refitSphereRecords( spheres );
+	refitLevels( sphere_node_levels, NULL, NULL );
+
+	sah_cost = computeSAHCost();
+	refit_time = timer.ElapsedMillis();
+}
+
+void BVH2::refitSphereRecords( const glm::vec4 *spheres )
+{
+	std::for_each( std::execution::par, leaf_spheres.begin(), leaf_spheres.end(), [spheres]( BVHSphereRecord &sphere ) {
+		sphere.center = glm::vec3( spheres[sphere.sphere_index] );
+		sphere.radius = spheres[sphere.sphere_index].w;
+	} );
+}
+
+// Nodes of one level only read the level below, so each level is refitted in parallel, deepest first.
+void BVH2::refitLevels( const std::vector<std::vector<int>> &levels, const glm::uvec3 *tris, const glm::vec3 *verts )
+{
+	for ( int level = (int)levels.size() - 1; level >= 0; --level ) {
+		std::for_each( std::execution::par, levels[level].begin(), levels[level].end(), [this, tris, verts]( int node_index ) {
+			refitNode( node_index, tris, verts );
+		} );
+	}
+}
+
+// Leaves take the bounds of their primitives, inner nodes the union of their children. tris and verts are only
+// read for triangle leaves.
+void BVH2::refitNode( int node_index, const glm::uvec3 *tris, const glm::vec3 *verts )
+{
+	BVHLinearNode &node = nodes[node_index];
+	BVHBounds bounds;
+
+	if ( !node.isLeaf() ) {
+		const BVHLinearNode &first = nodes[node_index + 1];
+		const BVHLinearNode &second = nodes[node.second_child];
+		bounds.grow( first.bounds_min );
+		bounds.grow( first.bounds_max );
+		bounds.grow( second.bounds_min );
+		bounds.grow( second.bounds_max );
+	}
+	else if ( node.prim_type == BVH_PRIM_SPHERES ) {
+		for ( int i = 0; i < node.num_prims; ++i ) {
+			const BVHSphereRecord &sphere = leaf_spheres[node.prim_offset + i];
+			bounds.grow( sphere.center - sphere.radius );
+			bounds.grow( sphere.center + sphere.radius );
+		}
+	}
+	else {
+		for ( int i = 0; i < node.num_prims; ++i ) {
+			const glm::uvec3 &tri = tris[leaf_tris[node.prim_offset + i].tri_index];
+			bounds.grow( verts[tri[0]] );
+			bounds.grow( verts[tri[1]] );
+			bounds.grow( verts[tri[2]] );
+		}
+	}
+
+	node.bounds_min = bounds.min;
+	node.bounds_max = bounds.max;
+}
+
+
+////////////////////////////////////////////////////
+// Traversal.
+////////////////////////////////////////////////////
+
+// Slab test against near and far planes picked by the direction signs. An axis the ray runs parallel to gives
+// +-inf, or NaN for an origin exactly on the slab boundary. NaN fails both comparisons and leaves the interval
+// untouched, so such a ray counts as inside the slab.
+bool BVH2::intersectBounds( const BVHLinearNode &node, const glm::vec3 &origin, const glm::vec3 &inv_dir, const int dir_is_neg[3], float t_min, float t_max ) const
+{
+	for ( int axis = 0; axis < 3; ++axis ) {
+		float t_near = ( ( dir_is_neg[axis] ? node.bounds_max[axis] : node.bounds_min[axis] ) - origin[axis] ) * inv_dir[axis];
+		float t_far = ( ( dir_is_neg[axis] ? node.bounds_min[axis] : node.bounds_max[axis] ) - origin[axis] ) * inv_dir[axis] * BVH_SLAB_EXIT_SCALE;
+
+		if ( t_near > t_min ) t_min = t_near;
+		if ( t_far < t_max ) t_max = t_far;
+	}
+
+	return t_min <= t_max;
+}
+
+
+// Ordered traversal: the child on the near side of the split axis goes first, the other one onto the stack.
+// Nodes are culled against the closest hit found so far.
+bool BVH2::closestHit( Ray* ray, float& t, uint32_t& prim_id, float& u, float& v ) const
+{
+	t = ray->TMax;
+	if ( nodes.empty() )
+		return false;
+
+	glm::vec3 inv_dir = 1.0f / ray->Direction;
+	int dir_is_neg[3] = { inv_dir.x < 0.0f, inv_dir.y < 0.0f, inv_dir.z < 0.0f };
+
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	int node_index = 0;
+
+	bool intersection_detected = false;
+
+	while ( true ) {
+		const BVHLinearNode &node = nodes[node_index];
+
+		if ( intersectBounds( node, ray->Origin, inv_dir, dir_is_neg, ray->TMin, t ) ) {
+			if ( !node.isLeaf() ) {
+				if ( dir_is_neg[node.axis] ) {
+					stack[stack_size++] = node_index + 1;
+					node_index = node.second_child;
+				}
+				else {
+					stack[stack_size++] = node.second_child;
+					node_index = node_index + 1;
+				}
+				continue;
+			}
+
+			if ( node.prim_type == BVH_PRIM_SPHERES ) {
+				for ( int i = 0; i < node.num_prims; ++i ) {
+					const BVHSphereRecord &sphere = leaf_spheres[node.prim_offset + i];
+
+					float tmp_t;
+					if ( Intersections::sphereIntersect( ray, sphere.center, sphere.radius, tmp_t ) && tmp_t < t && tmp_t >= ray->TMin ) {
+						intersection_detected = true;
+						t = tmp_t;
+						prim_id = ACCEL_PRIM_SPHERE_BIT | sphere.sphere_index;
+						u = 0.0f;
+						v = 0.0f;
+					}
+				}
+			}
+			else {
+				for ( int i = 0; i < node.num_prims; ++i ) {
+					const KDTriRecord &tri = leaf_tris[node.prim_offset + i];
+
+					float tmp_t, tmp_u, tmp_v;
+					if ( Intersections::triIntersect( ray, tri, tmp_t, tmp_u, tmp_v ) && tmp_t < t && tmp_t >= ray->TMin ) {
+						intersection_detected = true;
+						t = tmp_t;
+						prim_id = tri.tri_index;
+						u = tmp_u;
+						v = tmp_v;
+					}
+				}
+			}
+		}
+
+		if ( stack_size == 0 )
+			break;
+		node_index = stack[--stack_size];
+	}
+
+	return intersection_detected;
+}
+
+bool BVH2::occluded( Ray* ray, float t_max ) const
+{
+	if ( nodes.empty() )
+		return false;
+
+	glm::vec3 inv_dir = 1.0f / ray->Direction;
+	int dir_is_neg[3] = { inv_dir.x < 0.0f, inv_dir.y < 0.0f, inv_dir.z < 0.0f };
+
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	int node_index = 0;
+
+	while ( true ) {
+		const BVHLinearNode &node = nodes[node_index];
+
+		if ( intersectBounds( node, ray->Origin, inv_dir, dir_is_neg, ray->TMin, t_max ) ) {
+			if ( !node.isLeaf() ) {
+				if ( dir_is_neg[node.axis] ) {
+					stack[stack_size++] = node_index + 1;
+					node_index = node.second_child;
+				}
+				else {
+					stack[stack_size++] = node.second_child;
+					node_index = node_index + 1;
+				}
+				continue;
+			}
+
+			for ( int i = 0; i < node.num_prims; ++i ) {
+				if ( node.prim_type == BVH_PRIM_SPHERES ) {
+					const BVHSphereRecord &sphere = leaf_spheres[node.prim_offset + i];
+					if ( Intersections::sphereOccluded( ray, sphere.center, sphere.radius, ray->TMin, t_max ) ) {
+						return true;
+					}
+				}
+				else if ( Intersections::triOccluded( ray, leaf_tris[node.prim_offset + i], ray->TMin, t_max ) ) {
+					return true;
+				}
+			}
+		}
+
+		if ( stack_size == 0 )
+			return false;
+		node_index = stack[--stack_size];
+	}
+}
+
+
+////////////////////////////////////////////////////
+// Packet traversal.
+////////////////////////////////////////////////////
+#if KD_USE_SSE
+
+namespace {
+	const int PACKET_GROUPS = RayPacket::Size / 4;
+
+	// Packet-wide bounds of a packet sharing one origin and the direction signs: the inverse directions span
+	// [inv_min, inv_max] per axis, so the entry/exit distances of all rays lie within interval products.
+	struct PacketInterval
+	{
+		bool valid;
+		glm::vec3 origin;
+		glm::vec3 inv_min, inv_max;
+		int dir_is_neg[3];
+		float t_min;
+	};
+
+	PacketInterval getPacketInterval( const RayPacket &packet )
+	{
+		PacketInterval interval;
+		interval.valid = true;
+		interval.origin = glm::vec3( packet.OriginX[0], packet.OriginY[0], packet.OriginZ[0] );
+		interval.inv_min = glm::vec3( std::numeric_limits<float>::max() );
+		interval.inv_max = glm::vec3( -std::numeric_limits<float>::max() );
+		interval.t_min = std::numeric_limits<float>::max();
+
+		const float *inv_dirs[3] = { packet.DirectionInverseX, packet.DirectionInverseY, packet.DirectionInverseZ };
+		for ( int axis = 0; axis < 3; ++axis ) {
+			interval.dir_is_neg[axis] = inv_dirs[axis][0] < 0.0f;
+		}
+
+		for ( int i = 0; i < RayPacket::Size; ++i ) {
+			// Inactive lanes don't constrain anything.
+			if ( packet.TMin[i] > packet.T[i] )
+				continue;
+
+			glm::vec3 origin( packet.OriginX[i], packet.OriginY[i], packet.OriginZ[i] );
+			if ( origin != interval.origin )
+				interval.valid = false;
+
+			for ( int axis = 0; axis < 3; ++axis ) {
+				if ( ( inv_dirs[axis][i] < 0.0f ) != ( interval.dir_is_neg[axis] != 0 ) )
+					interval.valid = false;
+				interval.inv_min[axis] = std::min( interval.inv_min[axis], inv_dirs[axis][i] );
+				interval.inv_max[axis] = std::max( interval.inv_max[axis], inv_dirs[axis][i] );
+			}
+			interval.t_min = std::min( interval.t_min, packet.TMin[i] );
+		}
+
+		return interval;
+	}
+
+	// True if no ray of the packet can enter the node before t_max.
+	inline bool cullPacketInterval( const BVHLinearNode &node, const PacketInterval &interval, float t_max )
+	{
+		float enter = interval.t_min;
+		float exit = t_max;
+
+		for ( int axis = 0; axis < 3; ++axis ) {
+			float near_plane = ( interval.dir_is_neg[axis] ? node.bounds_max[axis] : node.bounds_min[axis] ) - interval.origin[axis];
+			float far_plane = ( interval.dir_is_neg[axis] ? node.bounds_min[axis] : node.bounds_max[axis] ) - interval.origin[axis];
+
+			float t_near = std::min( near_plane * interval.inv_min[axis], near_plane * interval.inv_max[axis] );
+			float t_far = std::max( far_plane * interval.inv_min[axis], far_plane * interval.inv_max[axis] ) * BVH_SLAB_EXIT_SCALE;
+
+			if ( t_near > enter ) enter = t_near;
+			if ( t_far < exit ) exit = t_far;
+		}
+
+		return enter > exit;
+	}
+
+	// Per-ray slab test of four rays, near/far planes selected per lane by the direction sign.
+	inline int intersectBounds4( const BVHLinearNode &node, const RayPacket &packet, int first )
+	{
+		__m128 enter = _mm_load_ps( &packet.TMin[first] );
+		__m128 exit = _mm_load_ps( &packet.T[first] );
+
+		const float *origins[3] = { packet.OriginX, packet.OriginY, packet.OriginZ };
+		const float *inv_dirs[3] = { packet.DirectionInverseX, packet.DirectionInverseY, packet.DirectionInverseZ };
+
+		for ( int axis = 0; axis < 3; ++axis ) {
+			__m128 o = _mm_load_ps( &origins[axis][first] );
+			__m128 inv = _mm_load_ps( &inv_dirs[axis][first] );
+			__m128 neg = _mm_cmplt_ps( inv, _mm_setzero_ps() );
+			__m128 b_min = _mm_set1_ps( node.bounds_min[axis] );
+			__m128 b_max = _mm_set1_ps( node.bounds_max[axis] );
+
+			__m128 near_plane = _mm_or_ps( _mm_and_ps( neg, b_max ), _mm_andnot_ps( neg, b_min ) );
+			__m128 far_plane = _mm_or_ps( _mm_and_ps( neg, b_min ), _mm_andnot_ps( neg, b_max ) );
+
+			// NaN from 0 * inf keeps the running value, see BVH2::intersectBounds().
+			enter = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( near_plane, o ), inv ), enter );
+			exit = _mm_min_ps( _mm_mul_ps( _mm_mul_ps( _mm_sub_ps( far_plane, o ), inv ), _mm_set1_ps( BVH_SLAB_EXIT_SCALE ) ), exit );
+		}
+
+		return _mm_movemask_ps( _mm_cmple_ps( enter, exit ) );
+	}
+
+	// Moller-Trumbore of one triangle against four rays, same operations as the scalar record test.
+	inline void intersectTri4( const KDTriRecord &tri, RayPacket &packet, int first )
+	{
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps( 1.0f );
+		const __m128 eps = _mm_set1_ps( 0.00001f );
+		const __m128 abs_mask = _mm_castsi128_ps( _mm_set1_epi32( 0x7fffffff ) );
+
+		__m128 dx = _mm_load_ps( &packet.DirectionX[first] );
+		__m128 dy = _mm_load_ps( &packet.DirectionY[first] );
+		__m128 dz = _mm_load_ps( &packet.DirectionZ[first] );
+
+		__m128 e1x = _mm_set1_ps( tri.e1.x ), e1y = _mm_set1_ps( tri.e1.y ), e1z = _mm_set1_ps( tri.e1.z );
+		__m128 e2x = _mm_set1_ps( tri.e2.x ), e2y = _mm_set1_ps( tri.e2.y ), e2z = _mm_set1_ps( tri.e2.z );
+
+		// h = d x e2
+		__m128 hx = _mm_sub_ps( _mm_mul_ps( dy, e2z ), _mm_mul_ps( dz, e2y ) );
+		__m128 hy = _mm_sub_ps( _mm_mul_ps( dz, e2x ), _mm_mul_ps( dx, e2z ) );
+		__m128 hz = _mm_sub_ps( _mm_mul_ps( dx, e2y ), _mm_mul_ps( dy, e2x ) );
+
+		__m128 a = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1x, hx ), _mm_mul_ps( e1y, hy ) ), _mm_mul_ps( e1z, hz ) );
+		__m128 mask = _mm_cmpge_ps( _mm_and_ps( a, abs_mask ), eps );
+		if ( _mm_movemask_ps( mask ) == 0 )
+			return;
+
+		__m128 f = _mm_div_ps( one, a );
+		__m128 sx = _mm_sub_ps( _mm_load_ps( &packet.OriginX[first] ), _mm_set1_ps( tri.v0.x ) );
+		__m128 sy = _mm_sub_ps( _mm_load_ps( &packet.OriginY[first] ), _mm_set1_ps( tri.v0.y ) );
+		__m128 sz = _mm_sub_ps( _mm_load_ps( &packet.OriginZ[first] ), _mm_set1_ps( tri.v0.z ) );
+
+		__m128 u = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( sx, hx ), _mm_mul_ps( sy, hy ) ), _mm_mul_ps( sz, hz ) ) );
+		mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpge_ps( u, zero ), _mm_cmple_ps( u, one ) ) );
+
+		// q = s x e1
+		__m128 qx = _mm_sub_ps( _mm_mul_ps( sy, e1z ), _mm_mul_ps( sz, e1y ) );
+		__m128 qy = _mm_sub_ps( _mm_mul_ps( sz, e1x ), _mm_mul_ps( sx, e1z ) );
+		__m128 qz = _mm_sub_ps( _mm_mul_ps( sx, e1y ), _mm_mul_ps( sy, e1x ) );
+
+		__m128 v = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, qx ), _mm_mul_ps( dy, qy ) ), _mm_mul_ps( dz, qz ) ) );
+		mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpge_ps( v, zero ), _mm_cmple_ps( _mm_add_ps( u, v ), one ) ) );
+
+		__m128 t = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x, qx ), _mm_mul_ps( e2y, qy ) ), _mm_mul_ps( e2z, qz ) ) );
+		mask = _mm_and_ps( mask, _mm_cmpgt_ps( t, eps ) );
+		mask = _mm_and_ps( mask, _mm_cmpge_ps( t, _mm_load_ps( &packet.TMin[first] ) ) );
+		mask = _mm_and_ps( mask, _mm_cmplt_ps( t, _mm_load_ps( &packet.T[first] ) ) );
+
+		int hits = _mm_movemask_ps( mask );
+		if ( hits == 0 )
+			return;
+
+		_mm_store_ps( &packet.T[first], _mm_or_ps( _mm_and_ps( mask, t ), _mm_andnot_ps( mask, _mm_load_ps( &packet.T[first] ) ) ) );
+		_mm_store_ps( &packet.U[first], _mm_or_ps( _mm_and_ps( mask, u ), _mm_andnot_ps( mask, _mm_load_ps( &packet.U[first] ) ) ) );
+		_mm_store_ps( &packet.V[first], _mm_or_ps( _mm_and_ps( mask, v ), _mm_andnot_ps( mask, _mm_load_ps( &packet.V[first] ) ) ) );
+
+		for ( int i = 0; i < 4; ++i ) {
+			if ( hits & ( 1 << i ) ) {
+				packet.PrimId[first + i] = tri.tri_index;
+				packet.Hit[first + i] = true;
+			}
+		}
+	}
+
+	// Nearest root of the ray/sphere quadratic for four rays, as in Intersections::sphereIntersect().
+	inline void intersectSphere4( const BVHSphereRecord &sphere, RayPacket &packet, int first )
+	{
+		__m128 dx = _mm_load_ps( &packet.DirectionX[first] );
+		__m128 dy = _mm_load_ps( &packet.DirectionY[first] );
+		__m128 dz = _mm_load_ps( &packet.DirectionZ[first] );
+		__m128 ox = _mm_sub_ps( _mm_load_ps( &packet.OriginX[first] ), _mm_set1_ps( sphere.center.x ) );
+		__m128 oy = _mm_sub_ps( _mm_load_ps( &packet.OriginY[first] ), _mm_set1_ps( sphere.center.y ) );
+		__m128 oz = _mm_sub_ps( _mm_load_ps( &packet.OriginZ[first] ), _mm_set1_ps( sphere.center.z ) );
+
+		__m128 a = _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, dx ), _mm_mul_ps( dy, dy ) ), _mm_mul_ps( dz, dz ) );
+		__m128 b = _mm_mul_ps( _mm_set1_ps( 2.0f ), _mm_add_ps( _mm_add_ps( _mm_mul_ps( ox, dx ), _mm_mul_ps( oy, dy ) ), _mm_mul_ps( oz, dz ) ) );
+		__m128 c = _mm_sub_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( ox, ox ), _mm_mul_ps( oy, oy ) ), _mm_mul_ps( oz, oz ) ), _mm_set1_ps( sphere.radius * sphere.radius ) );
+
+		__m128 discriminant = _mm_sub_ps( _mm_mul_ps( b, b ), _mm_mul_ps( _mm_mul_ps( _mm_set1_ps( 4.0f ), a ), c ) );
+		__m128 mask = _mm_cmpge_ps( discriminant, _mm_setzero_ps() );
+		if ( _mm_movemask_ps( mask ) == 0 )
+			return;
+
+		__m128 t = _mm_div_ps( _mm_sub_ps( _mm_sub_ps( _mm_setzero_ps(), b ), _mm_sqrt_ps( discriminant ) ), _mm_add_ps( a, a ) );
+		mask = _mm_and_ps( mask, _mm_cmpge_ps( t, _mm_load_ps( &packet.TMin[first] ) ) );
+		mask = _mm_and_ps( mask, _mm_cmplt_ps( t, _mm_load_ps( &packet.T[first] ) ) );
+
+		int hits = _mm_movemask_ps( mask );
+		if ( hits == 0 )
+			return;
+
+		_mm_store_ps( &packet.T[first], _mm_or_ps( _mm_and_ps( mask, t ), _mm_andnot_ps( mask, _mm_load_ps( &packet.T[first] ) ) ) );
+
+		for ( int i = 0; i < 4; ++i ) {
+			if ( hits & ( 1 << i ) ) {
+				packet.PrimId[first + i] = ACCEL_PRIM_SPHERE_BIT | sphere.sphere_index;
+				packet.U[first + i] = 0.0f;
+				packet.V[first + i] = 0.0f;
+				packet.Hit[first + i] = true;
+			}
+		}
+	}
+}
+
+// Packet traversal in the spirit of Wald et al.: one node visit for the whole packet. Nodes are culled with
+// interval arithmetic when the packet shares an origin and direction signs, otherwise (and when that test
+// passes) the groups of four rays are slab tested until the first one with a hit. Children are ordered by
+// the first ray's direction.
+void BVH2::closestHitPacket( RayPacket& packet ) const
+{
+	if ( nodes.empty() ) {
+		for ( int i = 0; i < RayPacket::Size; ++i )
+			packet.Hit[i] = false;
+		return;
+	}
+
+	PacketInterval interval = getPacketInterval( packet );
+	for ( int i = 0; i < RayPacket::Size; ++i )
+		packet.Hit[i] = false;
+
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	int node_index = 0;
+
+	// Farthest distance any ray of the packet still accepts, shrinks as hits are found.
+	float t_max_packet = -std::numeric_limits<float>::max();
+	for ( int i = 0; i < RayPacket::Size; ++i )
+		t_max_packet = std::max( t_max_packet, packet.T[i] );
+
+	while ( true ) {
+		const BVHLinearNode &node = nodes[node_index];
+
+		bool visit = false;
+		if ( !interval.valid || !cullPacketInterval( node, interval, t_max_packet ) ) {
+			for ( int g = 0; g < PACKET_GROUPS && !visit; ++g ) {
+				visit = intersectBounds4( node, packet, g * 4 ) != 0;
+			}
+		}
+
+		if ( visit ) {
+			if ( !node.isLeaf() ) {
+				if ( interval.dir_is_neg[node.axis] ) {
+					stack[stack_size++] = node_index + 1;
+					node_index = node.second_child;
+				}
+				else {
+					stack[stack_size++] = node.second_child;
+					node_index = node_index + 1;
+				}
+				continue;
+			}
+
+			if ( node.prim_type == BVH_PRIM_SPHERES ) {
+				for ( int i = 0; i < node.num_prims; ++i ) {
+					for ( int g = 0; g < PACKET_GROUPS; ++g ) {
+						intersectSphere4( leaf_spheres[node.prim_offset + i], packet, g * 4 );
+					}
+				}
+			}
+			else {
+				for ( int i = 0; i < node.num_prims; ++i ) {
+					for ( int g = 0; g < PACKET_GROUPS; ++g ) {
+						intersectTri4( leaf_tris[node.prim_offset + i], packet, g * 4 );
+					}
+				}
+			}
+
+			t_max_packet = -std::numeric_limits<float>::max();
+			for ( int i = 0; i < RayPacket::Size; ++i )
+				t_max_packet = std::max( t_max_packet, packet.T[i] );
+		}
+
+		if ( stack_size == 0 )
+			break;
+		node_index = stack[--stack_size];
+	}
+}
+
+#else
+
+void BVH2::closestHitPacket( RayPacket& packet ) const
+{
+	Accelerator::closestHitPacket( packet );
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef BVH2_H
+#define BVH2_H
+
+#include <vector>
+#include "BVHStructs.h"
+#include "../Accelerator.h"
+#include "../KDAccel/KDTreeStructs.h"
+
+
+////////////////////////////////////////////////////
+// Constants.
+////////////////////////////////////////////////////
+
+// SAH cost model.
+const float BVH_COST_TRAVERSAL = 1.0f;
+const float BVH_COST_INTERSECT = 1.0f;
+
+const int BVH_NUM_BINS = 16;
+const int BVH_MAX_LEAF_TRIS = 4;
+
+// Below this depth splits follow the SAH, deeper nodes are split at the object median. Bounds the tree depth to
+// BVH_MAX_DEPTH + log2(num_tris), which BVH_STACK_SIZE has to cover.
+const int BVH_MAX_DEPTH = 32;
+const int BVH_STACK_SIZE = 64;
+
+// LBVH build: Morton code bits per axis, and bits sorted per radix sort pass.
+const int BVH_MORTON_BITS = 10;
+const int BVH_RADIX_BITS = 10;
+
+// Smallest slice of the codes one radix sort task histograms and scatters.
+const int BVH_RADIX_MIN_CHUNK = 16384;
+
+// Largest LBVH subtree flattened as one task.
+const int BVH_FLATTEN_TASK_NODES = 4096;
+
+// Refitted trees are rebuilt once their SAH cost exceeds the cost right after the build by this factor.
+const float BVH_REFIT_MAX_SAH_RATIO = 1.5f;
+
+
+////////////////////////////////////////////////////
+// Enums.
+////////////////////////////////////////////////////
+
+enum BVHBuildMode {
+	BVH_BUILD_SAH = 0,	// Binned SAH, top down.
+	BVH_BUILD_LBVH = 1	// Linear BVH: primitives sorted along a Morton curve, the hierarchy read off their codes' prefixes.
+};
+
+
+////////////////////////////////////////////////////
+// BVH2.
+////////////////////////////////////////////////////
+class BVH2 : public Accelerator
+{
+public:
+	// spheres holds center and radius of each sphere, they are indexed together with the triangles.
+	BVH2( int num_tris, glm::uvec3 *tris, glm::vec3 *verts, int num_spheres = 0, const glm::vec4 *spheres = nullptr, BVHBuildMode build_mode = BVH_BUILD_SAH );
+	~BVH2( void );
+
+	// Accelerator.
+	bool closestHit( Ray* ray, float& t, uint32_t& prim_id, float& u, float& v ) const override;
+	bool occluded( Ray* ray, float t_max ) const override;
+	void closestHitPacket( RayPacket& packet ) const override;
+	int getNumSpheres( void ) const override;
+	const char* getName( void ) const override;
+	float getBuildTime( void ) const override;
+	size_t getMemoryBytes( void ) const override;
+	void getBounds( glm::vec3 &bounds_min, glm::vec3 &bounds_max ) const override;
+
+	int getNumNodes( void ) const;
+
+	// Moves the primitives without rebuilding: records are rewritten from the inputs and node bounds updated
+	// bottom-up. Takes the same triangles and spheres the tree was built from, only positions and radii may differ.
+	void refit( const glm::uvec3 *tris, const glm::vec3 *verts, const glm::vec4 *spheres );
+	// Same for scenes where only the spheres moved: triangle records and the bounds of subtrees without spheres
+	// are left as they are, only the sphere records and the nodes above them are updated.
+	void refitSpheres( const glm::vec4 *spheres );
+	float getRefitTime( void ) const;
+
+	// SAH cost of the tree relative to its root box, now and right after the build.
+	float getSAHCost( void ) const;
+	float getBuildSAHCost( void ) const;
+
+	// Flattened tree, for collapsing into wider BVHs.
+	const std::vector<BVHLinearNode>& getNodes( void ) const;
+	const std::vector<KDTriRecord>& getLeafTris( void ) const;
+	const std::vector<BVHSphereRecord>& getLeafSpheres( void ) const;
+
+private:
+	std::vector<BVHLinearNode> nodes;
+	std::vector<KDTriRecord> leaf_tris;
+	std::vector<BVHSphereRecord> leaf_spheres;
+	int num_tris;
+	float build_time;
+	float refit_time;
+	float sah_cost;
+	float build_sah_cost;
+
+	// Node indices grouped by depth, for the level by level refit. The second set only holds the nodes with
+	// spheres below them.
+	std::vector<std::vector<int>> node_levels;
+	std::vector<std::vector<int>> sphere_node_levels;
+
+	// Build.
+	int buildRecursive( std::vector<BVHBuildPrim> &prims, int start, int end, int depth );
+	bool findSplitBinned( const std::vector<BVHBuildPrim> &prims, int start, int end, const BVHBounds &bounds, const BVHBounds &centroid_bounds, int &split_axis, int &split_bin ) const;
+	int makeLeaf( std::vector<BVHBuildPrim> &prims, int start, int end, const BVHBounds &bounds );
+	void buildLBVH( std::vector<BVHBuildPrim> &prims );
+	void initNodeLevels( void );
+	float computeSAHCost( void ) const;
+
+	// Refit.
+	void refitSphereRecords( const glm::vec4 *spheres );
+	void refitLevels( const std::vector<std::vector<int>> &levels, const glm::uvec3 *tris, const glm::vec3 *verts );
+	void refitNode( int node_index, const glm::uvec3 *tris, const glm::vec3 *verts );
+
+	// Traversal.
+	bool intersectBounds( const BVHLinearNode &node, const glm::vec3 &origin, const glm::vec3 &inv_dir, const int dir_is_neg[3], float t_min, float t_max ) const;
+};
+
+#endif
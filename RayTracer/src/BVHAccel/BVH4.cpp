@@ -0,0 +1,560 @@
+#include "BVH4.h"
+#include "../KDAccel/Intersections.h"
+#include <algorithm>
+#include <cstdlib>
+#include <execution>
+
+#if KD_USE_SSE
+#include <emmintrin.h>
+#endif
+
+#include <Walnut/Timer.h>
+
+
+////////////////////////////////////////////////////
+// Constructor/destructor.
+////////////////////////////////////////////////////
+
+BVH4::BVH4( int num_tris, glm::uvec3 *tris, glm::vec3 *verts, int num_spheres, const glm::vec4 *spheres, BVHBuildMode build_mode ) :
+	BVH4( BVH2( num_tris, tris, verts, num_spheres, spheres, build_mode ) )
+{
+}
+
+// Every BVH4 node pulls in the largest inner nodes below it until it has four children. The build time includes
+// the binary build's.
+BVH4::BVH4( const BVH2 &bvh2 )
+{
+	Walnut::Timer timer;
+
+	const std::vector<BVHLinearNode> &bvh2_nodes = bvh2.getNodes();
+	leaf_tris = bvh2.getLeafTris();
+	leaf_spheres = bvh2.getLeafSpheres();
+
+	if ( !bvh2_nodes.empty() ) {
+		nodes.reserve( bvh2_nodes.size() / 2 + 1 );
+		collapse( bvh2_nodes, 0 );
+	}
+
+	initNodeLevels();
+	sah_cost = computeSAHCost();
+	build_sah_cost = sah_cost;
+	refit_time = 0.0f;
+
+	build_time = bvh2.getBuildTime() + timer.ElapsedMillis();
+}
+
+BVH4::~BVH4()
+{
+}
+
+
+////////////////////////////////////////////////////
+// Getters.
+////////////////////////////////////////////////////
+
+const char* BVH4::getName( void ) const
+{
+	return "BVH4";
+}
+
+float BVH4::getBuildTime( void ) const
+{
+	return build_time;
+}
+
+size_t BVH4::getMemoryBytes( void ) const
+{
+	return nodes.size() * sizeof( BVH4Node ) + leaf_tris.size() * sizeof( KDTriRecord ) + leaf_spheres.size() * sizeof( BVHSphereRecord );
+}
+
+void BVH4::getBounds( glm::vec3 &bounds_min, glm::vec3 &bounds_max ) const
+{
+	BVHBounds bounds;
+	if ( !nodes.empty() ) {
+		for ( int i = 0; i < BVH4_WIDTH; ++i ) {
+			if ( nodes[0].child[i] < 0 )
+				continue;
+			bounds.grow( glm::vec3( nodes[0].bounds_min[0][i], nodes[0].bounds_min[1][i], nodes[0].bounds_min[2][i] ) );
+			bounds.grow( glm::vec3( nodes[0].bounds_max[0][i], nodes[0].bounds_max[1][i], nodes[0].bounds_max[2][i] ) );
+		}
+	}
+	bounds_min = bounds.min;
+	bounds_max = bounds.max;
+}
+
+int BVH4::getNumSpheres( void ) const
+{
+	return (int)leaf_spheres.size();
+}
+
+int BVH4::getNumNodes( void ) const
+{
+	return (int)nodes.size();
+}
+
+size_t BVH4::getNodeMemoryBytes( void ) const
+{
+	return nodes.size() * sizeof( BVH4Node );
+}
+
+float BVH4::getRefitTime( void ) const
+{
+	return refit_time;
+}
+
+float BVH4::getSAHCost( void ) const
+{
+	return sah_cost;
+}
+
+// Same cost model as BVH2::computeSAHCost(), with one traversal step per BVH4 node.
+float BVH4::computeSAHCost( void ) const
+{
+	if ( nodes.empty() )
+		return 0.0f;
+
+	float cost = 0.0f;
+	BVHBounds root;
+	for ( int n = 0; n < (int)nodes.size(); ++n ) {
+		const BVH4Node &node = nodes[n];
+
+		BVHBounds node_bounds;
+		for ( int i = 0; i < BVH4_WIDTH; ++i ) {
+			if ( node.child[i] < 0 )
+				continue;
+
+			BVHBounds bounds;
+			bounds.grow( glm::vec3( node.bounds_min[0][i], node.bounds_min[1][i], node.bounds_min[2][i] ) );
+			bounds.grow( glm::vec3( node.bounds_max[0][i], node.bounds_max[1][i], node.bounds_max[2][i] ) );
+			node_bounds.grow( bounds );
+
+			if ( node.num_prims[i] != 0 )
+				cost += bounds.getSurfaceArea() * BVH_COST_INTERSECT * std::abs( node.num_prims[i] );
+		}
+
+		cost += node_bounds.getSurfaceArea() * BVH_COST_TRAVERSAL;
+		if ( n == 0 )
+			root = node_bounds;
+	}
+
+	float root_area = root.getSurfaceArea();
+	return root_area > 0.0f ? cost / root_area : 0.0f;
+}
+
+float BVH4::getBuildSAHCost( void ) const
+{
+	return build_sah_cost;
+}
+
+const std::vector<BVH4Node>& BVH4::getNodes( void ) const
+{
+	return nodes;
+}
+
+const std::vector<KDTriRecord>& BVH4::getLeafTris( void ) const
+{
+	return leaf_tris;
+}
+
+const std::vector<BVHSphereRecord>& BVH4::getLeafSpheres( void ) const
+{
+	return leaf_spheres;
+}
+
+
+////////////////////////////////////////////////////
+// Collapsing.
+////////////////////////////////////////////////////
+
+// Turns the BVH2 subtree at bvh2_index into a BVH4 subtree and returns its node index. A BVH2 leaf as root
+// becomes a BVH4 node with a single leaf child.
+int BVH4::collapse( const std::vector<BVHLinearNode> &bvh2_nodes, int bvh2_index )
+{
+	int node_index = (int)nodes.size();
+	nodes.emplace_back();
+
+	int children[BVH4_WIDTH];
+	int num_children = 0;
+
+	const BVHLinearNode &bvh2_node = bvh2_nodes[bvh2_index];
+	if ( bvh2_node.isLeaf() ) {
+		children[num_children++] = bvh2_index;
+	}
+	else {
+		children[num_children++] = bvh2_index + 1;
+		children[num_children++] = bvh2_node.second_child;
+	}
+
+	// Open the inner child with the largest surface area until all slots are used.
+	while ( num_children < BVH4_WIDTH ) {
+		int best = -1;
+		float best_area = -1.0f;
+		for ( int i = 0; i < num_children; ++i ) {
+			const BVHLinearNode &child = bvh2_nodes[children[i]];
+			if ( child.isLeaf() )
+				continue;
+
+			BVHBounds bounds;
+			bounds.grow( child.bounds_min );
+			bounds.grow( child.bounds_max );
+			if ( bounds.getSurfaceArea() > best_area ) {
+				best_area = bounds.getSurfaceArea();
+				best = i;
+			}
+		}
+
+		if ( best < 0 )
+			break;
+
+		int opened = children[best];
+		children[best] = opened + 1;
+		children[num_children++] = bvh2_nodes[opened].second_child;
+	}
+
+	for ( int i = 0; i < BVH4_WIDTH; ++i ) {
+		int child_node = -1;
+		int num_prims = 0;
+		glm::vec3 bounds_min( std::numeric_limits<float>::max() );
+		glm::vec3 bounds_max( -std::numeric_limits<float>::max() );
+
+		if ( i < num_children ) {
+			const BVHLinearNode &child = bvh2_nodes[children[i]];
+			bounds_min = child.bounds_min;
+			bounds_max = child.bounds_max;
+
+			if ( child.isLeaf() ) {
+				child_node = child.prim_offset;
+				num_prims = child.prim_type == BVH_PRIM_SPHERES ? -child.num_prims : child.num_prims;
+			}
+			else {
+				child_node = collapse( bvh2_nodes, children[i] );
+			}
+		}
+
+		// Recursion may have grown the node array, index instead of holding a reference.
+		BVH4Node &node = nodes[node_index];
+		for ( int axis = 0; axis < 3; ++axis ) {
+			node.bounds_min[axis][i] = bounds_min[axis];
+			node.bounds_max[axis][i] = bounds_max[axis];
+		}
+		node.child[i] = child_node;
+		node.num_prims[i] = num_prims;
+	}
+
+	return node_index;
+}
+
+
+// Parents are emitted before their children, so one forward pass hands every node its depth.
+void BVH4::initNodeLevels( void )
+{
+	node_levels.clear();
+
+	std::vector<int> depth( nodes.size(), 0 );
+	for ( int n = 0; n < (int)nodes.size(); ++n ) {
+		if ( depth[n] >= (int)node_levels.size() )
+			node_levels.resize( depth[n] + 1 );
+		node_levels[depth[n]].push_back( n );
+
+		for ( int i = 0; i < BVH4_WIDTH; ++i ) {
+			if ( nodes[n].child[i] >= 0 && nodes[n].num_prims[i] == 0 )
+				depth[nodes[n].child[i]] = depth[n] + 1;
+		}
+	}
+
+	// Deepest level first, so all child nodes are classified before their parent.
+	std::vector<uint8_t> has_spheres( nodes.size(), 0 );
+	sphere_node_levels.assign( node_levels.size(), std::vector<int>() );
+	for ( int level = (int)node_levels.size() - 1; level >= 0; --level ) {
+		for ( int n : node_levels[level] ) {
+			const BVH4Node &node = nodes[n];
+			for ( int i = 0; i < BVH4_WIDTH; ++i ) {
+				if ( node.child[i] >= 0 && ( node.num_prims[i] < 0 || ( node.num_prims[i] == 0 && has_spheres[node.child[i]] ) ) )
+					has_spheres[n] = 1;
+			}
+			if ( has_spheres[n] )
+				sphere_node_levels[level].push_back( n );
+		}
+	}
+}
+
+
+////////////////////////////////////////////////////
+// Refit.
+////////////////////////////////////////////////////
+
+void BVH4::refit( const glm::uvec3 *tris, const glm::vec3 *verts, const glm::vec4 *spheres )
+{
+	Walnut::Timer timer;
+
+	std::for_each( std::execution::par, leaf_tris.begin(), leaf_tris.end(), [tris, verts]( KDTriRecord &tri ) {
+		const glm::uvec3 &indices = tris[tri.tri_index];
+		tri.v0 = verts[indices[0]];
+		tri.e1 = verts[indices[1]] - verts[indices[0]];
+		tri.e2 = verts[indices[2]] - verts[indices[0]];
+	} );
+
+	refitSphereRecords( spheres );
+	refitLevels( node_levels, tris, verts );
+
+	sah_cost = computeSAHCost();
+	refit_time = timer.ElapsedMillis();
+}
+
+void BVH4::refitSpheres( const glm::vec4 *spheres )
+{
+	Walnut::Timer timer;
+
+	refitSphereRecords( spheres );
+	refitLevels( sphere_node_levels, NULL, NULL );
+
+	sah_cost = computeSAHCost();
+	refit_time = timer.ElapsedMillis();
+}
+
+void BVH4::refitSphereRecords( const glm::vec4 *spheres )
+{
+	std::for_each( std::execution::par, leaf_spheres.begin(), leaf_spheres.end(), [spheres]( BVHSphereRecord &sphere ) {
+		sphere.center = glm::vec3( spheres[sphere.sphere_index] );
+		sphere.radius = spheres[sphere.sphere_index].w;
+	} );
+}
+
+void BVH4::refitLevels( const std::vector<std::vector<int>> &levels, const glm::uvec3 *tris, const glm::vec3 *verts )
+{
+	for ( int level = (int)levels.size() - 1; level >= 0; --level ) {
+		std::for_each( std::execution::par, levels[level].begin(), levels[level].end(), [this, tris, verts]( int node_index ) {
+			refitNode( node_index, tris, verts );
+		} );
+	}
+}
+
+// Recomputes the bounds of all four child slots: leaves from their primitives, inner nodes as the union of
+// their own (already refitted) child slots. Without tris and verts, triangle leaves keep their bounds.
+void BVH4::refitNode( int node_index, const glm::uvec3 *tris, const glm::vec3 *verts )
+{
+	BVH4Node &node = nodes[node_index];
+
+	for ( int c = 0; c < BVH4_WIDTH; ++c ) {
+		if ( node.child[c] < 0 || ( node.num_prims[c] > 0 && !tris ) )
+			continue;
+
+		BVHBounds bounds;
+		if ( node.num_prims[c] == 0 ) {
+			const BVH4Node &child = nodes[node.child[c]];
+			for ( int i = 0; i < BVH4_WIDTH; ++i ) {
+				if ( child.child[i] < 0 )
+					continue;
+				bounds.grow( glm::vec3( child.bounds_min[0][i], child.bounds_min[1][i], child.bounds_min[2][i] ) );
+				bounds.grow( glm::vec3( child.bounds_max[0][i], child.bounds_max[1][i], child.bounds_max[2][i] ) );
+			}
+		}
+		else if ( node.num_prims[c] < 0 ) {
+			for ( int i = 0; i < -node.num_prims[c]; ++i ) {
+				const BVHSphereRecord &sphere = leaf_spheres[node.child[c] + i];
+				bounds.grow( sphere.center - sphere.radius );
+				bounds.grow( sphere.center + sphere.radius );
+			}
+		}
+		else {
+			for ( int i = 0; i < node.num_prims[c]; ++i ) {
+				const glm::uvec3 &tri = tris[leaf_tris[node.child[c] + i].tri_index];
+				bounds.grow( verts[tri[0]] );
+				bounds.grow( verts[tri[1]] );
+				bounds.grow( verts[tri[2]] );
+			}
+		}
+
+		for ( int axis = 0; axis < 3; ++axis ) {
+			node.bounds_min[axis][c] = bounds.min[axis];
+			node.bounds_max[axis][c] = bounds.max[axis];
+		}
+	}
+}
+
+
+////////////////////////////////////////////////////
+// Traversal.
+////////////////////////////////////////////////////
+
+// Slab test of the ray against all four children at once, near and far planes picked by the direction signs.
+// As in BVH2::intersectBounds(), a NaN from an origin on the boundary of a slab the ray runs parallel to leaves
+// the interval unchanged: max/min return their second operand when the first one is NaN.
+int BVH4::intersectChildren( const BVH4Node &node, const glm::vec3 &origin, const glm::vec3 &inv_dir, const int dir_is_neg[3], float t_min, float t_max, float t_entry[BVH4_WIDTH] ) const
+{
+#if KD_USE_SSE
+	__m128 enter = _mm_set1_ps( t_min );
+	__m128 exit = _mm_set1_ps( t_max );
+
+	for ( int axis = 0; axis < 3; ++axis ) {
+		__m128 o = _mm_set1_ps( origin[axis] );
+		__m128 inv = _mm_set1_ps( inv_dir[axis] );
+		__m128 near_plane = _mm_load_ps( dir_is_neg[axis] ? node.bounds_max[axis] : node.bounds_min[axis] );
+		__m128 far_plane = _mm_load_ps( dir_is_neg[axis] ? node.bounds_min[axis] : node.bounds_max[axis] );
+
+		enter = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( near_plane, o ), inv ), enter );
+		exit = _mm_min_ps( _mm_mul_ps( _mm_mul_ps( _mm_sub_ps( far_plane, o ), inv ), _mm_set1_ps( BVH_SLAB_EXIT_SCALE ) ), exit );
+	}
+
+	_mm_storeu_ps( t_entry, enter );
+	return _mm_movemask_ps( _mm_cmple_ps( enter, exit ) );
+#else
+	int mask = 0;
+	for ( int i = 0; i < BVH4_WIDTH; ++i ) {
+		float enter = t_min;
+		float exit = t_max;
+
+		for ( int axis = 0; axis < 3; ++axis ) {
+			float near_plane = dir_is_neg[axis] ? node.bounds_max[axis][i] : node.bounds_min[axis][i];
+			float far_plane = dir_is_neg[axis] ? node.bounds_min[axis][i] : node.bounds_max[axis][i];
+
+			float t_near = ( near_plane - origin[axis] ) * inv_dir[axis];
+			float t_far = ( far_plane - origin[axis] ) * inv_dir[axis] * BVH_SLAB_EXIT_SCALE;
+
+			if ( t_near > enter ) enter = t_near;
+			if ( t_far < exit ) exit = t_far;
+		}
+
+		t_entry[i] = enter;
+		if ( enter <= exit )
+			mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+// Hit children are handled near to far: leaves are intersected right away, inner nodes pushed so the nearest is
+// popped first. Stack entries remember their entry distance and are dropped once a closer hit is known.
+bool BVH4::closestHit( Ray* ray, float& t, uint32_t& prim_id, float& u, float& v ) const
+{
+	t = ray->TMax;
+	if ( nodes.empty() )
+		return false;
+
+	glm::vec3 inv_dir = 1.0f / ray->Direction;
+	int dir_is_neg[3] = { inv_dir.x < 0.0f, inv_dir.y < 0.0f, inv_dir.z < 0.0f };
+
+	struct StackEntry {
+		int node_index;
+		float t_entry;
+	};
+	StackEntry stack[BVH4_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, ray->TMin };
+
+	bool intersection_detected = false;
+
+	while ( stack_size > 0 ) {
+		StackEntry entry = stack[--stack_size];
+		if ( entry.t_entry > t )
+			continue;
+
+		const BVH4Node &node = nodes[entry.node_index];
+
+		float t_entry[BVH4_WIDTH];
+		int mask = intersectChildren( node, ray->Origin, inv_dir, dir_is_neg, ray->TMin, t, t_entry );
+		if ( mask == 0 )
+			continue;
+
+		// Insertion sort of the hit children by entry distance.
+		int order[BVH4_WIDTH];
+		int num_hit = 0;
+		for ( int i = 0; i < BVH4_WIDTH; ++i ) {
+			if ( !( mask & ( 1 << i ) ) || node.child[i] < 0 )
+				continue;
+
+			int j = num_hit++;
+			while ( j > 0 && t_entry[order[j - 1]] > t_entry[i] ) {
+				order[j] = order[j - 1];
+				--j;
+			}
+			order[j] = i;
+		}
+
+		for ( int k = 0; k < num_hit; ++k ) {
+			int c = order[k];
+			if ( node.num_prims[c] == 0 || t_entry[c] > t )
+				continue;
+
+			for ( int i = 0; i < -node.num_prims[c]; ++i ) {
+				const BVHSphereRecord &sphere = leaf_spheres[node.child[c] + i];
+
+				float tmp_t;
+				if ( Intersections::sphereIntersect( ray, sphere.center, sphere.radius, tmp_t ) && tmp_t < t && tmp_t >= ray->TMin ) {
+					intersection_detected = true;
+					t = tmp_t;
+					prim_id = ACCEL_PRIM_SPHERE_BIT | sphere.sphere_index;
+					u = 0.0f;
+					v = 0.0f;
+				}
+			}
+
+			for ( int i = 0; i < node.num_prims[c]; ++i ) {
+				const KDTriRecord &tri = leaf_tris[node.child[c] + i];
+
+				float tmp_t, tmp_u, tmp_v;
+				if ( Intersections::triIntersect( ray, tri, tmp_t, tmp_u, tmp_v ) && tmp_t < t && tmp_t >= ray->TMin ) {
+					intersection_detected = true;
+					t = tmp_t;
+					prim_id = tri.tri_index;
+					u = tmp_u;
+					v = tmp_v;
+				}
+			}
+		}
+
+		for ( int k = num_hit - 1; k >= 0; --k ) {
+			int c = order[k];
+			if ( node.num_prims[c] == 0 && t_entry[c] <= t ) {
+				stack[stack_size++] = { node.child[c], t_entry[c] };
+			}
+		}
+	}
+
+	return intersection_detected;
+}
+
+bool BVH4::occluded( Ray* ray, float t_max ) const
+{
+	if ( nodes.empty() )
+		return false;
+
+	glm::vec3 inv_dir = 1.0f / ray->Direction;
+	int dir_is_neg[3] = { inv_dir.x < 0.0f, inv_dir.y < 0.0f, inv_dir.z < 0.0f };
+
+	int stack[BVH4_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while ( stack_size > 0 ) {
+		const BVH4Node &node = nodes[stack[--stack_size]];
+
+		float t_entry[BVH4_WIDTH];
+		int mask = intersectChildren( node, ray->Origin, inv_dir, dir_is_neg, ray->TMin, t_max, t_entry );
+
+		for ( int c = 0; c < BVH4_WIDTH; ++c ) {
+			if ( !( mask & ( 1 << c ) ) || node.child[c] < 0 )
+				continue;
+
+			if ( node.num_prims[c] == 0 ) {
+				stack[stack_size++] = node.child[c];
+				continue;
+			}
+
+			for ( int i = 0; i < -node.num_prims[c]; ++i ) {
+				const BVHSphereRecord &sphere = leaf_spheres[node.child[c] + i];
+				if ( Intersections::sphereOccluded( ray, sphere.center, sphere.radius, ray->TMin, t_max ) ) {
+					return true;
+				}
+			}
+
+			for ( int i = 0; i < node.num_prims[c]; ++i ) {
+				if ( Intersections::triOccluded( ray, leaf_tris[node.child[c] + i], ray->TMin, t_max ) ) {
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
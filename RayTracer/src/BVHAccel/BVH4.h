@@ -0,0 +1,82 @@
+#ifndef BVH4_H
+#define BVH4_H
+
+#include <vector>
+#include "BVHStructs.h"
+#include "BVH2.h"
+
+
+////////////////////////////////////////////////////
+// Constants.
+////////////////////////////////////////////////////
+
+// A node pushes at most three siblings per level of the binary tree it was collapsed from.
+const int BVH4_STACK_SIZE = ( BVH4_WIDTH - 1 ) * BVH_STACK_SIZE + 1;
+
+
+////////////////////////////////////////////////////
+// BVH4.
+////////////////////////////////////////////////////
+class BVH4 : public Accelerator
+{
+public:
+	BVH4( int num_tris, glm::uvec3 *tris, glm::vec3 *verts, int num_spheres = 0, const glm::vec4 *spheres = nullptr, BVHBuildMode build_mode = BVH_BUILD_SAH );
+
+	// Collapses a binary tree that was already built, e.g. one also used as a BVH2, instead of building another.
+	BVH4( const BVH2 &bvh2 );
+	~BVH4( void );
+
+	// Accelerator.
+	bool closestHit( Ray* ray, float& t, uint32_t& prim_id, float& u, float& v ) const override;
+	bool occluded( Ray* ray, float t_max ) const override;
+	int getNumSpheres( void ) const override;
+	const char* getName( void ) const override;
+	float getBuildTime( void ) const override;
+	size_t getMemoryBytes( void ) const override;
+	void getBounds( glm::vec3 &bounds_min, glm::vec3 &bounds_max ) const override;
+
+	int getNumNodes( void ) const;
+	size_t getNodeMemoryBytes( void ) const;
+
+	// See BVH2::refit() and BVH2::refitSpheres().
+	void refit( const glm::uvec3 *tris, const glm::vec3 *verts, const glm::vec4 *spheres );
+	void refitSpheres( const glm::vec4 *spheres );
+	float getRefitTime( void ) const;
+
+	float getSAHCost( void ) const;
+	float getBuildSAHCost( void ) const;
+
+	// Collapsed tree, for encoding into compressed nodes.
+	const std::vector<BVH4Node>& getNodes( void ) const;
+	const std::vector<KDTriRecord>& getLeafTris( void ) const;
+	const std::vector<BVHSphereRecord>& getLeafSpheres( void ) const;
+
+private:
+	std::vector<BVH4Node> nodes;
+	std::vector<KDTriRecord> leaf_tris;
+	std::vector<BVHSphereRecord> leaf_spheres;
+	float build_time;
+	float refit_time;
+	float sah_cost;
+	float build_sah_cost;
+
+	// Node indices grouped by depth, for the level by level refit. The second set only holds the nodes with
+	// spheres below them.
+	std::vector<std::vector<int>> node_levels;
+	std::vector<std::vector<int>> sphere_node_levels;
+
+	// Collapsing the binary SAH tree.
+	int collapse( const std::vector<BVHLinearNode> &bvh2_nodes, int bvh2_index );
+	void initNodeLevels( void );
+	float computeSAHCost( void ) const;
+
+	// Refit.
+	void refitSphereRecords( const glm::vec4 *spheres );
+	void refitLevels( const std::vector<std::vector<int>> &levels, const glm::uvec3 *tris, const glm::vec3 *verts );
+	void refitNode( int node_index, const glm::uvec3 *tris, const glm::vec3 *verts );
+
+	// Traversal. Returns the hit mask over the children and their entry distances.
+	int intersectChildren( const BVH4Node &node, const glm::vec3 &origin, const glm::vec3 &inv_dir, const int dir_is_neg[3], float t_min, float t_max, float t_entry[BVH4_WIDTH] ) const;
+};
+
+#endif
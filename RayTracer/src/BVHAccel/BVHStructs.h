@@ -0,0 +1,180 @@
+#ifndef BVH_STRUCTS_H
+#define BVH_STRUCTS_H
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <limits>
+
+
+////////////////////////////////////////////////////
+// Constants.
+////////////////////////////////////////////////////
+
+// Slab exit distances are scaled by 1 + 2 * gamma(3) (pbrt's bound on the rounding error of the slab test), so
+// rays grazing an edge or corner of a box don't miss triangles lying exactly on it.
+const float BVH_SLAB_EXIT_SCALE = 1.0f + 2.0f * ( 3.0f * 0.5f * std::numeric_limits<float>::epsilon() ) / ( 1.0f - 3.0f * 0.5f * std::numeric_limits<float>::epsilon() );
+
+
+////////////////////////////////////////////////////
+// BVHBounds.
+////////////////////////////////////////////////////
+
+struct BVHBounds
+{
+	glm::vec3 min = glm::vec3( std::numeric_limits<float>::max() );
+	glm::vec3 max = glm::vec3( -std::numeric_limits<float>::max() );
+
+	void grow( const glm::vec3 &p ) { min = glm::min( min, p ); max = glm::max( max, p ); }
+	void grow( const BVHBounds &b ) { min = glm::min( min, b.min ); max = glm::max( max, b.max ); }
+
+	bool isEmpty( void ) const { return min.x > max.x; }
+	glm::vec3 getCenter( void ) const { return ( min + max ) * 0.5f; }
+
+	float getSurfaceArea( void ) const
+	{
+		if ( isEmpty() )
+			return 0.0f;
+		glm::vec3 d = max - min;
+		return 2.0f * ( d.x * d.y + d.y * d.z + d.x * d.z );
+	}
+
+	int getLongestAxis( void ) const
+	{
+		glm::vec3 d = max - min;
+		return ( d.x > d.y && d.x > d.z ) ? 0 : ( d.y > d.z ? 1 : 2 );
+	}
+};
+
+
+////////////////////////////////////////////////////
+// Build structures.
+////////////////////////////////////////////////////
+
+// Per-primitive input to the builders: bounds, centroid and the primitive it stands for. Indices below the
+// triangle count are mesh triangles, the ones above are spheres.
+struct BVHBuildPrim
+{
+	BVHBounds bounds;
+	glm::vec3 centroid;
+	int prim_index;
+};
+
+// Inner node of the radix tree the LBVH builder reads off the sorted Morton codes (Karras 2012). It covers the
+// primitives [first, last] in Morton order. A child below zero is the leaf over primitive ~child.
+struct BVHRadixNode
+{
+	BVHBounds bounds;
+	int first, last;
+	int child[2];
+	int split_axis;
+	int prim_types;		// Bit per BVHPrimType found in the subtree.
+	int num_flat_nodes;	// Nodes the subtree flattens to, 1 if it becomes a leaf.
+};
+
+struct BVHBin
+{
+	BVHBounds bounds;
+	int count = 0;
+};
+
+
+////////////////////////////////////////////////////
+// Leaf primitives.
+////////////////////////////////////////////////////
+
+enum BVHPrimType {
+	BVH_PRIM_TRIANGLES = 0,
+	BVH_PRIM_SPHERES = 1
+};
+
+struct BVHSphereRecord
+{
+	glm::vec3 center;
+	float radius;
+	int sphere_index;
+};
+
+
+////////////////////////////////////////////////////
+// BVHLinearNode.
+////////////////////////////////////////////////////
+
+// 32-byte node of the flattened BVH, two per cache line. The first child of an inner node directly follows it,
+// only the second child's index is stored. Leaves hold a single primitive type and reference a range of the
+// triangle or the sphere record array.
+struct alignas( 32 ) BVHLinearNode
+{
+	glm::vec3 bounds_min;
+	union {
+		int prim_offset;	// Leaf.
+		int second_child;	// Inner node.
+	};
+	glm::vec3 bounds_max;
+	uint16_t num_prims;		// 0 for inner nodes.
+	uint8_t axis;			// Split axis, decides which child a ray visits first.
+	uint8_t prim_type;		// Leaf, BVHPrimType.
+
+	bool isLeaf( void ) const { return num_prims > 0; }
+};
+
+
+
+////////////////////////////////////////////////////
+// BVH4Node.
+////////////////////////////////////////////////////
+
+const int BVH4_WIDTH = 4;
+
+// Four children with their bounds in SoA layout, [axis][child], so one SIMD slab test covers all of them.
+// A child is an inner node (num_prims 0, child is a node index), a leaf (child is the offset of num_prims
+// triangle records, or of -num_prims sphere records) or an unused slot (child -1).
+struct alignas( 64 ) BVH4Node
+{
+	float bounds_min[3][BVH4_WIDTH];
+	float bounds_max[3][BVH4_WIDTH];
+	int child[BVH4_WIDTH];
+	int num_prims[BVH4_WIDTH];
+};
+
+
+////////////////////////////////////////////////////
+// BVH4CompressedNode.
+////////////////////////////////////////////////////
+
+// Child slot codes of a compressed node. Leaf slots hold their primitive count, sphere leaves with
+// BVH4C_SLOT_SPHERES set.
+const uint8_t BVH4C_SLOT_EMPTY = 0;
+const uint8_t BVH4C_SLOT_SPHERES = 0x80;
+const uint8_t BVH4C_SLOT_INNER = 0xff;
+
+// Child bounds are quantized to this many steps of the node's box.
+const float BVH4C_QUANT_STEPS = 255.0f;
+
+// Quantization step over the box extent. Slightly larger than 1 / BVH4C_QUANT_STEPS, so the last step reaches the
+// box's max despite rounding.
+const float BVH4C_STEP_SCALE = ( 1.0f + 8.0f * std::numeric_limits<float>::epsilon() ) / BVH4C_QUANT_STEPS;
+
+// Box of a compressed node as its parent decoded it: a quantized coordinate q stands for origin + q * step.
+struct BVH4CompressedFrame
+{
+	glm::vec3 origin;
+	glm::vec3 step;
+};
+
+// 40-byte BVH4 node, a third of a BVH4Node. Child bounds are 8-bit coordinates in the node's own frame, min rounded
+// down and max up, so the decoded boxes always contain the exact ones. The inner children and the leaf records
+// of all leaf children are stored consecutively in slot order, one base index per array replaces the
+// per-child indices.
+// Nodes are deliberately not padded to a cache line: half of them straddle two lines, but padding to 64 bytes
+// grows the node array by 60% and traced about 6% slower on a 2M triangle mesh.
+struct BVH4CompressedNode
+{
+	uint8_t bounds_min[3][BVH4_WIDTH];
+	uint8_t bounds_max[3][BVH4_WIDTH];
+	int first_child;
+	int first_tri;
+	int first_sphere;
+	uint8_t slot[BVH4_WIDTH];
+};
+
+#endif
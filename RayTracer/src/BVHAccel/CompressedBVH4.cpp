@@ -0,0 +1,443 @@
+#include "CompressedBVH4.h"
+#include "../KDAccel/Intersections.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#if KD_USE_SSE
+#include <emmintrin.h>
+#endif
+
+#include <Walnut/Timer.h>
+
+
+////////////////////////////////////////////////////
+// Helpers.
+////////////////////////////////////////////////////
+
+// A leaf slot's primitive count has to stay below the sphere bit, which also keeps it clear of BVH4C_SLOT_INNER.
+static_assert( BVH_MAX_LEAF_TRIS < BVH4C_SLOT_SPHERES, "leaf primitive counts don't fit a compressed slot" );
+static_assert( sizeof( BVH4CompressedNode ) == 40, "see the layout notes at BVH4CompressedNode" );
+
+namespace {
+	inline BVH4CompressedFrame makeFrame( const glm::vec3 &bounds_min, const glm::vec3 &bounds_max )
+	{
+		return { bounds_min, ( bounds_max - bounds_min ) * BVH4C_STEP_SCALE };
+	}
+
+	// Multiply, then add, as the SIMD slab test does, so encoder and traversal agree on every decoded plane.
+	inline float decode( const BVH4CompressedFrame &frame, int axis, int q )
+	{
+		return (float)q * frame.step[axis] + frame.origin[axis];
+	}
+
+	// Frame of child slot c, from its decoded bounds.
+	inline BVH4CompressedFrame childFrame( const BVH4CompressedNode &node, const BVH4CompressedFrame &frame, int c )
+	{
+		glm::vec3 bounds_min, bounds_max;
+		for ( int axis = 0; axis < 3; ++axis ) {
+			bounds_min[axis] = decode( frame, axis, node.bounds_min[axis][c] );
+			bounds_max[axis] = decode( frame, axis, node.bounds_max[axis][c] );
+		}
+		return makeFrame( bounds_min, bounds_max );
+	}
+
+	// Rounds min down and max up to the frame's steps. The estimate from the division is corrected against the
+	// decoded planes, so rounding in either can't shrink the box.
+	inline void quantize( const BVH4CompressedFrame &frame, int axis, float bounds_min, float bounds_max, uint8_t &q_min, uint8_t &q_max )
+	{
+		int max_step = (int)BVH4C_QUANT_STEPS;
+		float step = frame.step[axis];
+		if ( step <= 0.0f ) {
+			q_min = 0;
+			q_max = 0;
+			return;
+		}
+
+		int lo = (int)std::floor( ( bounds_min - frame.origin[axis] ) / step );
+		int hi = (int)std::ceil( ( bounds_max - frame.origin[axis] ) / step );
+		lo = std::min( std::max( lo, 0 ), max_step );
+		hi = std::min( std::max( hi, 0 ), max_step );
+
+		while ( lo > 0 && decode( frame, axis, lo ) > bounds_min )
+			--lo;
+		while ( hi < max_step && decode( frame, axis, hi ) < bounds_max )
+			++hi;
+
+		q_min = (uint8_t)lo;
+		q_max = (uint8_t)hi;
+	}
+
+#if KD_USE_SSE
+	inline __m128 loadQuantized( const uint8_t q[BVH4_WIDTH] )
+	{
+		int packed;
+		std::memcpy( &packed, q, sizeof( packed ) );
+		__m128i zero = _mm_setzero_si128();
+		__m128i words = _mm_unpacklo_epi8( _mm_cvtsi32_si128( packed ), zero );
+		return _mm_cvtepi32_ps( _mm_unpacklo_epi16( words, zero ) );
+	}
+#endif
+}
+
+
+////////////////////////////////////////////////////
+// Constructor/destructor.
+////////////////////////////////////////////////////
+
+CompressedBVH4::CompressedBVH4( const BVH4 &bvh4 )
+{
+	Walnut::Timer timer;
+
+	bvh4.getBounds( root_bounds.min, root_bounds.max );
+	root_frame = makeFrame( root_bounds.min, root_bounds.max );
+
+	if ( bvh4.getNumNodes() > 0 ) {
+		nodes.reserve( bvh4.getNumNodes() );
+		leaf_tris.reserve( bvh4.getLeafTris().size() );
+		leaf_spheres.reserve( bvh4.getLeafSpheres().size() );
+
+		nodes.emplace_back();
+		compress( bvh4, 0, 0, root_frame );
+	}
+
+	build_time = timer.ElapsedMillis();
+}
+
+CompressedBVH4::~CompressedBVH4()
+{
+}
+
+
+////////////////////////////////////////////////////
+// Getters.
+////////////////////////////////////////////////////
+
+const char* CompressedBVH4::getName( void ) const
+{
+	return "BVH4 8-bit";
+}
+
+float CompressedBVH4::getBuildTime( void ) const
+{
+	return build_time;
+}
+
+size_t CompressedBVH4::getMemoryBytes( void ) const
+{
+	return getNodeMemoryBytes() + leaf_tris.size() * sizeof( KDTriRecord ) + leaf_spheres.size() * sizeof( BVHSphereRecord );
+}
+
+void CompressedBVH4::getBounds( glm::vec3 &bounds_min, glm::vec3 &bounds_max ) const
+{
+	bounds_min = root_bounds.min;
+	bounds_max = root_bounds.max;
+}
+
+int CompressedBVH4::getNumSpheres( void ) const
+{
+	return (int)leaf_spheres.size();
+}
+
+int CompressedBVH4::getNumNodes( void ) const
+{
+	return (int)nodes.size();
+}
+
+size_t CompressedBVH4::getNodeMemoryBytes( void ) const
+{
+	return nodes.size() * sizeof( BVH4CompressedNode );
+}
+
+
+////////////////////////////////////////////////////
+// Encoding.
+////////////////////////////////////////////////////
+
+// Encodes BVH4 node bvh4_index into nodes[node_index], whose box the parent decoded as frame. The node's inner
+// children are allocated as one block and its leaf records appended before descending, so every node only needs
+// base indices. Children are quantized against the decoded box rather than the exact one, the frames traversal
+// rebuilds from the 8-bit bounds.
+void CompressedBVH4::compress( const BVH4 &bvh4, int bvh4_index, int node_index, const BVH4CompressedFrame &frame )
+{
+	const BVH4Node &src = bvh4.getNodes()[bvh4_index];
+
+	int num_inner = 0;
+	for ( int c = 0; c < BVH4_WIDTH; ++c ) {
+		if ( src.child[c] >= 0 && src.num_prims[c] == 0 )
+			++num_inner;
+	}
+
+	int first_child = (int)nodes.size();
+	nodes.resize( nodes.size() + num_inner );
+
+	// Resizing may have moved the node array, index instead of holding a reference across it.
+	BVH4CompressedNode &node = nodes[node_index];
+	node.first_child = first_child;
+	node.first_tri = (int)leaf_tris.size();
+	node.first_sphere = (int)leaf_spheres.size();
+
+	for ( int c = 0; c < BVH4_WIDTH; ++c ) {
+		if ( src.child[c] < 0 ) {
+			node.slot[c] = BVH4C_SLOT_EMPTY;
+			for ( int axis = 0; axis < 3; ++axis ) {
+				node.bounds_min[axis][c] = 0;
+				node.bounds_max[axis][c] = 0;
+			}
+			continue;
+		}
+
+		for ( int axis = 0; axis < 3; ++axis )
+			quantize( frame, axis, src.bounds_min[axis][c], src.bounds_max[axis][c], node.bounds_min[axis][c], node.bounds_max[axis][c] );
+
+		if ( src.num_prims[c] == 0 ) {
+			node.slot[c] = BVH4C_SLOT_INNER;
+		}
+		else if ( src.num_prims[c] < 0 ) {
+			assert( -src.num_prims[c] < BVH4C_SLOT_SPHERES );
+			node.slot[c] = (uint8_t)( BVH4C_SLOT_SPHERES | -src.num_prims[c] );
+			for ( int i = 0; i < -src.num_prims[c]; ++i )
+				leaf_spheres.push_back( bvh4.getLeafSpheres()[src.child[c] + i] );
+		}
+		else {
+			assert( src.num_prims[c] < BVH4C_SLOT_SPHERES );
+			node.slot[c] = (uint8_t)src.num_prims[c];
+			for ( int i = 0; i < src.num_prims[c]; ++i )
+				leaf_tris.push_back( bvh4.getLeafTris()[src.child[c] + i] );
+		}
+	}
+
+	int child_index = first_child;
+	for ( int c = 0; c < BVH4_WIDTH; ++c ) {
+		if ( src.child[c] >= 0 && src.num_prims[c] == 0 ) {
+			BVH4CompressedFrame child_frame = childFrame( nodes[node_index], frame, c );
+			compress( bvh4, src.child[c], child_index++, child_frame );
+		}
+	}
+}
+
+
+////////////////////////////////////////////////////
+// Traversal.
+////////////////////////////////////////////////////
+
+// BVH4::intersectChildren() on the child boxes decoded from the node's frame.
+int CompressedBVH4::intersectChildren( const BVH4CompressedNode &node, const BVH4CompressedFrame &frame, const glm::vec3 &origin, const glm::vec3 &inv_dir, const int dir_is_neg[3], float t_min, float t_max, float t_entry[BVH4_WIDTH] ) const
+{
+#if KD_USE_SSE
+	__m128 enter = _mm_set1_ps( t_min );
+	__m128 exit = _mm_set1_ps( t_max );
+
+	for ( int axis = 0; axis < 3; ++axis ) {
+		__m128 step = _mm_set1_ps( frame.step[axis] );
+		__m128 frame_origin = _mm_set1_ps( frame.origin[axis] );
+		__m128 o = _mm_set1_ps( origin[axis] );
+		__m128 inv = _mm_set1_ps( inv_dir[axis] );
+		__m128 near_plane = _mm_add_ps( _mm_mul_ps( loadQuantized( dir_is_neg[axis] ? node.bounds_max[axis] : node.bounds_min[axis] ), step ), frame_origin );
+		__m128 far_plane = _mm_add_ps( _mm_mul_ps( loadQuantized( dir_is_neg[axis] ? node.bounds_min[axis] : node.bounds_max[axis] ), step ), frame_origin );
+
+		enter = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( near_plane, o ), inv ), enter );
+		exit = _mm_min_ps( _mm_mul_ps( _mm_mul_ps( _mm_sub_ps( far_plane, o ), inv ), _mm_set1_ps( BVH_SLAB_EXIT_SCALE ) ), exit );
+	}
+
+	_mm_storeu_ps( t_entry, enter );
+	return _mm_movemask_ps( _mm_cmple_ps( enter, exit ) );
+#else
+	int mask = 0;
+	for ( int i = 0; i < BVH4_WIDTH; ++i ) {
+		float enter = t_min;
+		float exit = t_max;
+
+		for ( int axis = 0; axis < 3; ++axis ) {
+			float near_plane = decode( frame, axis, dir_is_neg[axis] ? node.bounds_max[axis][i] : node.bounds_min[axis][i] );
+			float far_plane = decode( frame, axis, dir_is_neg[axis] ? node.bounds_min[axis][i] : node.bounds_max[axis][i] );
+
+			float t_near = ( near_plane - origin[axis] ) * inv_dir[axis];
+			float t_far = ( far_plane - origin[axis] ) * inv_dir[axis] * BVH_SLAB_EXIT_SCALE;
+
+			if ( t_near > enter ) enter = t_near;
+			if ( t_far < exit ) exit = t_far;
+		}
+
+		t_entry[i] = enter;
+		if ( enter <= exit )
+			mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+// Ordered traversal of BVH4::closestHit(). Stack entries carry the frame of their node, decoded from the parent's
+// 8-bit bounds when they are pushed.
+bool CompressedBVH4::closestHit( Ray* ray, float& t, uint32_t& prim_id, float& u, float& v ) const
+{
+	t = ray->TMax;
+	if ( nodes.empty() )
+		return false;
+
+	glm::vec3 inv_dir = 1.0f / ray->Direction;
+	int dir_is_neg[3] = { inv_dir.x < 0.0f, inv_dir.y < 0.0f, inv_dir.z < 0.0f };
+
+	struct StackEntry {
+		int node_index;
+		float t_entry;
+		BVH4CompressedFrame frame;
+	};
+	StackEntry stack[BVH4_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, ray->TMin, root_frame };
+
+	bool intersection_detected = false;
+
+	while ( stack_size > 0 ) {
+		StackEntry entry = stack[--stack_size];
+		if ( entry.t_entry > t )
+			continue;
+
+		const BVH4CompressedNode &node = nodes[entry.node_index];
+
+		float t_entry[BVH4_WIDTH];
+		int mask = intersectChildren( node, entry.frame, ray->Origin, inv_dir, dir_is_neg, ray->TMin, t, t_entry );
+		if ( mask == 0 )
+			continue;
+
+		// Child node and leaf record indices from the running counts over the slots.
+		int offset[BVH4_WIDTH];
+		int next_child = node.first_child, next_tri = node.first_tri, next_sphere = node.first_sphere;
+		for ( int c = 0; c < BVH4_WIDTH; ++c ) {
+			uint8_t slot = node.slot[c];
+			if ( slot == BVH4C_SLOT_INNER ) {
+				offset[c] = next_child++;
+			}
+			else if ( slot & BVH4C_SLOT_SPHERES ) {
+				offset[c] = next_sphere;
+				next_sphere += slot & ~BVH4C_SLOT_SPHERES;
+			}
+			else {
+				offset[c] = next_tri;
+				next_tri += slot;
+			}
+		}
+
+		// Insertion sort of the hit children by entry distance.
+		int order[BVH4_WIDTH];
+		int num_hit = 0;
+		for ( int i = 0; i < BVH4_WIDTH; ++i ) {
+			if ( !( mask & ( 1 << i ) ) || node.slot[i] == BVH4C_SLOT_EMPTY )
+				continue;
+
+			int j = num_hit++;
+			while ( j > 0 && t_entry[order[j - 1]] > t_entry[i] ) {
+				order[j] = order[j - 1];
+				--j;
+			}
+			order[j] = i;
+		}
+
+		for ( int k = 0; k < num_hit; ++k ) {
+			int c = order[k];
+			uint8_t slot = node.slot[c];
+			if ( slot == BVH4C_SLOT_INNER || t_entry[c] > t )
+				continue;
+
+			if ( slot & BVH4C_SLOT_SPHERES ) {
+				for ( int i = 0; i < ( slot & ~BVH4C_SLOT_SPHERES ); ++i ) {
+					const BVHSphereRecord &sphere = leaf_spheres[offset[c] + i];
+
+					float tmp_t;
+					if ( Intersections::sphereIntersect( ray, sphere.center, sphere.radius, tmp_t ) && tmp_t < t && tmp_t >= ray->TMin ) {
+						intersection_detected = true;
+						t = tmp_t;
+						prim_id = ACCEL_PRIM_SPHERE_BIT | sphere.sphere_index;
+						u = 0.0f;
+						v = 0.0f;
+					}
+				}
+				continue;
+			}
+
+			for ( int i = 0; i < slot; ++i ) {
+				const KDTriRecord &tri = leaf_tris[offset[c] + i];
+
+				float tmp_t, tmp_u, tmp_v;
+				if ( Intersections::triIntersect( ray, tri, tmp_t, tmp_u, tmp_v ) && tmp_t < t && tmp_t >= ray->TMin ) {
+					intersection_detected = true;
+					t = tmp_t;
+					prim_id = tri.tri_index;
+					u = tmp_u;
+					v = tmp_v;
+				}
+			}
+		}
+
+		for ( int k = num_hit - 1; k >= 0; --k ) {
+			int c = order[k];
+			if ( node.slot[c] == BVH4C_SLOT_INNER && t_entry[c] <= t ) {
+				stack[stack_size++] = { offset[c], t_entry[c], childFrame( node, entry.frame, c ) };
+			}
+		}
+	}
+
+	return intersection_detected;
+}
+
+bool CompressedBVH4::occluded( Ray* ray, float t_max ) const
+{
+	if ( nodes.empty() )
+		return false;
+
+	glm::vec3 inv_dir = 1.0f / ray->Direction;
+	int dir_is_neg[3] = { inv_dir.x < 0.0f, inv_dir.y < 0.0f, inv_dir.z < 0.0f };
+
+	struct StackEntry {
+		int node_index;
+		BVH4CompressedFrame frame;
+	};
+	StackEntry stack[BVH4_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, root_frame };
+
+	while ( stack_size > 0 ) {
+		StackEntry entry = stack[--stack_size];
+		const BVH4CompressedNode &node = nodes[entry.node_index];
+
+		float t_entry[BVH4_WIDTH];
+		int mask = intersectChildren( node, entry.frame, ray->Origin, inv_dir, dir_is_neg, ray->TMin, t_max, t_entry );
+
+		int next_child = node.first_child, next_tri = node.first_tri, next_sphere = node.first_sphere;
+		for ( int c = 0; c < BVH4_WIDTH; ++c ) {
+			uint8_t slot = node.slot[c];
+			if ( slot == BVH4C_SLOT_EMPTY )
+				continue;
+
+			bool hit = ( mask & ( 1 << c ) ) != 0;
+
+			if ( slot == BVH4C_SLOT_INNER ) {
+				if ( hit )
+					stack[stack_size++] = { next_child, childFrame( node, entry.frame, c ) };
+				++next_child;
+			}
+			else if ( slot & BVH4C_SLOT_SPHERES ) {
+				int num_spheres = slot & ~BVH4C_SLOT_SPHERES;
+				for ( int i = 0; hit && i < num_spheres; ++i ) {
+					const BVHSphereRecord &sphere = leaf_spheres[next_sphere + i];
+					if ( Intersections::sphereOccluded( ray, sphere.center, sphere.radius, ray->TMin, t_max ) ) {
+						return true;
+					}
+				}
+				next_sphere += num_spheres;
+			}
+			else {
+				for ( int i = 0; hit && i < slot; ++i ) {
+					if ( Intersections::triOccluded( ray, leaf_tris[next_tri + i], ray->TMin, t_max ) ) {
+						return true;
+					}
+				}
+				next_tri += slot;
+			}
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,46 @@
+#ifndef COMPRESSED_BVH4_H
+#define COMPRESSED_BVH4_H
+
+#include <vector>
+#include "BVHStructs.h"
+#include "BVH4.h"
+
+
+////////////////////////////////////////////////////
+// CompressedBVH4.
+////////////////////////////////////////////////////
+class CompressedBVH4 : public Accelerator
+{
+public:
+	// Encodes the nodes of a built BVH4, the tree itself is not changed.
+	CompressedBVH4( const BVH4 &bvh4 );
+	~CompressedBVH4( void );
+
+	// Accelerator.
+	bool closestHit( Ray* ray, float& t, uint32_t& prim_id, float& u, float& v ) const override;
+	bool occluded( Ray* ray, float t_max ) const override;
+	int getNumSpheres( void ) const override;
+	const char* getName( void ) const override;
+	float getBuildTime( void ) const override;
+	size_t getMemoryBytes( void ) const override;
+	void getBounds( glm::vec3 &bounds_min, glm::vec3 &bounds_max ) const override;
+
+	int getNumNodes( void ) const;
+	size_t getNodeMemoryBytes( void ) const;
+
+private:
+	std::vector<BVH4CompressedNode> nodes;
+	std::vector<KDTriRecord> leaf_tris;
+	std::vector<BVHSphereRecord> leaf_spheres;
+	BVHBounds root_bounds;
+	BVH4CompressedFrame root_frame;
+	float build_time;
+
+	// Encoding.
+	void compress( const BVH4 &bvh4, int bvh4_index, int node_index, const BVH4CompressedFrame &frame );
+
+	// Traversal. Returns the hit mask over the children and their entry distances.
+	int intersectChildren( const BVH4CompressedNode &node, const BVH4CompressedFrame &frame, const glm::vec3 &origin, const glm::vec3 &inv_dir, const int dir_is_neg[3], float t_min, float t_max, float t_entry[BVH4_WIDTH] ) const;
+};
+
+#endif
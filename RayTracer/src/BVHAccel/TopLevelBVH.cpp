@@ -0,0 +1,268 @@
+#include "TopLevelBVH.h"
+#include "BVH2.h"
+#include <algorithm>
+
+#include <Walnut/Timer.h>
+
+
+////////////////////////////////////////////////////
+// Helpers.
+////////////////////////////////////////////////////
+
+namespace {
+	// Slab test of BVH2::intersectBounds().
+	inline bool intersectBounds( const BVHLinearNode &node, const glm::vec3 &origin, const glm::vec3 &inv_dir, const int dir_is_neg[3], float t_min, float t_max )
+	{
+		for ( int axis = 0; axis < 3; ++axis ) {
+			float t_near = ( ( dir_is_neg[axis] ? node.bounds_max[axis] : node.bounds_min[axis] ) - origin[axis] ) * inv_dir[axis];
+			float t_far = ( ( dir_is_neg[axis] ? node.bounds_min[axis] : node.bounds_max[axis] ) - origin[axis] ) * inv_dir[axis] * BVH_SLAB_EXIT_SCALE;
+
+			if ( t_near > t_min ) t_min = t_near;
+			if ( t_far < t_max ) t_max = t_far;
+		}
+
+		return t_min <= t_max;
+	}
+}
+
+
+////////////////////////////////////////////////////
+// Constructor/destructor.
+////////////////////////////////////////////////////
+
+TopLevelBVH::TopLevelBVH( int num_instances, const BVHInstance *instances )
+{
+	Walnut::Timer timer;
+
+	this->instances.resize( num_instances );
+
+	std::vector<BVHBuildPrim> prims;
+	prims.reserve( num_instances );
+
+	for ( int i = 0; i < num_instances; ++i ) {
+		Instance &instance = this->instances[i];
+		instance.blas = instances[i].blas;
+		instance.object_to_world = instances[i].object_to_world;
+		instance.world_to_object = glm::inverse( instances[i].object_to_world );
+
+		glm::vec3 object_min, object_max;
+		instance.blas->getBounds( object_min, object_max );
+		if ( object_min.x > object_max.x )
+			continue;
+
+		// World bounds of the transformed object bounds' corners.
+		BVHBuildPrim prim;
+		for ( int corner = 0; corner < 8; ++corner ) {
+			glm::vec3 p( ( corner & 1 ) ? object_max.x : object_min.x, ( corner & 2 ) ? object_max.y : object_min.y, ( corner & 4 ) ? object_max.z : object_min.z );
+			prim.bounds.grow( glm::vec3( instance.object_to_world * glm::vec4( p, 1.0f ) ) );
+		}
+		prim.centroid = prim.bounds.getCenter();
+		prim.prim_index = i;
+		prims.push_back( prim );
+	}
+
+	if ( !prims.empty() ) {
+		nodes.reserve( 2 * prims.size() );
+		buildRecursive( prims, 0, (int)prims.size() );
+	}
+
+	leaf_instances.resize( prims.size() );
+	for ( size_t i = 0; i < prims.size(); ++i ) {
+		leaf_instances[i] = prims[i].prim_index;
+	}
+
+	build_time = timer.ElapsedMillis();
+}
+
+TopLevelBVH::~TopLevelBVH()
+{
+}
+
+
+////////////////////////////////////////////////////
+// Getters.
+////////////////////////////////////////////////////
+
+int TopLevelBVH::getNumInstances( void ) const
+{
+	return (int)instances.size();
+}
+
+const glm::mat4& TopLevelBVH::getObjectToWorld( int instance_index ) const
+{
+	return instances[instance_index].object_to_world;
+}
+
+const glm::mat4& TopLevelBVH::getWorldToObject( int instance_index ) const
+{
+	return instances[instance_index].world_to_object;
+}
+
+float TopLevelBVH::getBuildTime( void ) const
+{
+	return build_time;
+}
+
+size_t TopLevelBVH::getMemoryBytes( void ) const
+{
+	return nodes.size() * sizeof( BVHLinearNode ) + instances.size() * sizeof( Instance ) + leaf_instances.size() * sizeof( int );
+}
+
+
+////////////////////////////////////////////////////
+// Build.
+////////////////////////////////////////////////////
+
+// Object median split along the longest centroid axis, cheap enough to rebuild the top level whenever
+// instances move.
+int TopLevelBVH::buildRecursive( std::vector<BVHBuildPrim> &prims, int start, int end )
+{
+	BVHBounds bounds, centroid_bounds;
+	for ( int i = start; i < end; ++i ) {
+		bounds.grow( prims[i].bounds );
+		centroid_bounds.grow( prims[i].centroid );
+	}
+
+	int node_index = (int)nodes.size();
+	nodes.emplace_back();
+
+	if ( end - start <= TLAS_MAX_LEAF_INSTANCES ) {
+		BVHLinearNode &node = nodes[node_index];
+		node.bounds_min = bounds.min;
+		node.bounds_max = bounds.max;
+		node.prim_offset = start;
+		node.num_prims = (uint16_t)( end - start );
+		node.axis = 0;
+		node.prim_type = 0;
+		return node_index;
+	}
+
+	int split_axis = centroid_bounds.getLongestAxis();
+	int mid = start + ( end - start ) / 2;
+	std::nth_element( prims.begin() + start, prims.begin() + mid, prims.begin() + end, [split_axis]( const BVHBuildPrim &a, const BVHBuildPrim &b ) {
+		return a.centroid[split_axis] < b.centroid[split_axis];
+	} );
+
+	buildRecursive( prims, start, mid );
+	int second_child = buildRecursive( prims, mid, end );
+
+	BVHLinearNode &node = nodes[node_index];
+	node.bounds_min = bounds.min;
+	node.bounds_max = bounds.max;
+	node.second_child = second_child;
+	node.num_prims = 0;
+	node.axis = (uint8_t)split_axis;
+
+	return node_index;
+}
+
+
+////////////////////////////////////////////////////
+// Traversal.
+////////////////////////////////////////////////////
+
+Ray TopLevelBVH::toObjectSpace( const Instance &instance, const Ray *ray, float t_max ) const
+{
+	Ray object_ray;
+	object_ray.Origin = glm::vec3( instance.world_to_object * glm::vec4( ray->Origin, 1.0f ) );
+	object_ray.Direction = glm::mat3( instance.world_to_object ) * ray->Direction;
+	object_ray.DirectionInverse = 1.0f / object_ray.Direction;
+	object_ray.TMin = ray->TMin;
+	object_ray.TMax = t_max;
+	return object_ray;
+}
+
+// Ordered traversal as in BVH2::closestHit(). Every instance is entered with the closest hit so far as its
+// TMax, so its bottom-level traversal culls against it.
+bool TopLevelBVH::closestHit( Ray* ray, float& t, uint32_t& instance_index, uint32_t& prim_id, float& u, float& v ) const
+{
+	t = ray->TMax;
+	if ( nodes.empty() )
+		return false;
+
+	glm::vec3 inv_dir = 1.0f / ray->Direction;
+	int dir_is_neg[3] = { inv_dir.x < 0.0f, inv_dir.y < 0.0f, inv_dir.z < 0.0f };
+
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	int node_index = 0;
+
+	bool intersection_detected = false;
+
+	while ( true ) {
+		const BVHLinearNode &node = nodes[node_index];
+
+		if ( intersectBounds( node, ray->Origin, inv_dir, dir_is_neg, ray->TMin, t ) ) {
+			if ( !node.isLeaf() ) {
+				if ( dir_is_neg[node.axis] ) {
+					stack[stack_size++] = node_index + 1;
+					node_index = node.second_child;
+				}
+				else {
+					stack[stack_size++] = node.second_child;
+					node_index = node_index + 1;
+				}
+				continue;
+			}
+
+			for ( int i = 0; i < node.num_prims; ++i ) {
+				int index = leaf_instances[node.prim_offset + i];
+				Ray object_ray = toObjectSpace( instances[index], ray, t );
+
+				float tmp_t, tmp_u, tmp_v;
+				uint32_t tmp_prim_id;
+				if ( instances[index].blas->closestHit( &object_ray, tmp_t, tmp_prim_id, tmp_u, tmp_v ) && tmp_t < t ) {
+					intersection_detected = true;
+					t = tmp_t;
+					instance_index = (uint32_t)index;
+					prim_id = tmp_prim_id;
+					u = tmp_u;
+					v = tmp_v;
+				}
+			}
+		}
+
+		if ( stack_size == 0 )
+			break;
+		node_index = stack[--stack_size];
+	}
+
+	return intersection_detected;
+}
+
+bool TopLevelBVH::occluded( Ray* ray, float t_max ) const
+{
+	if ( nodes.empty() )
+		return false;
+
+	glm::vec3 inv_dir = 1.0f / ray->Direction;
+	int dir_is_neg[3] = { inv_dir.x < 0.0f, inv_dir.y < 0.0f, inv_dir.z < 0.0f };
+
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	int node_index = 0;
+
+	while ( true ) {
+		const BVHLinearNode &node = nodes[node_index];
+
+		if ( intersectBounds( node, ray->Origin, inv_dir, dir_is_neg, ray->TMin, t_max ) ) {
+			if ( !node.isLeaf() ) {
+				stack[stack_size++] = node.second_child;
+				node_index = node_index + 1;
+				continue;
+			}
+
+			for ( int i = 0; i < node.num_prims; ++i ) {
+				const Instance &instance = instances[leaf_instances[node.prim_offset + i]];
+				Ray object_ray = toObjectSpace( instance, ray, t_max );
+				if ( instance.blas->occluded( &object_ray, t_max ) ) {
+					return true;
+				}
+			}
+		}
+
+		if ( stack_size == 0 )
+			return false;
+		node_index = stack[--stack_size];
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef TOP_LEVEL_BVH_H
+#define TOP_LEVEL_BVH_H
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "BVHStructs.h"
+#include "../Accelerator.h"
+
+
+////////////////////////////////////////////////////
+// Constants.
+////////////////////////////////////////////////////
+
+const int TLAS_MAX_LEAF_INSTANCES = 2;
+
+
+////////////////////////////////////////////////////
+// BVHInstance.
+////////////////////////////////////////////////////
+
+// One placement of a bottom-level structure. Any number of instances can share the same structure.
+struct BVHInstance
+{
+	const Accelerator *blas;
+	glm::mat4 object_to_world;
+};
+
+
+////////////////////////////////////////////////////
+// TopLevelBVH.
+////////////////////////////////////////////////////
+
+// BVH over the world space bounds of instances. Rays reaching a leaf are taken into the object space of each
+// instance there and traced through its bottom-level structure. The direction is transformed but not
+// renormalized, so hit distances are the same in both spaces.
+class TopLevelBVH
+{
+public:
+	TopLevelBVH( int num_instances, const BVHInstance *instances );
+	~TopLevelBVH( void );
+
+	// Closest hit over all instances within [ray->TMin, ray->TMax]. prim_id is the hit reported by the
+	// instance's bottom-level structure.
+	bool closestHit( Ray* ray, float& t, uint32_t& instance_index, uint32_t& prim_id, float& u, float& v ) const;
+	bool occluded( Ray* ray, float t_max ) const;
+
+	int getNumInstances( void ) const;
+	const glm::mat4& getObjectToWorld( int instance_index ) const;
+	const glm::mat4& getWorldToObject( int instance_index ) const;
+
+	float getBuildTime( void ) const;
+
+	// Top-level nodes and instance data only, the bottom-level structures are shared.
+	size_t getMemoryBytes( void ) const;
+
+private:
+	struct Instance
+	{
+		const Accelerator *blas;
+		glm::mat4 object_to_world;
+		glm::mat4 world_to_object;
+	};
+
+	std::vector<BVHLinearNode> nodes;
+	std::vector<Instance> instances;
+	std::vector<int> leaf_instances;	// Instance indices in leaf order.
+	float build_time;
+
+	int buildRecursive( std::vector<BVHBuildPrim> &prims, int start, int end );
+
+	Ray toObjectSpace( const Instance &instance, const Ray *ray, float t_max ) const;
+};
+
+#endif
@@ -19,6 +19,9 @@ public:
 	const glm::vec3& GetPosition() const { return m_Position; }
 	const glm::vec3& GetDirection() const { return m_ForwardDirection; }
 
+	float GetNearClip() const { return m_NearClip; }
+	float GetFarClip() const { return m_FarClip; }
+
 	const std::vector<glm::vec3>& GetRayDirections() const { return m_RayDirections; }
 
 	float GetRotationSpeed();
@@ -1,5 +1,11 @@
 #include "Intersections.h"
 #include <algorithm>
+#include <limits>
+#include <cmath>
+
+#if KD_USE_SSE
+#include <emmintrin.h>
+#endif
 
 
 ////////////////////////////////////////////////////
@@ -46,6 +52,33 @@ bool Intersections::aabbIntersect(const boundingBox& bbox, Ray* ray, float& t_ne
 	return true;
 }
 
+// Variant returning the whole [t_near, t_far] interval. Axes the ray runs parallel to are only checked for
+// containment, so rays lying in a face of the box don't produce NaNs.
+bool Intersections::aabbIntersect(const boundingBox& bbox, Ray* ray, float& t_near, float& t_far)
+{
+	t_near = -std::numeric_limits<float>::max();
+	t_far = std::numeric_limits<float>::max();
+
+	for (int axis = 0; axis < 3; ++axis) {
+		float box_min = bbox.center[axis] - bbox.extends[axis];
+		float box_max = bbox.center[axis] + bbox.extends[axis];
+
+		if (ray->Direction[axis] == 0.0f) {
+			if (ray->Origin[axis] < box_min || ray->Origin[axis] > box_max)
+				return false;
+			continue;
+		}
+
+		float t1 = (box_min - ray->Origin[axis]) * ray->DirectionInverse[axis];
+		float t2 = (box_max - ray->Origin[axis]) * ray->DirectionInverse[axis];
+
+		t_near = std::max(t_near, std::min(t1, t2));
+		t_far = std::min(t_far, std::max(t1, t2));
+	}
+
+	return t_far >= 0.0f && t_near <= t_far;
+}
+
 
 
 ////////////////////////////////////////////////////
@@ -93,6 +126,265 @@ bool Intersections::triIntersect(Ray* ray, const glm::vec3& v0, const glm::vec3&
 	}
 }
 
+// Same test on a precomputed record, the edges come straight from memory instead of three vertex fetches.
+bool Intersections::triIntersect(Ray* ray, const KDTriRecord& tri, float &t, float& _u, float& _v)
+{
+	glm::vec3 h = glm::cross( ray->Direction, tri.e2 );
+	float a = glm::dot( tri.e1, h );
+
+	if ( a > -0.00001f && a < 0.00001f) {
+		return false;
+	}
+
+	float f = 1.0f / a;
+	glm::vec3 s = ray->Origin - tri.v0;
+	float u = f * glm::dot( s, h );
+
+	if ( u < 0.0f || u > 1.0f ) {
+		return false;
+	}
+
+	glm::vec3 q = glm::cross( s, tri.e1 );
+	float v = f * glm::dot( ray->Direction, q );
+
+	if ( v < 0.0f || u + v > 1.0f ) {
+		return false;
+	}
+
+	t = f * glm::dot( tri.e2, q );
+
+	if ( t > 0.00001f) {
+		_u = u;
+		_v = v;
+		return true;
+	}
+
+	return false;
+}
+
+// Any-hit variant for occlusion queries: only answers whether the hit lies in [t_min, t_max].
+bool Intersections::triOccluded(Ray* ray, const KDTriRecord& tri, float t_min, float t_max)
+{
+	glm::vec3 h = glm::cross( ray->Direction, tri.e2 );
+	float a = glm::dot( tri.e1, h );
+
+	if ( a > -0.00001f && a < 0.00001f) {
+		return false;
+	}
+
+	float f = 1.0f / a;
+	glm::vec3 s = ray->Origin - tri.v0;
+	float u = f * glm::dot( s, h );
+
+	if ( u < 0.0f || u > 1.0f ) {
+		return false;
+	}
+
+	glm::vec3 q = glm::cross( s, tri.e1 );
+	float v = f * glm::dot( ray->Direction, q );
+
+	if ( v < 0.0f || u + v > 1.0f ) {
+		return false;
+	}
+
+	float t = f * glm::dot( tri.e2, q );
+
+	return t > 0.00001f && t >= t_min && t <= t_max;
+}
+
+
+////////////////////////////////////////////////////
+// Moller-Trumbore against a block of KD_SIMD_WIDTH triangles.
+// Same math as the scalar test, one lane per triangle. Lanes failing a test are masked out and the nearest
+// surviving lane is picked at the end.
+////////////////////////////////////////////////////
+#if KD_USE_SSE
+
+namespace {
+	struct Vec3x4 {
+		__m128 x, y, z;
+	};
+
+	inline Vec3x4 load3x4(const float v[3][KD_SIMD_WIDTH])
+	{
+		return { _mm_load_ps(v[0]), _mm_load_ps(v[1]), _mm_load_ps(v[2]) };
+	}
+
+	inline Vec3x4 splat3x4(const glm::vec3& v)
+	{
+		return { _mm_set1_ps(v.x), _mm_set1_ps(v.y), _mm_set1_ps(v.z) };
+	}
+
+	inline __m128 dot3x4(const Vec3x4& a, const Vec3x4& b)
+	{
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a.x, b.x), _mm_mul_ps(a.y, b.y)), _mm_mul_ps(a.z, b.z));
+	}
+
+	inline Vec3x4 cross3x4(const Vec3x4& a, const Vec3x4& b)
+	{
+		return {
+			_mm_sub_ps(_mm_mul_ps(a.y, b.z), _mm_mul_ps(a.z, b.y)),
+			_mm_sub_ps(_mm_mul_ps(a.z, b.x), _mm_mul_ps(a.x, b.z)),
+			_mm_sub_ps(_mm_mul_ps(a.x, b.y), _mm_mul_ps(a.y, b.x))
+		};
+	}
+
+	// Lane mask of hits with t >= t_min, the caller adds its own upper bound. The operations and their order are the
+	// scalar test's, so a ray grazing an edge or a vertex gets the same answer from both leaf layouts.
+	inline __m128 triIntersectSSE(Ray* ray, const KDTriPacket& packet, float t_min, __m128& t, __m128& u, __m128& v)
+	{
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 sign_mask = _mm_set1_ps(-0.0f);
+
+		Vec3x4 dir = splat3x4(ray->Direction);
+		Vec3x4 e1 = load3x4(packet.e1);
+		Vec3x4 e2 = load3x4(packet.e2);
+
+		Vec3x4 h = cross3x4(dir, e2);
+		__m128 a = dot3x4(e1, h);
+		__m128 mask = _mm_cmpge_ps(_mm_andnot_ps(sign_mask, a), _mm_set1_ps(0.00001f));
+		__m128 f = _mm_div_ps(one, a);
+
+		Vec3x4 o = splat3x4(ray->Origin);
+		Vec3x4 v0 = load3x4(packet.v0);
+		Vec3x4 s = { _mm_sub_ps(o.x, v0.x), _mm_sub_ps(o.y, v0.y), _mm_sub_ps(o.z, v0.z) };
+		u = _mm_mul_ps(f, dot3x4(s, h));
+		mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+		Vec3x4 q = cross3x4(s, e1);
+		v = _mm_mul_ps(f, dot3x4(dir, q));
+		mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+		t = _mm_mul_ps(f, dot3x4(e2, q));
+		mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, _mm_set1_ps(0.00001f)));
+		return _mm_and_ps(mask, _mm_cmpge_ps(t, _mm_set1_ps(t_min)));
+	}
+}
+
+bool Intersections::triIntersect4(Ray* ray, const KDTriPacket& packet, float t_min, float &t, int& lane, float& _u, float& _v)
+{
+	__m128 t4, u4, v4;
+	__m128 mask = triIntersectSSE(ray, packet, t_min, t4, u4, v4);
+	mask = _mm_and_ps(mask, _mm_cmplt_ps(t4, _mm_set1_ps(t)));
+
+	if (_mm_movemask_ps(mask) == 0)
+		return false;
+
+	// Horizontal min over the hit lanes.
+	__m128 t_hits = _mm_or_ps(_mm_and_ps(mask, t4), _mm_andnot_ps(mask, _mm_set1_ps(std::numeric_limits<float>::max())));
+	__m128 t_min4 = _mm_min_ps(t_hits, _mm_shuffle_ps(t_hits, t_hits, _MM_SHUFFLE(2, 3, 0, 1)));
+	t_min4 = _mm_min_ps(t_min4, _mm_shuffle_ps(t_min4, t_min4, _MM_SHUFFLE(1, 0, 3, 2)));
+
+	int nearest = _mm_movemask_ps(_mm_and_ps(mask, _mm_cmpeq_ps(t_hits, t_min4)));
+	int i = 0;
+	while (!(nearest & (1 << i)))
+		++i;
+
+	alignas(16) float us[KD_SIMD_WIDTH], vs[KD_SIMD_WIDTH];
+	_mm_store_ps(us, u4);
+	_mm_store_ps(vs, v4);
+
+	t = _mm_cvtss_f32(t_min4);
+	lane = i;
+	_u = us[i];
+	_v = vs[i];
+	return true;
+}
+
+bool Intersections::triOccluded4(Ray* ray, const KDTriPacket& packet, float t_min, float t_max)
+{
+	__m128 t4, u4, v4;
+	__m128 mask = triIntersectSSE(ray, packet, t_min, t4, u4, v4);
+	mask = _mm_and_ps(mask, _mm_cmple_ps(t4, _mm_set1_ps(t_max)));
+	return _mm_movemask_ps(mask) != 0;
+}
+
+#else
+
+// Scalar fallback for targets without SSE2, lane by lane through the record test.
+static KDTriRecord getPacketRecord(const KDTriPacket& packet, int lane)
+{
+	KDTriRecord tri;
+	for (int c = 0; c < 3; ++c) {
+		tri.v0[c] = packet.v0[c][lane];
+		tri.e1[c] = packet.e1[c][lane];
+		tri.e2[c] = packet.e2[c][lane];
+	}
+	tri.tri_index = packet.tri_index[lane];
+	return tri;
+}
+
+bool Intersections::triIntersect4(Ray* ray, const KDTriPacket& packet, float t_min, float &t, int& lane, float& _u, float& _v)
+{
+	bool intersection_detected = false;
+	for (int i = 0; i < KD_SIMD_WIDTH; ++i) {
+		float tmp_t, tmp_u, tmp_v;
+		if (triIntersect(ray, getPacketRecord(packet, i), tmp_t, tmp_u, tmp_v) && tmp_t < t && tmp_t >= t_min) {
+			intersection_detected = true;
+			t = tmp_t;
+			lane = i;
+			_u = tmp_u;
+			_v = tmp_v;
+		}
+	}
+	return intersection_detected;
+}
+
+bool Intersections::triOccluded4(Ray* ray, const KDTriPacket& packet, float t_min, float t_max)
+{
+	for (int i = 0; i < KD_SIMD_WIDTH; ++i) {
+		if (triOccluded(ray, getPacketRecord(packet, i), t_min, t_max))
+			return true;
+	}
+	return false;
+}
+
+#endif
+
+
+////////////////////////////////////////////////////
+// Ray/sphere intersection.
+////////////////////////////////////////////////////
+
+// Nearest root of the ray/sphere quadratic, whether or not it lies in front of the ray. A ray starting inside
+// the sphere gets a negative t and misses it, like the renderer's sphere test always did.
+bool Intersections::sphereIntersect(Ray* ray, const glm::vec3& center, float radius, float& t)
+{
+	glm::vec3 origin = ray->Origin - center;
+
+	float a = glm::dot(ray->Direction, ray->Direction);
+	float b = 2.0f * glm::dot(origin, ray->Direction);
+	float c = glm::dot(origin, origin) - radius * radius;
+
+	float discriminant = b * b - 4.0f * a * c;
+	if (discriminant < 0.0f)
+		return false;
+
+	t = (-b - std::sqrt(discriminant)) / (2.0f * a);
+	return true;
+}
+
+// Both roots count: a ray starting inside the sphere is blocked on its way out.
+bool Intersections::sphereOccluded(Ray* ray, const glm::vec3& center, float radius, float t_min, float t_max)
+{
+	glm::vec3 origin = ray->Origin - center;
+
+	float a = glm::dot(ray->Direction, ray->Direction);
+	float b = 2.0f * glm::dot(origin, ray->Direction);
+	float c = glm::dot(origin, origin) - radius * radius;
+
+	float discriminant = b * b - 4.0f * a * c;
+	if (discriminant < 0.0f)
+		return false;
+
+	float sqrt_discriminant = std::sqrt(discriminant);
+	float t_near = (-b - sqrt_discriminant) / (2.0f * a);
+	float t_far = (-b + sqrt_discriminant) / (2.0f * a);
+
+	return (t_near >= t_min && t_near < t_max) || (t_far >= t_min && t_far < t_max);
+}
+
 
 ////////////////////////////////////////////////////
 // computeTriNormal().
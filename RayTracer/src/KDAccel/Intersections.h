@@ -15,7 +15,15 @@ public:
 	~Intersections( void );
 
 	static bool aabbIntersect( const boundingBox&  bbox, Ray* ray, float& t_near);
+	static bool aabbIntersect( const boundingBox&  bbox, Ray* ray, float& t_near, float& t_far);
 	static bool triIntersect(Ray* ray, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, float &t, float& _u, float& _v);
+	static bool triIntersect(Ray* ray, const KDTriRecord& tri, float &t, float& _u, float& _v);
+	static bool triOccluded(Ray* ray, const KDTriRecord& tri, float t_min, float t_max);
+	static bool triIntersect4(Ray* ray, const KDTriPacket& packet, float t_min, float &t, int& lane, float& _u, float& _v);
+	static bool triOccluded4(Ray* ray, const KDTriPacket& packet, float t_min, float t_max);
+
+	static bool sphereIntersect(Ray* ray, const glm::vec3& center, float radius, float& t);
+	static bool sphereOccluded(Ray* ray, const glm::vec3& center, float radius, float t_min, float t_max);
 
 	static glm::vec3 computeTriNormal( const glm::vec3&, const glm::vec3&, const glm::vec3& );
 };
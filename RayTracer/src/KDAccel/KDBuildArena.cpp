@@ -0,0 +1,97 @@
+#include "KDBuildArena.h"
+#include <algorithm>
+
+
+////////////////////////////////////////////////////
+// Constructor/destructor.
+////////////////////////////////////////////////////
+
+KDBuildArena::KDBuildArena( size_t block_size )
+{
+	this->block_size = block_size;
+	current_block = 0;
+	offset = 0;
+	bytes_used = 0;
+}
+
+KDBuildArena::~KDBuildArena()
+{
+	for ( const Block &block : blocks ) {
+		::operator delete[]( block.data, std::align_val_t( KD_ARENA_ALIGNMENT ) );
+	}
+}
+
+
+////////////////////////////////////////////////////
+// Allocation.
+////////////////////////////////////////////////////
+
+// Takes the memory from the first block at or after the current one with enough room left. Requests larger
+// than the block size get a block of their own.
+void* KDBuildArena::allocate( size_t bytes, size_t alignment )
+{
+	while ( current_block < blocks.size() ) {
+		const Block &block = blocks[current_block];
+		size_t start = ( offset + alignment - 1 ) & ~( alignment - 1 );
+		if ( start + bytes <= block.size ) {
+			offset = start + bytes;
+			bytes_used += bytes;
+			return block.data + start;
+		}
+
+		++current_block;
+		offset = 0;
+	}
+
+	Block block;
+	block.size = std::max( block_size, bytes );
+	block.data = static_cast<char*>( ::operator new[]( block.size, std::align_val_t( KD_ARENA_ALIGNMENT ) ) );
+	blocks.push_back( block );
+
+	current_block = blocks.size() - 1;
+	offset = bytes;
+	bytes_used += bytes;
+	return block.data;
+}
+
+void KDBuildArena::reset( void )
+{
+	current_block = 0;
+	offset = 0;
+	bytes_used = 0;
+}
+
+KDArenaMark KDBuildArena::getMark( void ) const
+{
+	KDArenaMark mark;
+	mark.block = current_block;
+	mark.offset = offset;
+	mark.bytes_used = bytes_used;
+	return mark;
+}
+
+void KDBuildArena::rewind( const KDArenaMark &mark )
+{
+	current_block = mark.block;
+	offset = mark.offset;
+	bytes_used = mark.bytes_used;
+}
+
+
+////////////////////////////////////////////////////
+// Getters.
+////////////////////////////////////////////////////
+
+size_t KDBuildArena::getBytesUsed( void ) const
+{
+	return bytes_used;
+}
+
+size_t KDBuildArena::getBytesReserved( void ) const
+{
+	size_t bytes = 0;
+	for ( const Block &block : blocks ) {
+		bytes += block.size;
+	}
+	return bytes;
+}
@@ -0,0 +1,81 @@
+#ifndef KD_BUILD_ARENA_H
+#define KD_BUILD_ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+
+////////////////////////////////////////////////////
+// Constants.
+////////////////////////////////////////////////////
+
+const size_t KD_ARENA_BLOCK_SIZE = 256 * 1024;
+const size_t KD_ARENA_ALIGNMENT = 64;	// Alignment of every block, the largest alignment allocate() supports.
+
+
+////////////////////////////////////////////////////
+// KDBuildArena.
+////////////////////////////////////////////////////
+
+// Allocation position of an arena, see KDBuildArena::rewind().
+struct KDArenaMark
+{
+	size_t block = 0;
+	size_t offset = 0;
+	size_t bytes_used = 0;
+};
+
+// Linear allocator for build-time memory. Allocations bump an offset into the current block and are never freed
+// one by one: reset() rewinds the arena while keeping its blocks for reuse, the destructor releases everything.
+// Only trivially destructible types may live in it. Not thread-safe, every build thread uses its own arenas.
+class KDBuildArena
+{
+public:
+	KDBuildArena( size_t block_size = KD_ARENA_BLOCK_SIZE );
+	~KDBuildArena( void );
+
+	KDBuildArena( const KDBuildArena& ) = delete;
+	KDBuildArena& operator=( const KDBuildArena& ) = delete;
+
+	void* allocate( size_t bytes, size_t alignment );
+	void reset( void );
+
+	// Frees everything allocated after the mark was taken, so the arena can be used as a stack.
+	KDArenaMark getMark( void ) const;
+	void rewind( const KDArenaMark &mark );
+
+	// Uninitialized storage for count elements, NULL for an empty array.
+	template <typename T>
+	T* allocArray( size_t count )
+	{
+		static_assert( std::is_trivially_destructible<T>::value, "arena memory is never destructed" );
+		return count > 0 ? static_cast<T*>( allocate( count * sizeof( T ), alignof( T ) ) ) : NULL;
+	}
+
+	template <typename T>
+	T* create( void )
+	{
+		static_assert( std::is_trivially_destructible<T>::value, "arena memory is never destructed" );
+		return new ( allocate( sizeof( T ), alignof( T ) ) ) T();
+	}
+
+	size_t getBytesUsed( void ) const;
+	size_t getBytesReserved( void ) const;
+
+private:
+	struct Block
+	{
+		char *data;
+		size_t size;
+	};
+
+	std::vector<Block> blocks;
+	size_t current_block;
+	size_t offset;
+	size_t block_size;
+	size_t bytes_used;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#include "KDMappedFile.h"
+
+#ifdef WL_PLATFORM_WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+////////////////////////////////////////////////////
+// Constructor/destructor.
+////////////////////////////////////////////////////
+
+KDMappedFile::KDMappedFile()
+{
+	data = NULL;
+	size = 0;
+
+#ifdef WL_PLATFORM_WINDOWS
+	file_handle = INVALID_HANDLE_VALUE;
+	mapping_handle = NULL;
+#endif
+}
+
+KDMappedFile::~KDMappedFile()
+{
+	close();
+}
+
+
+////////////////////////////////////////////////////
+// Getters.
+////////////////////////////////////////////////////
+
+const void* KDMappedFile::getData( void ) const
+{
+	return data;
+}
+
+size_t KDMappedFile::getSize( void ) const
+{
+	return size;
+}
+
+
+////////////////////////////////////////////////////
+// Mapping.
+////////////////////////////////////////////////////
+
+#ifdef WL_PLATFORM_WINDOWS
+
+bool KDMappedFile::open( const std::string &path )
+{
+	close();
+
+	file_handle = CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if ( file_handle == INVALID_HANDLE_VALUE )
+		return false;
+
+	LARGE_INTEGER file_size;
+	if ( !GetFileSizeEx( file_handle, &file_size ) || file_size.QuadPart == 0 ) {
+		close();
+		return false;
+	}
+
+	mapping_handle = CreateFileMappingA( file_handle, NULL, PAGE_READONLY, 0, 0, NULL );
+	if ( !mapping_handle ) {
+		close();
+		return false;
+	}
+
+	data = MapViewOfFile( mapping_handle, FILE_MAP_READ, 0, 0, 0 );
+	if ( !data ) {
+		close();
+		return false;
+	}
+
+	size = (size_t)file_size.QuadPart;
+	return true;
+}
+
+void KDMappedFile::close( void )
+{
+	if ( data )
+		UnmapViewOfFile( data );
+	if ( mapping_handle )
+		CloseHandle( mapping_handle );
+	if ( file_handle != INVALID_HANDLE_VALUE )
+		CloseHandle( file_handle );
+
+	data = NULL;
+	size = 0;
+	mapping_handle = NULL;
+	file_handle = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool KDMappedFile::open( const std::string &path )
+{
+	close();
+
+	int fd = ::open( path.c_str(), O_RDONLY );
+	if ( fd < 0 )
+		return false;
+
+	struct stat file_stat;
+	if ( fstat( fd, &file_stat ) != 0 || file_stat.st_size == 0 ) {
+		::close( fd );
+		return false;
+	}
+
+	// The mapping keeps its own reference to the file.
+	void *mapping = mmap( NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	::close( fd );
+	if ( mapping == MAP_FAILED )
+		return false;
+
+	data = mapping;
+	size = (size_t)file_stat.st_size;
+	return true;
+}
+
+void KDMappedFile::close( void )
+{
+	if ( data )
+		munmap( const_cast<void*>( data ), size );
+
+	data = NULL;
+	size = 0;
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef KD_MAPPED_FILE_H
+#define KD_MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+
+////////////////////////////////////////////////////
+// KDMappedFile.
+////////////////////////////////////////////////////
+
+// Read-only memory mapping of a whole file, used to load cached kd-trees without reading them through a stream.
+// The mapping lives as long as the object.
+class KDMappedFile
+{
+public:
+	KDMappedFile( void );
+	~KDMappedFile( void );
+
+	KDMappedFile( const KDMappedFile& ) = delete;
+	KDMappedFile& operator=( const KDMappedFile& ) = delete;
+
+	bool open( const std::string &path );
+	void close( void );
+
+	const void* getData( void ) const;
+	size_t getSize( void ) const;
+
+private:
+	const void *data;
+	size_t size;
+
+#ifdef WL_PLATFORM_WINDOWS
+	void *file_handle;
+	void *mapping_handle;
+#endif
+};
+
+#endif
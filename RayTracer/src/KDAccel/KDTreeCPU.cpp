@@ -1,9 +1,21 @@
 #include "KDTreeCPU.h"
 #include "Intersections.h"
+#include "KDMappedFile.h"
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
 #include <deque>
+#include <execution>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <thread>
 
 #include "../Scene.h"
 
@@ -14,12 +26,32 @@
 // Constructor/destructor.
 ////////////////////////////////////////////////////
 
-KDTreeCPU::KDTreeCPU(int num_tris, glm::uvec3* tris, int num_verts, glm::vec3* verts)
+KDTreeCPU::KDTreeCPU(int num_tris, glm::uvec3* tris, int num_verts, glm::vec3* verts, KDBuildMode build_mode, int num_bins, const char* cache_dir, bool simd_leaves)
 {
 	// Set class-level variables.
 	num_levels = 0;
 	num_leaves = 0;
 	num_nodes = 0;
+	this->build_mode = build_mode;
+	this->num_bins = std::max(num_bins, 2);
+
+	// Hand subtrees to their own threads until there are a few more subtrees than cores.
+	parallel_build_depth = 2;
+	for (unsigned int num_threads = std::thread::hardware_concurrency(); num_threads > 1; num_threads >>= 1) {
+		++parallel_build_depth;
+	}
+	build_time = 0.0f;
+	tree_memory = NULL;
+	tree_memory_bytes = 0;
+	linear_nodes = NULL;
+	num_linear_nodes = 0;
+	leaf_tris = NULL;
+	num_leaf_tris = 0;
+	leaf_packets = NULL;
+	leaf_ranks = NULL;
+	rope_leaves = NULL;
+	num_rope_leaves = 0;
+	this->simd_leaves = simd_leaves;
 	this->num_verts = num_verts;
 	this->num_tris = num_tris;
 
@@ -33,22 +65,62 @@ KDTreeCPU::KDTreeCPU(int num_tris, glm::uvec3* tris, int num_verts, glm::vec3* v
 		this->tris[i] = tris[i];
 	}
 
-	// Create list of triangle indices for first level of kd-tree.
-	int* tri_indices = new int[num_tris];
-	for (int i = 0; i < num_tris; ++i) {
-		tri_indices[i] = i;
+	// Compute bounding box for all triangles.
+	bbox = computeTightFittingBoundingBox(num_verts, verts);
+
+	loaded_from_cache = false;
+	root = NULL;
+	uint64_t cache_key = cache_dir ? computeCacheKey() : 0;
+	std::string cache_path = cache_dir ? getCachePath(cache_dir, cache_key) : std::string();
+
+	Walnut::Timer timer;
+	if (cache_dir && loadCache(cache_path, cache_key)) {
+		loaded_from_cache = true;
+		build_time = timer.ElapsedMillis();
 	}
+	else {
+		// Create list of triangle indices for first level of kd-tree.
+		KDBuildArena& root_arena = createBuildArena();
+		int* tri_indices = root_arena.allocArray<int>(num_tris);
+		for (int i = 0; i < num_tris; ++i) {
+			tri_indices[i] = i;
+		}
 
-	// Compute bounding box for all triangles.
-	boundingBox bbox = computeTightFittingBoundingBox(num_verts, verts);
+		// Build kd-tree and set root node.
+		root = constructTreeStackless(num_tris, tri_indices, bbox, root_arena);
+		build_time = timer.ElapsedMillis();
+
+		// build rope structure
+		KDTreeNode* ropes[6] = { NULL };
+		buildRopeStructure( root, ropes, true );
+
+		// Flatten into one contiguous, cache line aligned allocation and drop the pointer tree. The second node of
+		// the root's pair is an unused empty leaf.
+		std::vector<KDLinearNode> nodes(2);
+		std::vector<KDTriRecord> tri_records;
+		nodes[1].initLeaf(0, 0);
+		flattenTree(root, 0, nodes, tri_records);
+		padLeafTris(tri_records);
+
+		int num_flat_leaves = (int)std::count_if(nodes.begin(), nodes.end(), [](const KDLinearNode& node) { return node.isLeaf(); });
+		allocateTreeMemory((int)nodes.size(), num_flat_leaves, (int)tri_records.size());
+		std::copy(nodes.begin(), nodes.end(), linear_nodes);
+		buildLeafRanks();
+		flattenRopes(root, bbox.center - bbox.extends, bbox.center + bbox.extends);
+		if (KD_VEB_LAYOUT) {
+			layoutNodes(tri_records);
+		}
+		storeLeafTris(tri_records);
 
-	// Build kd-tree and set root node.
-	//root = constructTreeMedianSpaceSplit(num_tris, tri_indices, bbox, 1);
-	root = constructTreeStackless(num_tris, tri_indices, bbox);
+		root = NULL;
+		releaseBuildArenas();
 
-	// build rope structure
-	//KDTreeNode* ropes[6] = { NULL };
-	//buildRopeStructure( root, ropes, true );
+		if (cache_dir && !saveCache(cache_path, cache_key)) {
+			std::cout << "KD-tree cache: could not write " << cache_path << std::endl;
+		}
+	}
+
+	computeStats();
 }
 
 KDTreeCPU::~KDTreeCPU()
@@ -61,7 +133,10 @@ KDTreeCPU::~KDTreeCPU()
 		delete[] tris;
 	}
 
-	delete root;
+	// A cached tree's memory belongs to the mapping.
+	if (!loaded_from_cache) {
+		::operator delete[](tree_memory, std::align_val_t(KD_CACHE_LINE_SIZE));
+	}
 }
 
 
@@ -90,14 +165,79 @@ int KDTreeCPU::getNumNodes(void) const
 	return num_nodes;
 }
 
+int KDTreeCPU::getNumLinearNodes(void) const
+{
+	return num_linear_nodes;
+}
+
+// Size of everything traversal touches besides the mesh itself.
+size_t KDTreeCPU::getMemoryBytes(void) const
+{
+	return tree_memory_bytes;
+}
+
+KDBuildMode KDTreeCPU::getBuildMode(void) const
+{
+	return build_mode;
+}
+
+float KDTreeCPU::getBuildTime(void) const
+{
+	return build_time;
+}
+
+bool KDTreeCPU::getLoadedFromCache(void) const
+{
+	return loaded_from_cache;
+}
+
+const KDTreeStats& KDTreeCPU::getStats(void) const
+{
+	return stats;
+}
+
+void KDTreeCPU::getBounds(glm::vec3& bounds_min, glm::vec3& bounds_max) const
+{
+	bounds_min = bbox.center - bbox.extends;
+	bounds_max = bbox.center + bbox.extends;
+}
+
+bool KDTreeCPU::getSimdLeaves(void) const
+{
+	return simd_leaves;
+}
+
+KDMailboxStats KDTreeCPU::getMailboxStats(void) const
+{
+	KDMailboxStats stats;
+	for (const KDMailboxStatSlot& slot : mailbox_stats) {
+		stats.num_tested += slot.num_tested.load(std::memory_order_relaxed);
+		stats.num_skipped += slot.num_skipped.load(std::memory_order_relaxed);
+	}
+	return stats;
+}
+
+void KDTreeCPU::resetMailboxStats(void)
+{
+	for (KDMailboxStatSlot& slot : mailbox_stats) {
+		slot.num_tested = 0;
+		slot.num_skipped = 0;
+	}
+}
+
+const char* KDTreeCPU::getName(void) const
+{
+	return "KD-tree";
+}
+
 SplitAxis KDTreeCPU::getLongestBoundingBoxSide(const boundingBox& bbox)
 {
 	return (bbox.extends.x > bbox.extends.y && bbox.extends.x > bbox.extends.z) ? X_AXIS : (bbox.extends.y > bbox.extends.z ? Y_AXIS : Z_AXIS);
 }
 
-float KDTreeCPU::getMinTriValue(int tri_index, SplitAxis axis)
+float KDTreeCPU::getMinTriValue(int tri_index, SplitAxis axis) const
 {
-	glm::vec3 tri = tris[tri_index];
+	const glm::uvec3& tri = tris[tri_index];
 	glm::vec3 v0 = verts[(int)tri[0]];
 	glm::vec3 v1 = verts[(int)tri[1]];
 	glm::vec3 v2 = verts[(int)tri[2]];
@@ -113,9 +253,9 @@ float KDTreeCPU::getMinTriValue(int tri_index, SplitAxis axis)
 	}
 }
 
-float KDTreeCPU::getMaxTriValue(int tri_index, SplitAxis axis)
+float KDTreeCPU::getMaxTriValue(int tri_index, SplitAxis axis) const
 {
-	glm::vec3 tri = tris[tri_index];
+	const glm::uvec3& tri = tris[tri_index];
 	glm::vec3 v0 = verts[(int)tri[0]];
 	glm::vec3 v1 = verts[(int)tri[1]];
 	glm::vec3 v2 = verts[(int)tri[2]];
@@ -197,7 +337,7 @@ boundingBox KDTreeCPU::computeTightFittingBoundingBox(int num_tris, int* tri_ind
 
 	int verts_index;
 	for (int i = 0; i < num_tris; ++i) {
-		glm::uvec3 tri = tris[i];
+		glm::uvec3 tri = tris[tri_indices[i]];
 		verts_index = i * 3;
 		verts[verts_index] = this->verts[tri[0]];
 		verts[verts_index + 1] = this->verts[tri[1]];
@@ -213,10 +353,10 @@ boundingBox KDTreeCPU::computeTightFittingBoundingBox(int num_tris, int* tri_ind
 ////////////////////////////////////////////////////
 // constructTreeMedianSpaceSplit().
 ////////////////////////////////////////////////////
-KDTreeNode* KDTreeCPU::constructTreeMedianSpaceSplit(int num_tris, int* tri_indices, boundingBox bounds, int curr_depth)
+KDTreeNode* KDTreeCPU::constructTreeMedianSpaceSplit(int num_tris, int* tri_indices, boundingBox bounds, int curr_depth, KDBuildArena& arena, KDBuildArena& scratch)
 {
 	// Create new node.
-	KDTreeNode* node = new KDTreeNode();
+	KDTreeNode* node = arena.create<KDTreeNode>();
 	node->num_tris = num_tris;
 	node->tri_indices = tri_indices;
 
@@ -359,8 +499,9 @@ node->split_plane_value = median_val;
 
 
 // Allocate and initialize memory for temporary buffers to hold triangle indices for left and right subtrees.
-int* temp_left_tri_indices = new int[num_tris];
-int* temp_right_tri_indices = new int[num_tris];
+scratch.reset();
+int* temp_left_tri_indices = scratch.allocArray<int>(num_tris);
+int* temp_right_tri_indices = scratch.allocArray<int>(num_tris);
 
 // Populate temporary buffers.
 int left_tri_count = 0, right_tri_count = 0;
@@ -390,8 +531,8 @@ for (int i = 0; i < num_tris; ++i) {
 }
 
 // Allocate memory for lists of triangle indices for left and right subtrees.
-int* left_tri_indices = new int[left_tri_count];
-int* right_tri_indices = new int[right_tri_count];
+int* left_tri_indices = arena.allocArray<int>(left_tri_count);
+int* right_tri_indices = arena.allocArray<int>(right_tri_count);
 
 // Populate lists of triangle indices.
 int left_index = 0, right_index = 0;
@@ -406,13 +547,9 @@ for (int i = 0; i < num_tris; ++i) {
 	}
 }
 
-// Free temporary triangle indices buffers.
-delete[] temp_left_tri_indices;
-delete[] temp_right_tri_indices;
-
-// Recurse.
-node->left = constructTreeMedianSpaceSplit(left_tri_count, left_tri_indices, left_bbox, curr_depth + 1);
-node->right = constructTreeMedianSpaceSplit(right_tri_count, right_tri_indices, right_bbox, curr_depth + 1);
+// Recurse. The temporary buffers are dead by now, so the children can reuse the scratch arena.
+node->left = constructTreeMedianSpaceSplit(left_tri_count, left_tri_indices, left_bbox, curr_depth + 1, arena, scratch);
+node->right = constructTreeMedianSpaceSplit(right_tri_count, right_tri_indices, right_bbox, curr_depth + 1, arena, scratch);
 
 // Set node ID.
 node->id = num_nodes;
@@ -421,106 +558,84 @@ node->id = num_nodes;
 return node;
 }
 
-KDTreeNode* KDTreeCPU::constructTreeStackless(int num_tris, int* tri_indices, boundingBox bounds)
+KDTreeNode* KDTreeCPU::constructTreeStackless(int num_tris, int* tri_indices, boundingBox bounds, KDBuildArena& arena)
 {
-	std::deque<KDTreeNode*> nodesToSplit;
-	int num_nodes = 1;
-
 	// Create new node.
-	KDTreeNode* root_node = new KDTreeNode();
+	KDTreeNode* root_node = arena.create<KDTreeNode>();
 	root_node->num_tris = num_tris;
 	root_node->tri_indices = tri_indices;
 	root_node->bbox = bounds;
 	root_node->id = 0;
 
+	root_node->tri_bounds = arena.allocArray<KDTriBounds>(num_tris);
+	for (int i = 0; i < num_tris; ++i) {
+		for (int axis = 0; axis < 3; ++axis) {
+			root_node->tri_bounds[i].min[axis] = getMinTriValue(tri_indices[i], (SplitAxis)axis);
+			root_node->tri_bounds[i].max[axis] = getMaxTriValue(tri_indices[i], (SplitAxis)axis);
+		}
+	}
+
 	if (num_tris <= NUM_TRIS_PER_NODE)
 		return root_node;
 
-	nodesToSplit.push_back(root_node);
-
-
-	while (!nodesToSplit.empty()) {
-		KDTreeNode* node = nodesToSplit.back();
-		nodesToSplit.pop_back();
-
-		int currentDepth = node->id;
-
-		if (node->num_tris <= NUM_TRIS_PER_NODE || node->id >= MAX_DEPTH)
-			continue;
-
-		// Get longest side of bounding box.
-		SplitAxis longest_side = getLongestBoundingBoxSide(node->bbox);
-
-
-		// Find best splitting plane through SAH
-		float cost_traversal = 1.5f;
-		float cost_intersect = 1.0f;
-
-		SplitAxis min_cost_side = longest_side;
-		float min_cost = INFINITYY;
-		float min_splitting_plane = 0.0f;
-
-		float split_delta = 0.01f;
+	std::unique_ptr<KDBuildArena> event_arena = std::make_unique<KDBuildArena>();
+	KDBuildTask root_task;
+	root_task.node = root_node;
+	root_task.depth = 0;
+	if (build_mode == KD_BUILD_SWEEP)
+		initSplitEvents(root_task, *event_arena);
 
+	constructSubtree(root_task, std::move(event_arena));
 
-		#define SAH_PER_SIDE2 1
+	return root_node;
+}
 
-		#if SAH_PER_SIDE2
-		for (uint32_t side = 0; side < 3; side++) {
-			SplitAxis side_enum = (side == 0 ? X_AXIS : (side == 1 ? Y_AXIS : Z_AXIS));
-		#else
-			SplitAxis side_enum = longest_side;
-		#endif //  SAH_PER_SIDE
-			float min_s = node->bbox.center[side_enum] - node->bbox.extends[side_enum];
-			float max_s = node->bbox.center[side_enum] + node->bbox.extends[side_enum];
-			float s_length = max_s - min_s;
+// Splits the task's node and all of its descendants and returns the number of nodes created. Large children
+// near the top of the tree are built as independent tasks. Every subtree only depends on its own triangles,
+// so the resulting tree is the same no matter how many threads take part.
+int KDTreeCPU::constructSubtree(KDBuildTask subtree_task, std::unique_ptr<KDBuildArena> event_arena)
+{
+	// Nodes and index lists outlive this task, the temporary buffers only one split. Event lists are used as a
+	// stack: children's lists are allocated on top of their parent's and the queue is worked off last in first out.
+	KDBuildArena& arena = createBuildArena();
+	KDBuildArena scratch;
 
-			for (float current_delta = split_delta; current_delta < 1.0f; current_delta += split_delta) {
-				float current_plane = min_s + s_length * current_delta;
+	std::deque<KDBuildTask> nodesToSplit;
+	std::vector<std::future<int>> subtree_builds;
+	int num_nodes = 0;
 
-				boundingBox left_bb = node->bbox;
-				boundingBox right_bb = node->bbox;
+	nodesToSplit.push_back(subtree_task);
 
-				left_bb.extends[side_enum] = (current_plane - min_s) * 0.5f;
-				right_bb.extends[side_enum] = (max_s - current_plane) * 0.5f;
 
-				float area_left = 8.0f * (left_bb.extends[0] * left_bb.extends[1] + left_bb.extends[1] * left_bb.extends[2] + left_bb.extends[0] * left_bb.extends[2]);
-				float area_right = 8.0f * (right_bb.extends[0] * right_bb.extends[1] + right_bb.extends[1] * right_bb.extends[2] + right_bb.extends[0] * right_bb.extends[2]);
+	while (!nodesToSplit.empty()) {
+		KDBuildTask task = nodesToSplit.back();
+		nodesToSplit.pop_back();
 
-				// Count number of tris in each node now
-				uint32_t count_tris_left = 0, count_tris_right = 0;
-				for (int i = 0; i < node->num_tris; ++i) {
-					// Get min and max triangle values along desired axis.
-					float min_tri_val = getMinTriValue(node->tri_indices[i], side_enum);
-					float max_tri_val = getMaxTriValue(node->tri_indices[i], side_enum);
-					if (min_tri_val < current_plane) {
-						count_tris_left++;
-					}
-					if (max_tri_val >= current_plane) {
-						count_tris_right++;
-					}
-				}
+		// Every task still queued was pushed before this one, its lists lie below this task's. Anything above
+		// belongs to nodes that are done.
+		event_arena->rewind(task.events_end);
 
-				// This split does nothing, try the next
-				//if (count_tris_left == node->num_tris || count_tris_right == node->num_tris)
-				//	continue;
+		KDTreeNode* node = task.node;
+		int currentDepth = task.depth;
 
-				float cost = cost_traversal + area_left * ((float)count_tris_left) * cost_intersect + area_right * ((float)count_tris_right) * cost_intersect;
-				if (cost < min_cost) {
-					min_cost = cost;
-					min_splitting_plane = current_plane;
-					min_cost_side = side_enum;
-				}
-			}
-#if SAH_PER_SIDE2
-		}
-#endif
+		if (node->num_tris <= NUM_TRIS_PER_NODE || currentDepth >= MAX_DEPTH)
+			continue;
 
+		// Find best splitting plane through SAH
+		SplitAxis longest_side;
+		float median_val;
+
+		bool split_found;
+		if (build_mode == KD_BUILD_GRID)
+			split_found = findSplitGrid(node, longest_side, median_val);
+		else
+			split_found = findSplitSAH(task, longest_side, median_val);
+		if (!split_found)
+			continue;
 
-		longest_side = min_cost_side;
+		SplitAxis min_cost_side = longest_side;
 		float min_before = node->bbox.center[longest_side] - node->bbox.extends[longest_side];
 		float max_before = node->bbox.center[longest_side] + node->bbox.extends[longest_side];
-		float median_val = min_splitting_plane;
 
 		boundingBox left_bbox = node->bbox;
 		boundingBox right_bbox = node->bbox;
@@ -544,251 +659,1822 @@ KDTreeNode* KDTreeCPU::constructTreeStackless(int num_tris, int* tri_indices, bo
 		node->split_plane_value = median_val;
 
 
-		// Allocate and initialize memory for temporary buffers to hold triangle indices for left and right subtrees.
-		int* temp_left_tri_indices = new int[node->num_tris];
-		int* temp_right_tri_indices = new int[node->num_tris];
+		// Assign triangles by their bounds inside the node: left if they start before the plane, right if they end
+		// on or after it. Triangles lying in the plane go to both sides, a ray running inside the plane is only
+		// traced through one of them. The slot arrays hold each triangle's position in the child, or -1. Clipped
+		// bounds of a triangle touching a child's edge can come out inverted by rounding, those go right so none
+		// is lost.
+		scratch.reset();
+		int* left_slots = scratch.allocArray<int>(node->num_tris);
+		int* right_slots = scratch.allocArray<int>(node->num_tris);
 
-		// Populate temporary buffers.
 		int left_tri_count = 0, right_tri_count = 0;
-		float min_tri_val, max_tri_val;
 		for (int i = 0; i < node->num_tris; ++i) {
-			// Get min and max triangle values along desired axis.
-			min_tri_val = getMinTriValue(node->tri_indices[i], longest_side);
-			max_tri_val = getMaxTriValue(node->tri_indices[i], longest_side);
-
-			// Update temp_left_tri_indices.
-			if (min_tri_val < median_val) {
-				temp_left_tri_indices[i] = node->tri_indices[i];
-				++left_tri_count;
-			}
-			else {
-				temp_left_tri_indices[i] = -1;
-			}
-
-			// Update temp_right_tri_indices.
-			if (max_tri_val >= median_val) {
-				temp_right_tri_indices[i] = node->tri_indices[i];
-				++right_tri_count;
-			}
-			else {
-				temp_right_tri_indices[i] = -1;
-			}
+			const KDTriBounds& tri_bounds = node->tri_bounds[i];
+			left_slots[i] = goesLeft(tri_bounds.min[longest_side], tri_bounds.max[longest_side], median_val) ? left_tri_count++ : -1;
+			right_slots[i] = tri_bounds.max[longest_side] >= median_val || left_slots[i] < 0 ? right_tri_count++ : -1;
 		}
 
 		// Allocate memory for lists of triangle indices for left and right subtrees.
-		int* left_tri_indices = new int[left_tri_count];
-		int* right_tri_indices = new int[right_tri_count];
-
-		// Populate lists of triangle indices.
-		int left_index = 0, right_index = 0;
+		int* left_tri_indices = arena.allocArray<int>(left_tri_count);
+		int* right_tri_indices = arena.allocArray<int>(right_tri_count);
+		KDTriBounds* left_tri_bounds = arena.allocArray<KDTriBounds>(left_tri_count);
+		KDTriBounds* right_tri_bounds = arena.allocArray<KDTriBounds>(right_tri_count);
+
+		// Triangles on one side keep their bounds, straddling ones are clipped to each child.
+		glm::vec3 left_min = left_bbox.center - left_bbox.extends, left_max = left_bbox.center + left_bbox.extends;
+		glm::vec3 right_min = right_bbox.center - right_bbox.extends, right_max = right_bbox.center + right_bbox.extends;
 		for (int i = 0; i < node->num_tris; ++i) {
-			if (temp_left_tri_indices[i] != -1) {
-				left_tri_indices[left_index] = temp_left_tri_indices[i];
-				++left_index;
+			int tri_index = node->tri_indices[i];
+			bool straddles = left_slots[i] >= 0 && right_slots[i] >= 0;
+
+			if (left_slots[i] >= 0) {
+				left_tri_indices[left_slots[i]] = tri_index;
+				left_tri_bounds[left_slots[i]] = straddles ? clipTriBounds(tri_index, node->tri_bounds[i], left_min, left_max) : node->tri_bounds[i];
 			}
-			if (temp_right_tri_indices[i] != -1) {
-				right_tri_indices[right_index] = temp_right_tri_indices[i];
-				++right_index;
+			if (right_slots[i] >= 0) {
+				right_tri_indices[right_slots[i]] = tri_index;
+				right_tri_bounds[right_slots[i]] = straddles ? clipTriBounds(tri_index, node->tri_bounds[i], right_min, right_max) : node->tri_bounds[i];
 			}
 		}
 
-		// Free temporary triangle indices buffers.
-		delete[] temp_left_tri_indices;
-		delete[] temp_right_tri_indices;
+		KDBuildTask left_task, right_task;
+
+		// Both children always exist, an empty side becomes an empty leaf so every region of space has a node.
+		node->left = arena.create<KDTreeNode>();
+		node->left->num_tris = left_tri_count;
+		node->left->tri_indices = left_tri_indices;
+		node->left->tri_bounds = left_tri_bounds;
+		node->left->bbox = left_bbox;
+		node->left->id = currentDepth + 1;
+		node->left->split_plane_axis = min_cost_side;
+		num_nodes++;
 
-		
 		if (left_tri_count > 0) {
-			node->left = new KDTreeNode();
-			node->left->num_tris = left_tri_count;
-			node->left->tri_indices = left_tri_indices;
-			node->left->bbox = left_bbox;
-			node->left->id = currentDepth + 1;
-			node->left->split_plane_axis = min_cost_side;
-			nodesToSplit.push_back(node->left);
-			num_nodes++;
+			left_task.node = node->left;
+			left_task.depth = currentDepth + 1;
+		}
+		else {
+			node->left->is_leaf_node = true;
 		}
 
+		node->right = arena.create<KDTreeNode>();
+		node->right->num_tris = right_tri_count;
+		node->right->tri_indices = right_tri_indices;
+		node->right->tri_bounds = right_tri_bounds;
+		node->right->bbox = right_bbox;
+		node->right->id = currentDepth + 1;
+		node->right->split_plane_axis = min_cost_side;
+		num_nodes++;
+
 		if (right_tri_count > 0) {
-			node->right = new KDTreeNode();
-			node->right->num_tris = right_tri_count;
-			node->right->tri_indices = right_tri_indices;
-			node->right->bbox = right_bbox;
-			node->right->id = currentDepth + 1;
-			node->right->split_plane_axis = min_cost_side;
-			nodesToSplit.push_back(node->right);
-			num_nodes++;
+			right_task.node = node->right;
+			right_task.depth = currentDepth + 1;
 		}
+		else {
+			node->right->is_leaf_node = true;
+		}
+
+		// Hand the sorted event lists down. Events of triangles on one side keep their order, so only the new
+		// events of the clipped straddling triangles need sorting before they are merged in. All buffers are taken
+		// up front, the axes may run in parallel and the arenas aren't thread-safe.
+		if (build_mode == KD_BUILD_SWEEP) {
+			// Every triangle goes to at least one side.
+			int num_straddling = left_tri_count + right_tri_count - node->num_tris;
+			KDSplitEvent* left_events[3], * right_events[3], * left_straddling[3], * right_straddling[3];
+			for (int axis = 0; axis < 3; ++axis) {
+				left_events[axis] = scratch.allocArray<KDSplitEvent>(2 * (left_tri_count - num_straddling));
+				right_events[axis] = scratch.allocArray<KDSplitEvent>(2 * (right_tri_count - num_straddling));
+				left_straddling[axis] = scratch.allocArray<KDSplitEvent>(2 * num_straddling);
+				right_straddling[axis] = scratch.allocArray<KDSplitEvent>(2 * num_straddling);
+			}
+			if (left_task.node)
+				allocSplitEvents(left_task, *event_arena);
+			if (right_task.node)
+				allocSplitEvents(right_task, *event_arena);
+
+			auto splitEvents = [&](int axis) {
+				int num_left_events = 0, num_right_events = 0;
+				for (int i = 0; i < 2 * node->num_tris; ++i) {
+					const KDSplitEvent& e = task.events[axis][i];
+					int left_slot = left_slots[e.tri_slot];
+					int right_slot = right_slots[e.tri_slot];
+					if (left_slot >= 0 && right_slot >= 0) {
+						continue;
+					}
+
+					if (left_slot >= 0) {
+						left_events[axis][num_left_events++] = { e.position, left_slot, e.type };
+					}
+					else {
+						right_events[axis][num_right_events++] = { e.position, right_slot, e.type };
+					}
+				}
+
+				int num_straddling_events = 0;
+				for (int i = 0; i < node->num_tris; ++i) {
+					if (left_slots[i] < 0 || right_slots[i] < 0) {
+						continue;
+					}
 
-		//if (node->num_tris > left_index) {
+					const KDTriBounds& left_bounds = left_tri_bounds[left_slots[i]];
+					left_straddling[axis][num_straddling_events] = { left_bounds.min[axis], left_slots[i], EVENT_START };
+					left_straddling[axis][num_straddling_events + 1] = { left_bounds.max[axis], left_slots[i], EVENT_END };
+
+					const KDTriBounds& right_bounds = right_tri_bounds[right_slots[i]];
+					right_straddling[axis][num_straddling_events] = { right_bounds.min[axis], right_slots[i], EVENT_START };
+					right_straddling[axis][num_straddling_events + 1] = { right_bounds.max[axis], right_slots[i], EVENT_END };
+					num_straddling_events += 2;
+				}
+
+				auto eventLess = [](const KDSplitEvent& a, const KDSplitEvent& b) {
+					return a.position < b.position;
+				};
+				std::sort(left_straddling[axis], left_straddling[axis] + num_straddling_events, eventLess);
+				std::sort(right_straddling[axis], right_straddling[axis] + num_straddling_events, eventLess);
+
+				if (left_task.node)
+					std::merge(left_events[axis], left_events[axis] + num_left_events, left_straddling[axis], left_straddling[axis] + num_straddling_events, left_task.events[axis], eventLess);
+				if (right_task.node)
+					std::merge(right_events[axis], right_events[axis] + num_right_events, right_straddling[axis], right_straddling[axis] + num_straddling_events, right_task.events[axis], eventLess);
+			};
+
+			int axes[3] = { X_AXIS, Y_AXIS, Z_AXIS };
+			if (node->num_tris >= KD_PARALLEL_SPLIT_MIN_TRIS)
+				std::for_each(std::execution::par, axes, axes + 3, splitEvents);
+			else
+				std::for_each(axes, axes + 3, splitEvents);
+		}
 
-		//}
-		//if (node->num_tris > right_index) {
+		KDBuildTask* child_tasks[2] = { &left_task, &right_task };
+		for (KDBuildTask* child_task : child_tasks) {
+			if (!child_task->node)
+				continue;
+
+			if (child_task->depth <= parallel_build_depth && child_task->node->num_tris >= KD_PARALLEL_BUILD_MIN_TRIS) {
+				// The subtree's thread gets its own copy of the event lists, this thread rewinds over them.
+				std::unique_ptr<KDBuildArena> subtree_event_arena = std::make_unique<KDBuildArena>();
+				KDBuildTask subtree_task = *child_task;
+				if (build_mode == KD_BUILD_SWEEP) {
+					allocSplitEvents(subtree_task, *subtree_event_arena);
+					for (int axis = 0; axis < 3; ++axis)
+						std::copy(child_task->events[axis], child_task->events[axis] + 2 * child_task->node->num_tris, subtree_task.events[axis]);
+				}
+				subtree_builds.push_back(std::async(std::launch::async, &KDTreeCPU::constructSubtree, this, subtree_task, std::move(subtree_event_arena)));
+			}
+			else
+				nodesToSplit.push_back(*child_task);
+		}
+	}
 
-		//}
+	for (std::future<int>& subtree_build : subtree_builds) {
+		num_nodes += subtree_build.get();
 	}
 
-	std::cout << "Node count: " << num_nodes;
-	return root_node;
+	return num_nodes;
+}
+
+// Called from every build thread. The arena stays valid until releaseBuildArenas().
+KDBuildArena& KDTreeCPU::createBuildArena(void)
+{
+	std::lock_guard<std::mutex> lock(build_arenas_mutex);
+	build_arenas.push_back(std::make_unique<KDBuildArena>());
+	return *build_arenas.back();
+}
+
+// Frees all pointer tree nodes and index lists in one go.
+void KDTreeCPU::releaseBuildArenas(void)
+{
+	std::lock_guard<std::mutex> lock(build_arenas_mutex);
+	build_arenas.clear();
 }
 
 
 ////////////////////////////////////////////////////
-// Recursive (needs a stack) kd-tree traversal method to test for intersections with passed-in ray.
+// Split plane search.
 ////////////////////////////////////////////////////
 
-// Public-facing wrapper method.
-bool KDTreeCPU::intersect(Ray* ray, float& t, uint32_t& tri_index, float& u, float& v) const
+// Tests 99 evenly spaced planes per axis and counts the triangles on each side for every one of them.
+bool KDTreeCPU::findSplitGrid(const KDTreeNode* node, SplitAxis& split_axis, float& split_value)
 {
-	t = INFINITYY;
-	return intersect(root, ray, t, tri_index, u, v);
-}
+	// Get longest side of bounding box.
+	SplitAxis longest_side = getLongestBoundingBoxSide(node->bbox);
+
+	// Find best splitting plane through SAH
+	float cost_traversal = KD_COST_TRAVERSAL;
+	float cost_intersect = KD_COST_INTERSECT;
 
+	SplitAxis min_cost_side = longest_side;
+	float min_cost = INFINITYY;
+	float min_splitting_plane = 0.0f;
 
+	float split_delta = 0.01f;
 
-// Private recursive call.
-bool KDTreeCPU::intersect(KDTreeNode* curr_node, Ray* ray, float& t, uint32_t& tri_index, float& u, float& v) const
-{
-	// Perform ray/AABB intersection test.
-	//bool intersects_aabb = Intersections::aabbIntersect2( curr_node->bbox, ray_o, ray_dir);
-	float dist_aabb_near = INFINITYY;
-	bool intersects_aabb = Intersections::aabbIntersect(curr_node->bbox, ray, dist_aabb_near);
 
-	if (dist_aabb_near > t)
-		return false;
+	#define SAH_PER_SIDE2 1
 
-	if (intersects_aabb) {
-		// If current node is a leaf node.
-		if (!curr_node->left && !curr_node->right) {
-			// Check triangles for intersections.
-			bool intersection_detected = false;
-			for (int i = 0; i < curr_node->num_tris; ++i) {
-				int triIndex = curr_node->tri_indices[i];
-				//const glm::uvec3& tri = tris[triIndex];
-				const glm::uvec3& tri = tris[triIndex];
-				const glm::vec3& v0 = verts[tri[0]];
-				const glm::vec3& v1 = verts[tri[1]];
-				const glm::vec3& v2 = verts[tri[2]];
-
-				// Perform ray/triangle intersection test.
-				float tmp_t = INFINITYY;
-				float tmp_u = 0.0f;
-				float tmp_v = 0.0f;
-				bool intersects_tri = Intersections::triIntersect(ray, v0, v1, v2, tmp_t, tmp_u, tmp_v);
-
-
-				// intersects and no backface was hit
-				//if (intersects_tri && glm::dot(glm::cross(v0 - v1, v0 - v2), ray_dir) < 0.0f) {
-				if (intersects_tri) {
-					intersection_detected = true;
-					if (tmp_t < t) {
-						t = tmp_t;
-						tri_index = triIndex;
-						u = tmp_u;
-						v = tmp_v;
-					}
+	#if SAH_PER_SIDE2
+	for (uint32_t side = 0; side < 3; side++) {
+		SplitAxis side_enum = (side == 0 ? X_AXIS : (side == 1 ? Y_AXIS : Z_AXIS));
+	#else
+		SplitAxis side_enum = longest_side;
+	#endif //  SAH_PER_SIDE
+		float min_s = node->bbox.center[side_enum] - node->bbox.extends[side_enum];
+		float max_s = node->bbox.center[side_enum] + node->bbox.extends[side_enum];
+		float s_length = max_s - min_s;
+
+		for (float current_delta = split_delta; current_delta < 1.0f; current_delta += split_delta) {
+			float current_plane = min_s + s_length * current_delta;
+
+			boundingBox left_bb = node->bbox;
+			boundingBox right_bb = node->bbox;
+
+			left_bb.extends[side_enum] = (current_plane - min_s) * 0.5f;
+			right_bb.extends[side_enum] = (max_s - current_plane) * 0.5f;
+
+			float area_left = 8.0f * (left_bb.extends[0] * left_bb.extends[1] + left_bb.extends[1] * left_bb.extends[2] + left_bb.extends[0] * left_bb.extends[2]);
+			float area_right = 8.0f * (right_bb.extends[0] * right_bb.extends[1] + right_bb.extends[1] * right_bb.extends[2] + right_bb.extends[0] * right_bb.extends[2]);
+
+			// Count number of tris in each node now
+			uint32_t count_tris_left = 0, count_tris_right = 0;
+			for (int i = 0; i < node->num_tris; ++i) {
+				// Get min and max triangle values along desired axis.
+				float min_tri_val = node->tri_bounds[i].min[side_enum];
+				float max_tri_val = node->tri_bounds[i].max[side_enum];
+				if (goesLeft(min_tri_val, max_tri_val, current_plane)) {
+					count_tris_left++;
+				}
+				if (max_tri_val >= current_plane) {
+					count_tris_right++;
 				}
 			}
 
-			return intersection_detected;
-		}
-		// Else, recurse.
-		else {
-			bool hit_left = false, hit_right = false;
-			if (curr_node->left) {
-				hit_left = intersect(curr_node->left, ray, t, tri_index, u, v);
+			// This split does nothing, try the next
+			//if (count_tris_left == node->num_tris || count_tris_right == node->num_tris)
+			//	continue;
+
+			float cost = cost_traversal + area_left * ((float)count_tris_left) * cost_intersect + area_right * ((float)count_tris_right) * cost_intersect;
+			if (count_tris_left == 0 || count_tris_right == 0) {
+				cost *= 1.0f - KD_EMPTY_SPACE_BONUS;
 			}
-			if (curr_node->right) {
-				hit_right = intersect(curr_node->right, ray, t, tri_index, u, v);
+			if (cost < min_cost) {
+				min_cost = cost;
+				min_splitting_plane = current_plane;
+				min_cost_side = side_enum;
 			}
-			return hit_left || hit_right;
 		}
+#if SAH_PER_SIDE2
 	}
+#endif
 
-	return false;
+	split_axis = min_cost_side;
+	split_value = min_splitting_plane;
+	return true;
 }
 
+// Picks the cheapest plane over all three axes. The axes are evaluated in parallel for large nodes; the
+// reduction always runs in axis order so ties resolve the same way as in a serial build.
+bool KDTreeCPU::findSplitSAH(const KDBuildTask& task, SplitAxis& split_axis, float& split_value)
+{
+	const KDTreeNode* node = task.node;
+
+	float axis_costs[3] = { INFINITYY, INFINITYY, INFINITYY };
+	float axis_planes[3] = { 0.0f, 0.0f, 0.0f };
+
+	auto evaluateAxis = [&](int axis) {
+		if (build_mode == KD_BUILD_SWEEP)
+			findSplitSweep(task, (SplitAxis)axis, axis_costs[axis], axis_planes[axis]);
+		else
+			findSplitBinned(node, (SplitAxis)axis, axis_costs[axis], axis_planes[axis]);
+	};
+
+	int axes[3] = { X_AXIS, Y_AXIS, Z_AXIS };
+	if (node->num_tris >= KD_PARALLEL_SPLIT_MIN_TRIS)
+		std::for_each(std::execution::par, axes, axes + 3, evaluateAxis);
+	else
+		std::for_each(axes, axes + 3, evaluateAxis);
+
+	float min_cost = INFINITYY;
+	for (int axis = 0; axis < 3; ++axis) {
+		if (axis_costs[axis] < min_cost) {
+			min_cost = axis_costs[axis];
+			split_value = axis_planes[axis];
+			split_axis = (SplitAxis)axis;
+		}
+	}
+
+	// Splitting is only worth it if it is cheaper than intersecting every triangle of the node.
+	return min_cost < KD_COST_INTERSECT * (float)node->num_tris;
+}
+
+// Exact SAH: every triangle bound inside the node is a candidate plane. The events of each axis are sorted,
+// so the left/right triangle counts for all candidates fall out of a single linear sweep.
+void KDTreeCPU::findSplitSweep(const KDBuildTask& task, SplitAxis axis, float& min_cost, float& split_value) const
+{
+	const KDTreeNode* node = task.node;
+	const KDSplitEvent* events = task.events[axis];
+	size_t num_events = 2 * (size_t)node->num_tris;
+
+	float min_s = node->bbox.center[axis] - node->bbox.extends[axis];
+	float max_s = node->bbox.center[axis] + node->bbox.extends[axis];
+
+	// A triangle goes left if its min lies before the plane and right if its max lies on or after it. Triangles
+	// lying in the plane go to both sides.
+	int num_left = 0;
+	int num_right = node->num_tris;
+
+	size_t i = 0;
+	while (i < num_events) {
+		float current_plane = events[i].position;
+
+		int num_starting = 0, num_ending = 0, num_planar = 0;
+		while (i < num_events && events[i].position == current_plane) {
+			if (events[i].type == EVENT_START) {
+				++num_starting;
+				if (node->tri_bounds[events[i].tri_slot].max[axis] == current_plane) {
+					++num_planar;
+				}
+			}
+			else {
+				++num_ending;
+			}
+			++i;
+		}
+
+		if (current_plane > min_s && current_plane < max_s && isSplitUseful(node->num_tris, num_left + num_planar, num_right)) {
+			float cost = getSplitCost(node->bbox, axis, current_plane, num_left + num_planar, num_right);
+			if (cost < min_cost) {
+				min_cost = cost;
+				split_value = current_plane;
+			}
+		}
 
-bool KDTreeCPU::intersectStackless(Ray* ray, float& t, uint32_t& tri_index, float& u, float& v) const
+		num_left += num_starting;
+		num_right -= num_ending;
+	}
+}
+
+// Approximate SAH: one pass over the node's triangles drops each min/max into one of num_bins bins.
+// Prefix sums over the bins then give the left/right counts for the num_bins - 1 bin borders.
+void KDTreeCPU::findSplitBinned(const KDTreeNode* node, SplitAxis axis, float& min_cost, float& split_value) const
 {
-	t = INFINITYY;
+	if (node->bbox.extends[axis] <= 0.0f) {
+		return;
+	}
 
-	std::deque<KDTreeNode*> currentNodeQueue;
-	currentNodeQueue.push_back(root);
+	std::vector<int> min_bins(num_bins, 0);
+	std::vector<int> max_bins(num_bins, 0);
+	std::vector<int> planar_borders(num_bins, 0);
 
-	bool intersection_detected = false;
+	float node_min = node->bbox.center[axis] - node->bbox.extends[axis];
+	float bin_width = 2.0f * node->bbox.extends[axis] / (float)num_bins;
+	float bin_scale = 1.0f / bin_width;
 
-	while (!currentNodeQueue.empty()) {
+	// Bin b holds values in [plane(b), plane(b + 1)). The estimate from bin_scale is nudged so the bins agree
+	// exactly with the comparisons the split itself makes, otherwise rounding can hide straddling triangles.
+	auto getBin = [&](float value) {
+		int bin = glm::clamp((int)((value - node_min) * bin_scale), 0, num_bins - 1);
+		while (bin > 0 && value < node_min + bin_width * (float)bin) {
+			--bin;
+		}
+		while (bin < num_bins - 1 && value >= node_min + bin_width * (float)(bin + 1)) {
+			++bin;
+		}
+		return bin;
+	};
+
+	// A triangle lying exactly in a border also goes left there, planar_borders[b] counts those at border b.
+	for (int i = 0; i < node->num_tris; ++i) {
+		float tri_min = node->tri_bounds[i].min[axis];
+		float tri_max = node->tri_bounds[i].max[axis];
+		int min_bin = getBin(tri_min);
+		++min_bins[min_bin];
+		++max_bins[getBin(tri_max)];
+
+		if (min_bin > 0 && goesLeft(tri_min, tri_max, node_min + bin_width * (float)min_bin)) {
+			++planar_borders[min_bin];
+		}
+	}
 
-		KDTreeNode* node = currentNodeQueue.back();
-		currentNodeQueue.pop_back();
+	// Triangles starting in a bin below the border go left, triangles ending in a bin above it go right.
+	int num_left = 0;
+	int num_right = node->num_tris;
 
-		float dist_aabb_near = INFINITYY;
-		bool intersects_aabb = Intersections::aabbIntersect(node->bbox, ray, dist_aabb_near);
+	for (int b = 1; b < num_bins; ++b) {
+		num_left += min_bins[b - 1];
+		num_right -= max_bins[b - 1];
 
-		if (!intersects_aabb || dist_aabb_near > t)
+		if (!isSplitUseful(node->num_tris, num_left + planar_borders[b], num_right)) {
 			continue;
+		}
 
-		// is leaf
-		if ((!node->left && !node->right)) {
-			for (int i = 0; i < node->num_tris; ++i) {
-				int triIndex = node->tri_indices[i];
-				//const glm::uvec3& tri = tris[triIndex];
-				const glm::uvec3& tri = tris[triIndex];
-				const glm::vec3& v0 = verts[tri[0]];
-				const glm::vec3& v1 = verts[tri[1]];
-				const glm::vec3& v2 = verts[tri[2]];
-
-				// Perform ray/triangle intersection test.
-				float tmp_t = INFINITYY;
-				float tmp_u = 0.0f;
-				float tmp_v = 0.0f;
-				bool intersects_tri = Intersections::triIntersect(ray, v0, v1, v2, tmp_t, tmp_u, tmp_v);
-
-
-				// intersects and no backface was hit
-				//if (intersects_tri && glm::dot(glm::cross(v0 - v1, v0 - v2), ray_dir) < 0.0f) {
-				if (intersects_tri) {
-					intersection_detected = true;
-					if (tmp_t < t) {
-						t = tmp_t;
-						tri_index = triIndex;
-						u = tmp_u;
-						v = tmp_v;
-					}
-				}
-			}
+		float current_plane = node_min + bin_width * (float)b;
+		float cost = getSplitCost(node->bbox, axis, current_plane, num_left + planar_borders[b], num_right);
+		if (cost < min_cost) {
+			min_cost = cost;
+			split_value = current_plane;
 		}
-		else {
-			if (node->left) {
-				currentNodeQueue.push_back(node->left);
+	}
+}
+
+// Left side of a split, in the same comparison the split itself makes. Every triangle with max >= plane goes right.
+bool KDTreeCPU::goesLeft(float tri_min, float tri_max, float plane) const
+{
+	return tri_min < plane || (tri_min == plane && tri_max == plane);
+}
+
+// A child that keeps every triangle of its parent only makes progress if its sibling is empty space. Without
+// this, flat slivers along shared triangle edges (zero area in one dimension) keep getting split until MAX_DEPTH.
+bool KDTreeCPU::isSplitUseful(int num_tris, int num_left, int num_right) const
+{
+	if (num_left == num_tris && num_right > 0)
+		return false;
+	if (num_right == num_tris && num_left > 0)
+		return false;
+	return true;
+}
+
+float KDTreeCPU::getSplitCost(const boundingBox& bbox, SplitAxis axis, float plane, int num_left, int num_right) const
+{
+	float area = 8.0f * (bbox.extends[0] * bbox.extends[1] + bbox.extends[1] * bbox.extends[2] + bbox.extends[0] * bbox.extends[2]);
+	if (area <= 0.0f) {
+		return INFINITYY;
+	}
+
+	float min_s = bbox.center[axis] - bbox.extends[axis];
+	float max_s = bbox.center[axis] + bbox.extends[axis];
+
+	glm::vec3 left_extends = bbox.extends;
+	glm::vec3 right_extends = bbox.extends;
+	left_extends[axis] = (plane - min_s) * 0.5f;
+	right_extends[axis] = (max_s - plane) * 0.5f;
+
+	float area_left = 8.0f * (left_extends[0] * left_extends[1] + left_extends[1] * left_extends[2] + left_extends[0] * left_extends[2]);
+	float area_right = 8.0f * (right_extends[0] * right_extends[1] + right_extends[1] * right_extends[2] + right_extends[0] * right_extends[2]);
+
+	float cost = KD_COST_TRAVERSAL + KD_COST_INTERSECT * (area_left * (float)num_left + area_right * (float)num_right) / area;
+	if (num_left == 0 || num_right == 0) {
+		cost *= 1.0f - KD_EMPTY_SPACE_BONUS;
+	}
+	return cost;
+}
+
+// Takes the task's three event lists from the top of the arena.
+void KDTreeCPU::allocSplitEvents(KDBuildTask& task, KDBuildArena& event_arena) const
+{
+	for (int axis = 0; axis < 3; ++axis) {
+		task.events[axis] = event_arena.allocArray<KDSplitEvent>(2 * (size_t)task.node->num_tris);
+	}
+	task.events_end = event_arena.getMark();
+}
+
+// Creates and sorts the min/max events of all triangles in the task's node. Only needed once, for the root.
+void KDTreeCPU::initSplitEvents(KDBuildTask& task, KDBuildArena& event_arena)
+{
+	const KDTreeNode* node = task.node;
+	allocSplitEvents(task, event_arena);
+
+	int axes[3] = { X_AXIS, Y_AXIS, Z_AXIS };
+	std::for_each(std::execution::par, axes, axes + 3, [&](int axis) {
+		SplitAxis side_enum = (SplitAxis)axis;
+		KDSplitEvent* events = task.events[axis];
+
+		for (int i = 0; i < node->num_tris; ++i) {
+			events[2 * i] = { node->tri_bounds[i].min[side_enum], i, EVENT_START };
+			events[2 * i + 1] = { node->tri_bounds[i].max[side_enum], i, EVENT_END };
+		}
+
+		std::sort(std::execution::par, events, events + 2 * node->num_tris, [](const KDSplitEvent& a, const KDSplitEvent& b) {
+			return a.position < b.position;
+		});
+	});
+}
+
+
+// Bounds of the triangle clipped to the box, found by clipping the triangle polygon against the box's six planes
+// (Sutherland-Hodgman). The result is clamped to the box and to the triangle's bounds in the parent, which
+// also stands in if rounding clips the polygon away entirely. Without perfect splits the parent bounds are
+// only clamped to the box.
+KDTriBounds KDTreeCPU::clipTriBounds(int tri_index, const KDTriBounds& tri_bounds, const glm::vec3& box_min, const glm::vec3& box_max) const
+{
+	KDTriBounds clipped;
+	clipped.min = glm::max(tri_bounds.min, box_min);
+	clipped.max = glm::min(tri_bounds.max, box_max);
+
+	if (!KD_PERFECT_SPLITS) {
+		return clipped;
+	}
+
+	// Every plane adds at most one vertex.
+	const int max_polygon_verts = 9;
+	glm::vec3 polygon[max_polygon_verts], clipped_polygon[max_polygon_verts];
+	int num_polygon_verts = 3;
+
+	const glm::uvec3& tri = tris[tri_index];
+	polygon[0] = verts[tri[0]];
+	polygon[1] = verts[tri[1]];
+	polygon[2] = verts[tri[2]];
+
+	for (int plane = 0; plane < 6 && num_polygon_verts > 0; ++plane) {
+		int axis = plane >> 1;
+		bool is_max_plane = (plane & 1) != 0;
+		float plane_value = is_max_plane ? box_max[axis] : box_min[axis];
+
+		auto isInside = [&](const glm::vec3& p) {
+			return is_max_plane ? p[axis] <= plane_value : p[axis] >= plane_value;
+		};
+
+		int num_clipped_verts = 0;
+		for (int i = 0; i < num_polygon_verts; ++i) {
+			const glm::vec3& curr = polygon[i];
+			const glm::vec3& next = polygon[(i + 1) % num_polygon_verts];
+			bool curr_inside = isInside(curr);
+			bool next_inside = isInside(next);
+
+			if (curr_inside) {
+				clipped_polygon[num_clipped_verts++] = curr;
 			}
-			if (node->right) {
-				currentNodeQueue.push_back(node->right);
+			if (curr_inside != next_inside) {
+				float t = (plane_value - curr[axis]) / (next[axis] - curr[axis]);
+				glm::vec3 p = curr + t * (next - curr);
+				p[axis] = plane_value;
+				clipped_polygon[num_clipped_verts++] = p;
 			}
 		}
+
+		num_polygon_verts = num_clipped_verts;
+		std::copy(clipped_polygon, clipped_polygon + num_clipped_verts, polygon);
 	}
 
-	return intersection_detected;
+	if (num_polygon_verts == 0) {
+		return clipped;
+	}
+
+	glm::vec3 polygon_min = polygon[0], polygon_max = polygon[0];
+	for (int i = 1; i < num_polygon_verts; ++i) {
+		polygon_min = glm::min(polygon_min, polygon[i]);
+		polygon_max = glm::max(polygon_max, polygon[i]);
+	}
+
+	// Intersection points carry rounding error, widen them a little so a triangle is never dropped from a child
+	// it touches.
+	glm::vec3 margin = KD_TREE_EPSILON * (box_max - box_min);
+	polygon_min -= margin;
+	polygon_max += margin;
+
+	clipped.min = glm::clamp(polygon_min, clipped.min, clipped.max);
+	clipped.max = glm::clamp(polygon_max, clipped.min, clipped.max);
+	return clipped;
 }
 
 
 ////////////////////////////////////////////////////
-// Debug methods.
+// Flattening.
 ////////////////////////////////////////////////////
 
-void KDTreeCPU::printNumTrianglesInEachNode(KDTreeNode* curr_node, int curr_depth)
+// Depth-first layout of the sibling pairs, the node at node_index is already allocated. A missing child becomes
+// an empty leaf.
+void KDTreeCPU::flattenTree(KDTreeNode* curr_node, int node_index, std::vector<KDLinearNode>& nodes, std::vector<KDTriRecord>& tri_records)
 {
-	std::cout << "Level: " << curr_depth << ", Triangles: " << curr_node->num_tris << std::endl;
+	if (!curr_node) {
+		nodes[node_index].initLeaf((int)tri_records.size(), 0);
+		return;
+	}
 
-	if (curr_node->left) {
-		printNumTrianglesInEachNode(curr_node->left, curr_depth + 1);
+	curr_node->id = node_index;
+
+	if (!curr_node->left && !curr_node->right) {
+		padLeafTris(tri_records);
+		nodes[node_index].initLeaf((int)tri_records.size(), curr_node->num_tris);
+		for (int i = 0; i < curr_node->num_tris; ++i) {
+			const glm::uvec3& tri = tris[curr_node->tri_indices[i]];
+			tri_records.push_back({ verts[tri[0]], verts[tri[1]] - verts[tri[0]], verts[tri[2]] - verts[tri[0]], curr_node->tri_indices[i] });
+		}
+		return;
 	}
-	if (curr_node->right) {
-		printNumTrianglesInEachNode(curr_node->right, curr_depth + 1);
+
+	int children = (int)nodes.size();
+	nodes.resize(nodes.size() + 2);
+	nodes[node_index].initInner(curr_node->split_plane_axis, curr_node->split_plane_value, children);
+	flattenTree(curr_node->left, children, nodes, tri_records);
+	flattenTree(curr_node->right, children + 1, nodes, tri_records);
+}
+
+// Fills tri_records up to the next KD_SIMD_WIDTH boundary with degenerate records.
+void KDTreeCPU::padLeafTris(std::vector<KDTriRecord>& tri_records)
+{
+	while (tri_records.size() % KD_SIMD_WIDTH != 0) {
+		tri_records.push_back({ glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(0.0f), -1 });
 	}
 }
 
-void KDTreeCPU::printNodeIdsAndBounds(KDTreeNode* curr_node)
+// Carves the node, leaf triangle, leaf rank and rope arrays out of one zeroed allocation, each starting on a cache
+// line, in the order traversal touches them. Leaf triangles are stored in the simd_leaves layout only.
+void KDTreeCPU::allocateTreeMemory(int num_nodes, int num_leaves, int num_tri_records)
+{
+	size_t bytes = getTreeMemoryBytes(num_nodes, num_leaves, num_tri_records);
+	char* memory = static_cast<char*>(::operator new[](bytes, std::align_val_t(KD_CACHE_LINE_SIZE)));
+	std::memset(memory, 0, bytes);
+
+	placeTreeMemory(memory, num_nodes, num_leaves, num_tri_records);
+}
+
+namespace {
+	size_t alignToCacheLine(size_t bytes)
+	{
+		return (bytes + KD_CACHE_LINE_SIZE - 1) & ~(KD_CACHE_LINE_SIZE - 1);
+	}
+}
+
+// Every section starts on a cache line.
+size_t KDTreeCPU::getTreeMemoryBytes(int num_nodes, int num_leaves, int num_tri_records) const
+{
+	return alignToCacheLine(num_nodes * sizeof(KDLinearNode)) +
+		alignToCacheLine(getLeafTrisBytes(num_tri_records)) +
+		alignToCacheLine((num_nodes + 63) / 64 * sizeof(KDLeafRank)) +
+		alignToCacheLine(num_leaves * sizeof(KDRopeLeaf));
+}
+
+// Points the tree at a block of getTreeMemoryBytes() bytes, either freshly allocated or a mapped cache file.
+void KDTreeCPU::placeTreeMemory(char* memory, int num_nodes, int num_leaves, int num_tri_records)
+{
+	size_t nodes_bytes = alignToCacheLine(num_nodes * sizeof(KDLinearNode));
+	size_t tris_bytes = alignToCacheLine(getLeafTrisBytes(num_tri_records));
+	size_t ranks_bytes = alignToCacheLine((num_nodes + 63) / 64 * sizeof(KDLeafRank));
+
+	tree_memory = memory;
+	tree_memory_bytes = getTreeMemoryBytes(num_nodes, num_leaves, num_tri_records);
+	num_linear_nodes = num_nodes;
+	num_leaf_tris = num_tri_records;
+	num_rope_leaves = num_leaves;
+	linear_nodes = reinterpret_cast<KDLinearNode*>(tree_memory);
+	leaf_packets = simd_leaves ? reinterpret_cast<KDTriPacket*>(tree_memory + nodes_bytes) : NULL;
+	leaf_tris = simd_leaves ? NULL : reinterpret_cast<KDTriRecord*>(tree_memory + nodes_bytes);
+	leaf_ranks = reinterpret_cast<KDLeafRank*>(tree_memory + nodes_bytes + tris_bytes);
+	rope_leaves = reinterpret_cast<KDRopeLeaf*>(tree_memory + nodes_bytes + tris_bytes + ranks_bytes);
+}
+
+size_t KDTreeCPU::getLeafTrisBytes(int num_tri_records) const
+{
+	return simd_leaves ? num_tri_records / KD_SIMD_WIDTH * sizeof(KDTriPacket) : num_tri_records * sizeof(KDTriRecord);
+}
+
+// Writes the leaf triangle records in the leaf layout the tree was built for.
+void KDTreeCPU::storeLeafTris(const std::vector<KDTriRecord>& tri_records)
+{
+	if (!simd_leaves) {
+		std::copy(tri_records.begin(), tri_records.end(), leaf_tris);
+		return;
+	}
+
+	for (int i = 0; i < num_leaf_tris; ++i) {
+		KDTriPacket& packet = leaf_packets[i / KD_SIMD_WIDTH];
+		int lane = (int)(i % KD_SIMD_WIDTH);
+
+		for (int c = 0; c < 3; ++c) {
+			packet.v0[c][lane] = tri_records[i].v0[c];
+			packet.e1[c][lane] = tri_records[i].e1[c];
+			packet.e2[c][lane] = tri_records[i].e2[c];
+		}
+		packet.tri_index[lane] = tri_records[i].tri_index;
+	}
+}
+
+namespace {
+	int countBits(uint64_t x)
+	{
+		x = x - ((x >> 1) & 0x5555555555555555ull);
+		x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+		x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+		return (int)((x * 0x0101010101010101ull) >> 56);
+	}
+}
+
+// Numbers the leaves in node order, from the node flags.
+void KDTreeCPU::buildLeafRanks(void)
+{
+	int leaves_before = 0;
+	for (int word = 0; word < (num_linear_nodes + 63) / 64; ++word) {
+		KDLeafRank& rank = leaf_ranks[word];
+		rank.leaf_mask = 0;
+		rank.leaves_before = leaves_before;
+		for (int i = 0; i < 64 && word * 64 + i < num_linear_nodes; ++i) {
+			if (linear_nodes[word * 64 + i].isLeaf()) {
+				rank.leaf_mask |= (uint64_t)1 << i;
+			}
+		}
+		leaves_before += countBits(rank.leaf_mask);
+	}
+}
+
+// Index of a leaf's rope data: the leaves before it in node order.
+int KDTreeCPU::getLeafOrdinal(int node_index) const
+{
+	const KDLeafRank& rank = leaf_ranks[node_index / 64];
+	return rank.leaves_before + countBits(rank.leaf_mask & (((uint64_t)1 << (node_index % 64)) - 1));
+}
+
+
+// Resolves the leaves' ropes to node indices. Leaf bounds are rebuilt from the split values themselves, so a
+// leaf's exit distance is bit-identical to the split plane distance computed during descent.
+void KDTreeCPU::flattenRopes(KDTreeNode* curr_node, glm::vec3 node_min, glm::vec3 node_max)
+{
+	if (!curr_node->left && !curr_node->right) {
+		KDRopeLeaf& leaf = rope_leaves[getLeafOrdinal(curr_node->id)];
+		leaf.min = node_min;
+		leaf.max = node_max;
+		for (int i = 0; i < 6; ++i) {
+			leaf.ropes[i] = curr_node->ropes[i] ? curr_node->ropes[i]->id : -1;
+		}
+		return;
+	}
+
+	SplitAxis axis = curr_node->split_plane_axis;
+
+	glm::vec3 below_max = node_max;
+	below_max[axis] = curr_node->split_plane_value;
+	flattenRopes(curr_node->left, node_min, below_max);
+
+	glm::vec3 above_min = node_min;
+	above_min[axis] = curr_node->split_plane_value;
+	flattenRopes(curr_node->right, above_min, node_max);
+}
+
+
+// Reorders the flattened tree by sibling pairs into a van Emde Boas layout: the pairs of a subtree of height h
+// are split at half its height, the top treelet is laid out first, followed by each bottom treelet, all of them
+// recursively. Every treelet ends up contiguous at every scale, so a ray descending the upper tree crosses few
+// pages and cache lines. Subtrees that fit into a page keep the depth-first order, which packs a longer path
+// into each cache line. Leaf triangle records, leaf ranks and rope leaves are rewritten in the new node order.
+void KDTreeCPU::layoutNodes(std::vector<KDTriRecord>& tri_records)
+{
+	int num_pairs = num_linear_nodes / 2;
+
+	// Children are always allocated after their parent, so a backwards pass sees them first.
+	std::vector<int> pair_heights(num_pairs, 1);
+	std::vector<int> pair_counts(num_pairs, 1);
+	for (int pair = num_pairs - 1; pair >= 0; --pair) {
+		for (int i = 0; i < 2; ++i) {
+			const KDLinearNode& node = linear_nodes[2 * pair + i];
+			if (!node.isLeaf()) {
+				pair_heights[pair] = std::max(pair_heights[pair], pair_heights[node.getBelowChild() / 2] + 1);
+				pair_counts[pair] += pair_counts[node.getBelowChild() / 2];
+			}
+		}
+	}
+
+	std::vector<int> pair_order;
+	std::vector<int> bottom_pairs;
+	pair_order.reserve(num_pairs);
+	layoutSubtree(0, pair_heights[0], pair_heights, pair_counts, pair_order, bottom_pairs);
+
+	std::vector<int> new_index(num_linear_nodes);
+	for (int i = 0; i < num_pairs; ++i) {
+		new_index[2 * pair_order[i]] = 2 * i;
+		new_index[2 * pair_order[i] + 1] = 2 * i + 1;
+	}
+
+	std::vector<KDLinearNode> nodes(num_linear_nodes);
+	std::vector<KDTriRecord> records;
+	std::vector<KDRopeLeaf> ropes;
+	records.reserve(num_leaf_tris);
+	ropes.reserve(num_rope_leaves);
+
+	for (int i = 0; i < num_linear_nodes; ++i) {
+		int old_index = 2 * pair_order[i / 2] + i % 2;
+		const KDLinearNode& node = linear_nodes[old_index];
+
+		if (!node.isLeaf()) {
+			nodes[i].initInner(node.getSplitAxis(), node.split, new_index[node.getBelowChild()]);
+			continue;
+		}
+
+		int num_records = (node.getNumTris() + KD_SIMD_WIDTH - 1) / KD_SIMD_WIDTH * KD_SIMD_WIDTH;
+		nodes[i].initLeaf((int)records.size(), node.getNumTris());
+		records.insert(records.end(), tri_records.begin() + node.tri_offset, tri_records.begin() + node.tri_offset + num_records);
+
+		KDRopeLeaf rope_leaf = rope_leaves[getLeafOrdinal(old_index)];
+		for (int j = 0; j < 6; ++j) {
+			if (rope_leaf.ropes[j] >= 0) {
+				rope_leaf.ropes[j] = new_index[rope_leaf.ropes[j]];
+			}
+		}
+		ropes.push_back(rope_leaf);
+	}
+
+	std::copy(nodes.begin(), nodes.end(), linear_nodes);
+	tri_records.swap(records);
+	std::copy(ropes.begin(), ropes.end(), rope_leaves);
+	buildLeafRanks();
+}
+
+// Appends the pairs of the treelet of the given height below root_pair to pair_order, and the pairs right below
+// the treelet to bottom_pairs. pair_counts holds the number of pairs in each pair's subtree.
+void KDTreeCPU::layoutSubtree(int root_pair, int height, const std::vector<int>& pair_heights, const std::vector<int>& pair_counts, std::vector<int>& pair_order, std::vector<int>& bottom_pairs) const
+{
+	if (height == pair_heights[root_pair] && pair_counts[root_pair] * 2 * sizeof(KDLinearNode) <= KD_PAGE_SIZE) {
+		layoutDepthFirst(root_pair, pair_order);
+		return;
+	}
+
+	if (height == 1) {
+		pair_order.push_back(root_pair);
+		for (int i = 0; i < 2; ++i) {
+			const KDLinearNode& node = linear_nodes[2 * root_pair + i];
+			if (!node.isLeaf()) {
+				bottom_pairs.push_back(node.getBelowChild() / 2);
+			}
+		}
+		return;
+	}
+
+	int top_height = height / 2;
+	std::vector<int> middle_pairs;
+	layoutSubtree(root_pair, top_height, pair_heights, pair_counts, pair_order, middle_pairs);
+
+	for (int pair : middle_pairs) {
+		layoutSubtree(pair, std::min(height - top_height, pair_heights[pair]), pair_heights, pair_counts, pair_order, bottom_pairs);
+	}
+}
+
+void KDTreeCPU::layoutDepthFirst(int root_pair, std::vector<int>& pair_order) const
+{
+	pair_order.push_back(root_pair);
+	for (int i = 0; i < 2; ++i) {
+		const KDLinearNode& node = linear_nodes[2 * root_pair + i];
+		if (!node.isLeaf()) {
+			layoutDepthFirst(node.getBelowChild() / 2, pair_order);
+		}
+	}
+}
+
+
+////////////////////////////////////////////////////
+// Statistics.
+////////////////////////////////////////////////////
+
+// Walks the flattened tree with each node's bounds rebuilt from the split planes. The SAH cost uses the build's
+// cost model: every inner node a ray enters costs KD_COST_TRAVERSAL, every leaf KD_COST_INTERSECT per triangle.
+// Also sets num_levels, num_leaves and num_nodes.
+void KDTreeCPU::computeStats(void)
+{
+	stats = KDTreeStats();
+	stats.leaf_size_histogram.assign(KD_STATS_LEAF_SIZE_BINS, 0);
+	stats.num_nodes = num_linear_nodes;
+	stats.memory_bytes = getMemoryBytes();
+	stats.build_time = build_time;
+
+	struct StatsEntry
+	{
+		int node_index;
+		int depth;
+		glm::vec3 min, max;
+	};
+
+	auto surfaceArea = [](const glm::vec3& min, const glm::vec3& max) {
+		glm::vec3 d = max - min;
+		return 2.0f * (d.x * d.y + d.y * d.z + d.x * d.z);
+	};
+
+	glm::vec3 root_min = bbox.center - bbox.extends;
+	glm::vec3 root_max = bbox.center + bbox.extends;
+	float root_area = surfaceArea(root_min, root_max);
+
+	std::vector<StatsEntry> stack;
+	stack.push_back({ 0, 0, root_min, root_max });
+
+	double cost = 0.0;
+	while (!stack.empty()) {
+		StatsEntry entry = stack.back();
+		stack.pop_back();
+
+		const KDLinearNode& node = linear_nodes[entry.node_index];
+		float area = surfaceArea(entry.min, entry.max);
+
+		if (node.isLeaf()) {
+			int leaf_size = node.getNumTris();
+			cost += (double)area * KD_COST_INTERSECT * leaf_size;
+
+			++stats.num_leaves;
+			if (leaf_size == 0) {
+				++stats.num_empty_leaves;
+			}
+			stats.num_tri_refs += leaf_size;
+			++stats.leaf_size_histogram[std::min(leaf_size, KD_STATS_LEAF_SIZE_BINS - 1)];
+
+			if (entry.depth >= (int)stats.depth_histogram.size()) {
+				stats.depth_histogram.resize(entry.depth + 1, 0);
+			}
+			++stats.depth_histogram[entry.depth];
+			stats.max_depth = std::max(stats.max_depth, entry.depth);
+			continue;
+		}
+
+		cost += (double)area * KD_COST_TRAVERSAL;
+		++stats.num_inner_nodes;
+
+		SplitAxis axis = node.getSplitAxis();
+
+		glm::vec3 below_max = entry.max;
+		below_max[axis] = node.split;
+		stack.push_back({ node.getBelowChild(), entry.depth + 1, entry.min, below_max });
+
+		glm::vec3 above_min = entry.min;
+		above_min[axis] = node.split;
+		stack.push_back({ node.getAboveChild(), entry.depth + 1, above_min, entry.max });
+	}
+
+	stats.sah_cost = root_area > 0.0f ? (float)(cost / root_area) : 0.0f;
+	stats.duplication_factor = num_tris > 0 ? (float)stats.num_tri_refs / num_tris : 0.0f;
+	stats.empty_leaf_ratio = stats.num_leaves > 0 ? (float)stats.num_empty_leaves / stats.num_leaves : 0.0f;
+	int num_filled_leaves = stats.num_leaves - stats.num_empty_leaves;
+	stats.avg_leaf_tris = num_filled_leaves > 0 ? (float)stats.num_tri_refs / num_filled_leaves : 0.0f;
+
+	num_levels = stats.max_depth + 1;
+	num_leaves = stats.num_leaves;
+	num_nodes = stats.num_nodes;
+}
+
+std::string KDTreeCPU::getStatsJSON(void) const
+{
+	const char* build_mode_names[] = { "grid", "sweep", "binned" };
+
+	auto writeArray = [](std::ostringstream& json, const std::vector<int>& values) {
+		json << "[";
+		for (size_t i = 0; i < values.size(); ++i) {
+			json << (i > 0 ? ", " : "") << values[i];
+		}
+		json << "]";
+	};
+
+	std::ostringstream json;
+	json << "{\n";
+	json << "  \"accelerator\": \"" << getName() << "\",\n";
+	json << "  \"build_mode\": \"" << build_mode_names[build_mode] << "\",\n";
+	json << "  \"num_bins\": " << num_bins << ",\n";
+	json << "  \"loaded_from_cache\": " << (loaded_from_cache ? "true" : "false") << ",\n";
+	json << "  \"build_time_ms\": " << stats.build_time << ",\n";
+	json << "  \"memory_bytes\": " << stats.memory_bytes << ",\n";
+	json << "  \"num_tris\": " << num_tris << ",\n";
+	json << "  \"sah_cost\": " << stats.sah_cost << ",\n";
+	json << "  \"num_nodes\": " << stats.num_nodes << ",\n";
+	json << "  \"num_inner_nodes\": " << stats.num_inner_nodes << ",\n";
+	json << "  \"num_leaves\": " << stats.num_leaves << ",\n";
+	json << "  \"num_empty_leaves\": " << stats.num_empty_leaves << ",\n";
+	json << "  \"empty_leaf_ratio\": " << stats.empty_leaf_ratio << ",\n";
+	json << "  \"max_depth\": " << stats.max_depth << ",\n";
+	json << "  \"num_tri_refs\": " << stats.num_tri_refs << ",\n";
+	json << "  \"duplication_factor\": " << stats.duplication_factor << ",\n";
+	json << "  \"avg_leaf_tris\": " << stats.avg_leaf_tris << ",\n";
+	json << "  \"leaf_size_histogram\": ";
+	writeArray(json, stats.leaf_size_histogram);
+	json << ",\n";
+	json << "  \"depth_histogram\": ";
+	writeArray(json, stats.depth_histogram);
+	json << "\n}\n";
+
+	return json.str();
+}
+
+
+////////////////////////////////////////////////////
+// Cache.
+////////////////////////////////////////////////////
+
+static const AABBFace MIN_FACES[3] = { LEFT, BOTTOM, BACK };
+static const AABBFace MAX_FACES[3] = { RIGHT, TOP, FRONT };
+
+namespace {
+	// 64-bit FNV-1a.
+	const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+	const uint64_t FNV_PRIME = 1099511628211ull;
+
+	uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+	{
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; ++i) {
+			hash = (hash ^ bytes[i]) * FNV_PRIME;
+		}
+		return hash;
+	}
+
+	template <typename T>
+	uint64_t hashValue(uint64_t hash, const T& value)
+	{
+		return hashBytes(hash, &value, sizeof(T));
+	}
+}
+
+// Covers everything the flattened tree depends on: the mesh, the build parameters and the layout of the
+// cached records.
+uint64_t KDTreeCPU::computeCacheKey(void) const
+{
+	uint64_t key = FNV_OFFSET_BASIS;
+	key = hashValue(key, KD_CACHE_VERSION);
+	key = hashValue(key, (int)build_mode);
+	key = hashValue(key, num_bins);
+	key = hashValue(key, NUM_TRIS_PER_NODE);
+	key = hashValue(key, MAX_DEPTH);
+	key = hashValue(key, KD_COST_TRAVERSAL);
+	key = hashValue(key, KD_COST_INTERSECT);
+	key = hashValue(key, KD_EMPTY_SPACE_BONUS);
+	key = hashValue(key, KD_PERFECT_SPLITS);
+	key = hashValue(key, KD_VEB_LAYOUT);
+	key = hashValue(key, KD_SIMD_WIDTH);
+	key = hashValue(key, simd_leaves);
+	key = hashValue(key, sizeof(KDLinearNode));
+	key = hashValue(key, sizeof(KDTriRecord));
+	key = hashValue(key, sizeof(KDTriPacket));
+	key = hashValue(key, sizeof(KDRopeLeaf));
+	key = hashValue(key, num_verts);
+	key = hashValue(key, num_tris);
+	key = hashBytes(key, verts, num_verts * sizeof(glm::vec3));
+	key = hashBytes(key, tris, num_tris * sizeof(glm::uvec3));
+	return key;
+}
+
+std::string KDTreeCPU::getCachePath(const char* cache_dir, uint64_t key) const
+{
+	std::ostringstream name;
+	name << "kdtree_" << std::hex << key << ".kdc";
+	return (std::filesystem::path(cache_dir) / name.str()).string();
+}
+
+// Maps the file and traces the tree in place, nothing is copied. Anything that doesn't match the tree about to be
+// built, including truncated or damaged files, is rejected and the tree is built instead.
+bool KDTreeCPU::loadCache(const std::string& path, uint64_t key)
+{
+	static_assert(sizeof(KDCacheHeader) % KD_CACHE_LINE_SIZE == 0, "The tree block after the header has to stay cache line aligned");
+
+	if (!cache_file.open(path) || cache_file.getSize() < sizeof(KDCacheHeader)) {
+		cache_file.close();
+		return false;
+	}
+
+	KDCacheHeader header;
+	std::memcpy(&header, cache_file.getData(), sizeof(KDCacheHeader));
+
+	if (std::memcmp(header.magic, KD_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != KD_CACHE_VERSION ||
+		header.key != key || header.num_verts != num_verts || header.num_tris != num_tris ||
+		header.num_linear_nodes < 2 || header.num_linear_nodes % 2 != 0 || header.num_leaf_tris < 0 || header.num_leaf_tris % KD_SIMD_WIDTH != 0 ||
+		header.num_rope_leaves < 1 || header.num_rope_leaves > header.num_linear_nodes ||
+		cache_file.getSize() != sizeof(KDCacheHeader) + getTreeMemoryBytes(header.num_linear_nodes, header.num_rope_leaves, header.num_leaf_tris)) {
+		cache_file.close();
+		return false;
+	}
+
+	// The mapping is read-only, the traversals never write to the tree.
+	char* memory = const_cast<char*>(static_cast<const char*>(cache_file.getData())) + sizeof(KDCacheHeader);
+	placeTreeMemory(memory, header.num_linear_nodes, header.num_rope_leaves, header.num_leaf_tris);
+
+	if (!validateTreeMemory()) {
+		placeTreeMemory(NULL, 0, 0, 0);
+		cache_file.close();
+		return false;
+	}
+
+	bbox.center = glm::vec3(header.bbox_center[0], header.bbox_center[1], header.bbox_center[2]);
+	bbox.extends = glm::vec3(header.bbox_extends[0], header.bbox_extends[1], header.bbox_extends[2]);
+
+	return true;
+}
+
+// Checks every index the traversals follow, so a damaged file can't send them out of bounds or into a loop: leaves
+// stay within the triangle records, child pairs and ropes within the node array, leaf ranks match the nodes, the
+// nodes form one tree below the root pair no deeper than the MAX_DEPTH traversal stack, and every rope leads across
+// its leaf's face.
+bool KDTreeCPU::validateTreeMemory(void) const
+{
+	std::vector<uint8_t> pair_parents(num_linear_nodes / 2, 0);
+	int num_file_leaves = 0;
+	for (int word = 0; word < (num_linear_nodes + 63) / 64; ++word) {
+		if (leaf_ranks[word].leaves_before != num_file_leaves) {
+			return false;
+		}
+
+		uint64_t leaf_mask = 0;
+		for (int i = 0; i < 64 && word * 64 + i < num_linear_nodes; ++i) {
+			const KDLinearNode& node = linear_nodes[word * 64 + i];
+			if (node.isLeaf()) {
+				int num_records = simd_leaves ? (node.getNumTris() + KD_SIMD_WIDTH - 1) / KD_SIMD_WIDTH * KD_SIMD_WIDTH : node.getNumTris();
+				if (node.tri_offset < 0 || node.getNumTris() < 0 || node.tri_offset > num_leaf_tris - num_records ||
+					(simd_leaves && node.tri_offset % KD_SIMD_WIDTH != 0)) {
+					return false;
+				}
+				leaf_mask |= (uint64_t)1 << i;
+				num_file_leaves++;
+			}
+			else {
+				int below = node.getBelowChild();
+				if (below < 2 || below % 2 != 0 || below >= num_linear_nodes || pair_parents[below / 2]++ != 0) {
+					return false;
+				}
+			}
+		}
+
+		if (leaf_ranks[word].leaf_mask != leaf_mask) {
+			return false;
+		}
+	}
+
+	// Rope leaves are indexed by leaf ordinal, there has to be one for every leaf.
+	if (num_file_leaves != num_rope_leaves) {
+		return false;
+	}
+	for (int i = 0; i < num_rope_leaves; ++i) {
+		for (int face = 0; face < 6; ++face) {
+			if (rope_leaves[i].ropes[face] < -1 || rope_leaves[i].ropes[face] == 1 || rope_leaves[i].ropes[face] >= num_linear_nodes) {
+				return false;
+			}
+		}
+	}
+
+	// Every pair has one parent, so the walk terminates. It has to reach all nodes except the unused leaf next to
+	// the root, otherwise ropes could lead into a detached cycle. Node boxes are rebuilt from the split values the
+	// way flattenRopes() does it.
+	std::vector<glm::vec3> node_mins(num_linear_nodes), node_maxs(num_linear_nodes);
+	node_mins[0] = bbox.center - bbox.extends;
+	node_maxs[0] = bbox.center + bbox.extends;
+	std::vector<std::pair<int, int>> stack(1, std::make_pair(0, 0));
+	int num_reached = 0;
+	while (!stack.empty()) {
+		int node_index = stack.back().first;
+		int depth = stack.back().second;
+		stack.pop_back();
+		num_reached++;
+
+		const KDLinearNode& node = linear_nodes[node_index];
+		if (!node.isLeaf()) {
+			if (depth > MAX_DEPTH) {
+				return false;
+			}
+
+			int below = node.getBelowChild();
+			int above = node.getAboveChild();
+			SplitAxis axis = node.getSplitAxis();
+			node_mins[below] = node_mins[node_index];
+			node_maxs[below] = node_maxs[node_index];
+			node_maxs[below][axis] = node.split;
+			node_mins[above] = node_mins[node_index];
+			node_maxs[above] = node_maxs[node_index];
+			node_mins[above][axis] = node.split;
+
+			stack.push_back(std::make_pair(below, depth + 1));
+			stack.push_back(std::make_pair(above, depth + 1));
+		}
+	}
+	if (num_reached != num_linear_nodes - 1 || !linear_nodes[1].isLeaf()) {
+		return false;
+	}
+
+	// The rope traversal only moves on if each leaf's exit face matches its splits and the rope behind that face
+	// leads into a node covering all of it.
+	for (int node_index = 0; node_index < num_linear_nodes; ++node_index) {
+		if (node_index == 1 || !linear_nodes[node_index].isLeaf()) {
+			continue;
+		}
+
+		const KDRopeLeaf& leaf = rope_leaves[getLeafOrdinal(node_index)];
+		if (leaf.min != node_mins[node_index] || leaf.max != node_maxs[node_index]) {
+			return false;
+		}
+
+		for (int axis = 0; axis < 3; ++axis) {
+			for (int side = 0; side < 2; ++side) {
+				int rope = leaf.ropes[side == 0 ? MIN_FACES[axis] : MAX_FACES[axis]];
+				if (rope < 0) {
+					continue;
+				}
+
+				float leaf_face = side == 0 ? leaf.min[axis] : leaf.max[axis];
+				float rope_face = side == 0 ? node_maxs[rope][axis] : node_mins[rope][axis];
+				if (rope_face != leaf_face) {
+					return false;
+				}
+				for (int other = 0; other < 3; ++other) {
+					if (other != axis && (node_mins[rope][other] > leaf.min[other] || node_maxs[rope][other] < leaf.max[other])) {
+						return false;
+					}
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+// Written to a temporary file first and renamed into place, so a concurrent or interrupted write never leaves a
+// partial file under the final name.
+bool KDTreeCPU::saveCache(const std::string& path, uint64_t key) const
+{
+	KDCacheHeader header;
+	std::memset(&header, 0, sizeof(KDCacheHeader));
+	std::memcpy(header.magic, KD_CACHE_MAGIC, sizeof(header.magic));
+	header.version = KD_CACHE_VERSION;
+	header.key = key;
+	header.num_verts = num_verts;
+	header.num_tris = num_tris;
+	header.num_linear_nodes = num_linear_nodes;
+	header.num_leaf_tris = num_leaf_tris;
+	header.num_rope_leaves = num_rope_leaves;
+	for (int i = 0; i < 3; ++i) {
+		header.bbox_center[i] = bbox.center[i];
+		header.bbox_extends[i] = bbox.extends[i];
+	}
+
+	std::error_code error;
+	std::filesystem::path file_path(path);
+	if (file_path.has_parent_path()) {
+		std::filesystem::create_directories(file_path.parent_path(), error);
+	}
+
+	std::string tmp_path = path + ".tmp";
+	{
+		std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+		if (!file) {
+			return false;
+		}
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(KDCacheHeader));
+		file.write(tree_memory, tree_memory_bytes);
+		if (!file) {
+			file.close();
+			std::filesystem::remove(tmp_path, error);
+			return false;
+		}
+	}
+
+	std::filesystem::rename(tmp_path, path, error);
+	if (error) {
+		std::filesystem::remove(tmp_path, error);
+		return false;
+	}
+
+	return true;
+}
+
+
+////////////////////////////////////////////////////
+// Rope construction.
+////////////////////////////////////////////////////
+
+// Passes each node the neighbours across its six faces. A child inherits its parent's ropes, except across
+// the split plane where the rope points to its sibling.
+void KDTreeCPU::buildRopeStructure(KDTreeNode* curr_node, KDTreeNode* ropes[6], bool is_single_ray_case)
+{
+	if (!curr_node->left && !curr_node->right) {
+		for (int i = 0; i < 6; ++i) {
+			curr_node->ropes[i] = ropes[i];
+		}
+		return;
+	}
+
+	if (is_single_ray_case) {
+		optimizeRopes(ropes, curr_node->bbox);
+	}
+
+	SplitAxis axis = curr_node->split_plane_axis;
+
+	KDTreeNode* ropes_left[6];
+	KDTreeNode* ropes_right[6];
+	for (int i = 0; i < 6; ++i) {
+		ropes_left[i] = ropes[i];
+		ropes_right[i] = ropes[i];
+	}
+
+	ropes_left[MAX_FACES[axis]] = curr_node->right;
+	buildRopeStructure(curr_node->left, ropes_left, is_single_ray_case);
+
+	ropes_right[MIN_FACES[axis]] = curr_node->left;
+	buildRopeStructure(curr_node->right, ropes_right, is_single_ray_case);
+}
+
+// Rope tightening: pushes each rope down the neighbour's subtree as long as one child still covers the whole face.
+void KDTreeCPU::optimizeRopes(KDTreeNode* ropes[6], const boundingBox& bbox)
+{
+	glm::vec3 node_min = bbox.center - bbox.extends;
+	glm::vec3 node_max = bbox.center + bbox.extends;
+
+	for (int axis = 0; axis < 3; ++axis) {
+		for (int side = 0; side < 2; ++side) {
+			AABBFace face = side == 0 ? MIN_FACES[axis] : MAX_FACES[axis];
+			KDTreeNode* rope = ropes[face];
+			if (!rope) {
+				continue;
+			}
+
+			while (rope->left && rope->right) {
+				SplitAxis rope_axis = rope->split_plane_axis;
+
+				if (rope_axis == axis) {
+					// The child touching the face.
+					rope = side == 0 ? rope->right : rope->left;
+				}
+				else if (rope->split_plane_value >= node_max[rope_axis]) {
+					rope = rope->left;
+				}
+				else if (rope->split_plane_value <= node_min[rope_axis]) {
+					rope = rope->right;
+				}
+				else {
+					break;
+				}
+			}
+
+			ropes[face] = rope;
+		}
+	}
+}
+
+
+////////////////////////////////////////////////////
+// Recursive (needs a stack) kd-tree traversal method to test for intersections with passed-in ray.
+////////////////////////////////////////////////////
+
+// Public-facing wrapper method. Clips the ray's [TMin, TMax] against the scene bounds once, the nodes below
+// only ever shrink that interval at their split planes.
+bool KDTreeCPU::intersect(Ray* ray, float& t, uint32_t& tri_index, float& u, float& v, const KDTraversalOptions& options) const
+{
+	t = ray->TMax;
+
+	float t_min, t_max;
+	if (!Intersections::aabbIntersect(bbox, ray, t_min, t_max))
+		return false;
+
+	t_min = std::max(t_min, ray->TMin);
+	t_max = std::min(t_max, ray->TMax);
+	if (t_min > t_max)
+		return false;
+
+	std::optional<KDMailbox> mailbox;
+	if (options.mailboxing)
+		mailbox.emplace(mailbox_stats);
+	return intersect(0, t_min, t_max, ray, mailbox ? &*mailbox : NULL, t, tri_index, u, v);
+}
+
+
+
+// Private recursive call. Visits the child on the ray origin's side of the split plane first and only enters
+// the far child if nothing was hit before the plane. A plane crossed exactly at t_min or t_max counts as crossed,
+// so both children see the ray there, and a ray running inside the plane is traced through both children.
+bool KDTreeCPU::intersect(int node_index, float t_min, float t_max, Ray* ray, KDMailbox* mailbox, float& t, uint32_t& tri_index, float& u, float& v) const
+{
+	const KDLinearNode& curr_node = linear_nodes[node_index];
+
+	// If current node is a leaf node.
+	if (curr_node.isLeaf()) {
+		return intersectLeaf(curr_node, ray, mailbox, t, tri_index, u, v);
+	}
+
+	SplitAxis axis = curr_node.getSplitAxis();
+	float t_plane = (ray->Direction[axis] != 0.0f) ? (curr_node.split - ray->Origin[axis]) * ray->DirectionInverse[axis] : INFINITYY;
+
+	bool below_first = (ray->Origin[axis] < curr_node.split) || (ray->Origin[axis] == curr_node.split && ray->Direction[axis] <= 0.0f);
+	int first_child = below_first ? curr_node.getBelowChild() : curr_node.getAboveChild();
+	int second_child = below_first ? curr_node.getAboveChild() : curr_node.getBelowChild();
+
+	if (isInSplitPlane(curr_node, ray)) {
+		bool hit_first = intersect(first_child, t_min, t_max, ray, mailbox, t, tri_index, u, v);
+		bool hit_second = intersect(second_child, t_min, t_max, ray, mailbox, t, tri_index, u, v);
+		return hit_first || hit_second;
+	}
+
+	// Interval lies completely on one side of the plane.
+	if (t_plane > t_max || t_plane <= 0.0f) {
+		return intersect(first_child, t_min, t_max, ray, mailbox, t, tri_index, u, v);
+	}
+	if (t_plane < t_min) {
+		return intersect(second_child, t_min, t_max, ray, mailbox, t, tri_index, u, v);
+	}
+
+	bool hit_first = intersect(first_child, t_min, t_plane, ray, mailbox, t, tri_index, u, v);
+
+	// A hit before the plane can't be beaten by anything in the far child.
+	if (t <= t_plane) {
+		return hit_first;
+	}
+
+	bool hit_second = intersect(second_child, t_plane, t_max, ray, mailbox, t, tri_index, u, v);
+	return hit_first || hit_second;
+}
+
+
+// Allocation check for the short-stack traversal, compiled in with KD_CHECK_TRAVERSAL_ALLOCATIONS defined. The global
+// operator new then counts every heap allocation of the calling thread, and intersectStackless() asserts that a ray
+// leaves the count unchanged.
+#ifdef KD_CHECK_TRAVERSAL_ALLOCATIONS
+namespace {
+	thread_local uint64_t num_thread_allocations = 0;
+
+	struct KDAllocationCheck {
+		uint64_t num_allocations_before = num_thread_allocations;
+		~KDAllocationCheck() { assert(num_thread_allocations == num_allocations_before && "kd-tree traversal allocated"); }
+	};
+}
+
+void* operator new(size_t size)
+{
+	++num_thread_allocations;
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	std::free(p);
+}
+#endif
+
+
+// Same front-to-back order as intersect(), but the far children go onto a small ring buffer on the stack
+// instead of being recursed into, so a ray never allocates. When the buffer overflows the oldest entry is
+// dropped; once the buffer runs dry the traversal restarts for the rest of the ray from the push-down node,
+// the deepest node known to contain all of the remaining interval.
+bool KDTreeCPU::intersectStackless(Ray* ray, float& t, uint32_t& tri_index, float& u, float& v, const KDTraversalOptions& options) const
+{
+#ifdef KD_CHECK_TRAVERSAL_ALLOCATIONS
+	KDAllocationCheck allocation_check;
+#endif
+	t = ray->TMax;
+
+	float scene_t_min, scene_t_max;
+	if (!Intersections::aabbIntersect(bbox, ray, scene_t_min, scene_t_max))
+		return false;
+
+	scene_t_min = std::max(scene_t_min, ray->TMin);
+	scene_t_max = std::min(scene_t_max, ray->TMax);
+	if (scene_t_min > scene_t_max)
+		return false;
+
+	std::optional<KDMailbox> mailbox;
+	if (options.mailboxing)
+		mailbox.emplace(mailbox_stats);
+
+	KDStackEntry stack[KD_SHORT_STACK_SIZE];
+	int stack_top = 0;
+	int stack_count = 0;
+
+	int node_index = 0;
+	int push_down_node = 0;
+	bool push_down = true;
+	bool restarted = false;
+	float t_min = scene_t_min;
+	float t_max = scene_t_max;
+
+	bool intersection_detected = false;
+
+	while (true) {
+		// Descend to the leaf containing t_min.
+		while (!linear_nodes[node_index].isLeaf()) {
+			const KDLinearNode& node = linear_nodes[node_index];
+
+			SplitAxis axis = node.getSplitAxis();
+			float t_plane = (ray->Direction[axis] != 0.0f) ? (node.split - ray->Origin[axis]) * ray->DirectionInverse[axis] : INFINITYY;
+
+			bool below_first = (ray->Origin[axis] < node.split) || (ray->Origin[axis] == node.split && ray->Direction[axis] <= 0.0f);
+			int first_child = below_first ? node.getBelowChild() : node.getAboveChild();
+			int second_child = below_first ? node.getAboveChild() : node.getBelowChild();
+
+			// Both children of a plane the ray runs inside cover the same interval, which the near-to-far stack
+			// can't order. Such rays are rare and take the recursive traversal instead.
+			if (isInSplitPlane(node, ray)) {
+				return intersect(ray, t, tri_index, u, v, options);
+			}
+
+			// After a restart, a plane exactly at t_min leads to the child holding the rest of the ray, otherwise the
+			// restart could land in the same zero-length segment again and never advance.
+			if (t_plane > t_max || t_plane <= 0.0f) {
+				node_index = first_child;
+			}
+			else if (t_plane < t_min || (restarted && t_plane == t_min)) {
+				node_index = second_child;
+			}
+			else {
+				stack[stack_top] = { second_child, t_plane, t_max };
+				stack_top = (stack_top + 1) % KD_SHORT_STACK_SIZE;
+				stack_count = std::min(stack_count + 1, KD_SHORT_STACK_SIZE);
+
+				node_index = first_child;
+				t_max = t_plane;
+				push_down = false;
+			}
+
+			if (push_down) {
+				push_down_node = node_index;
+			}
+		}
+		restarted = false;
+
+		if (intersectLeaf(linear_nodes[node_index], ray, mailbox ? &*mailbox : NULL, t, tri_index, u, v)) {
+			intersection_detected = true;
+		}
+
+		// Nodes further along the ray can't hold anything closer.
+		if (t <= t_max) {
+			return intersection_detected;
+		}
+
+		if (stack_count > 0) {
+			stack_top = (stack_top + KD_SHORT_STACK_SIZE - 1) % KD_SHORT_STACK_SIZE;
+			--stack_count;
+
+			node_index = stack[stack_top].node_index;
+			t_min = stack[stack_top].t_min;
+			t_max = stack[stack_top].t_max;
+			push_down = false;
+		}
+		else {
+			if (t_max >= scene_t_max) {
+				return intersection_detected;
+			}
+
+			// Stack overflowed at some point, restart for the remaining part of the ray.
+			node_index = push_down_node;
+			t_min = t_max;
+			t_max = scene_t_max;
+			push_down = true;
+			restarted = true;
+		}
+	}
+}
+
+
+bool KDTreeCPU::closestHit(Ray* ray, float& t, uint32_t& tri_index, float& u, float& v, const KDTraversalOptions& options) const
+{
+	return options.use_ropes ? intersectRopes(ray, t, tri_index, u, v, options) : intersectStackless(ray, t, tri_index, u, v, options);
+}
+
+bool KDTreeCPU::closestHit(Ray* ray, float& t, uint32_t& tri_index, float& u, float& v) const
+{
+	return closestHit(ray, t, tri_index, u, v, KDTraversalOptions());
+}
+
+
+// Stackless traversal along the ropes: from each leaf the ray follows the rope of its exit face and descends
+// from there to the leaf containing the exit point. Per-ray state is just the current node and entry distance.
+bool KDTreeCPU::intersectRopes(Ray* ray, float& t, uint32_t& tri_index, float& u, float& v, const KDTraversalOptions& options) const
+{
+	t = ray->TMax;
+
+	float scene_t_min, scene_t_max;
+	if (!Intersections::aabbIntersect(bbox, ray, scene_t_min, scene_t_max))
+		return false;
+
+	scene_t_min = std::max(scene_t_min, ray->TMin);
+	scene_t_max = std::min(scene_t_max, ray->TMax);
+	if (scene_t_min > scene_t_max)
+		return false;
+
+	std::optional<KDMailbox> mailbox;
+	if (options.mailboxing)
+		mailbox.emplace(mailbox_stats);
+
+	int node_index = 0;
+	float t_entry = scene_t_min;
+
+	bool intersection_detected = false;
+
+	while (true) {
+		// Descend to the leaf the ray is in at t_entry. A ray entering exactly on a split plane goes to the near
+		// side first, its zero-length segment there ends on the plane and the rope leads across. A ray running
+		// inside a split plane needs both children, which one rope path can't give, it takes the recursive
+		// traversal instead.
+		while (!linear_nodes[node_index].isLeaf()) {
+			const KDLinearNode& node = linear_nodes[node_index];
+			if (isInSplitPlane(node, ray)) {
+				return intersect(ray, t, tri_index, u, v, options);
+			}
+
+			SplitAxis axis = node.getSplitAxis();
+			float t_plane = (ray->Direction[axis] != 0.0f) ? (node.split - ray->Origin[axis]) * ray->DirectionInverse[axis] : INFINITYY;
+
+			bool below_first = (ray->Origin[axis] < node.split) || (ray->Origin[axis] == node.split && ray->Direction[axis] <= 0.0f);
+			int first_child = below_first ? node.getBelowChild() : node.getAboveChild();
+			int second_child = below_first ? node.getAboveChild() : node.getBelowChild();
+
+			node_index = (t_plane > 0.0f && t_entry > t_plane) ? second_child : first_child;
+		}
+
+		if (intersectLeaf(linear_nodes[node_index], ray, mailbox ? &*mailbox : NULL, t, tri_index, u, v)) {
+			intersection_detected = true;
+		}
+
+		// Find the face the ray leaves the leaf through.
+		const KDRopeLeaf& leaf = rope_leaves[getLeafOrdinal(node_index)];
+		float t_exit = INFINITYY;
+		int exit_face = -1;
+		for (int axis = 0; axis < 3; ++axis) {
+			if (ray->Direction[axis] == 0.0f) {
+				continue;
+			}
+
+			bool positive = ray->Direction[axis] > 0.0f;
+			float t_face = ((positive ? leaf.max[axis] : leaf.min[axis]) - ray->Origin[axis]) * ray->DirectionInverse[axis];
+			if (t_face < t_exit) {
+				t_exit = t_face;
+				exit_face = positive ? MAX_FACES[axis] : MIN_FACES[axis];
+			}
+		}
+
+		if (t <= t_exit || t_exit >= scene_t_max || exit_face < 0 || leaf.ropes[exit_face] < 0) {
+			return intersection_detected;
+		}
+
+		node_index = leaf.ropes[exit_face];
+		t_entry = t_exit;
+	}
+}
+
+
+// Any-hit traversal. Order doesn't matter for the answer, but going near-to-far still finds blockers close to the
+// origin first. Every push descends a level, so a MAX_DEPTH stack never overflows and needs no restart.
+bool KDTreeCPU::occluded(Ray* ray, float t_max, const KDTraversalOptions& options) const
+{
+	float scene_t_min, scene_t_max;
+	if (!Intersections::aabbIntersect(bbox, ray, scene_t_min, scene_t_max))
+		return false;
+
+	scene_t_min = std::max(scene_t_min, ray->TMin);
+	scene_t_max = std::min(scene_t_max, t_max);
+	if (scene_t_min > scene_t_max)
+		return false;
+
+	std::optional<KDMailbox> mailbox;
+	if (options.mailboxing)
+		mailbox.emplace(mailbox_stats);
+
+	KDStackEntry stack[MAX_DEPTH + 1];
+	int stack_size = 0;
+
+	int node_index = 0;
+	float node_t_min = scene_t_min;
+	float node_t_max = scene_t_max;
+
+	while (true) {
+		while (!linear_nodes[node_index].isLeaf()) {
+			const KDLinearNode& node = linear_nodes[node_index];
+
+			SplitAxis axis = node.getSplitAxis();
+			float t_plane = (ray->Direction[axis] != 0.0f) ? (node.split - ray->Origin[axis]) * ray->DirectionInverse[axis] : INFINITYY;
+
+			bool below_first = (ray->Origin[axis] < node.split) || (ray->Origin[axis] == node.split && ray->Direction[axis] <= 0.0f);
+			int first_child = below_first ? node.getBelowChild() : node.getAboveChild();
+			int second_child = below_first ? node.getAboveChild() : node.getBelowChild();
+
+			// A ray inside the plane is tested against both children over the whole interval.
+			if (isInSplitPlane(node, ray)) {
+				stack[stack_size++] = { second_child, node_t_min, node_t_max };
+				node_index = first_child;
+			}
+			else if (t_plane > node_t_max || t_plane <= 0.0f) {
+				node_index = first_child;
+			}
+			else if (t_plane < node_t_min) {
+				node_index = second_child;
+			}
+			else {
+				stack[stack_size++] = { second_child, t_plane, node_t_max };
+				node_index = first_child;
+				node_t_max = t_plane;
+			}
+		}
+
+		// The whole query interval is tested, a triangle reaching into this leaf may block the ray elsewhere.
+		if (occludedLeaf(linear_nodes[node_index], ray, mailbox ? &*mailbox : NULL, ray->TMin, t_max)) {
+			return true;
+		}
+
+		if (stack_size == 0) {
+			return false;
+		}
+
+		--stack_size;
+		node_index = stack[stack_size].node_index;
+		node_t_min = stack[stack_size].t_min;
+		node_t_max = stack[stack_size].t_max;
+	}
+}
+
+bool KDTreeCPU::occluded(Ray* ray, float t_max) const
+{
+	return occluded(ray, t_max, KDTraversalOptions());
+}
+
+
+bool KDTreeCPU::isInSplitPlane(const KDLinearNode& node, const Ray* ray) const
+{
+	SplitAxis axis = node.getSplitAxis();
+	return ray->Direction[axis] == 0.0f && ray->Origin[axis] == node.split;
+}
+
+
+// Tests all triangles of a leaf and keeps the closest hit in t. Only hits in [ray->TMin, t) count, so a triangle
+// tested in an earlier leaf can't produce a new hit and the mailbox may skip it.
+bool KDTreeCPU::intersectLeaf(const KDLinearNode& node, Ray* ray, KDMailbox* mailbox, float& t, uint32_t& tri_index, float& u, float& v) const
+{
+	bool intersection_detected = false;
+
+	if (simd_leaves) {
+		const KDTriPacket* packets = leaf_packets + node.tri_offset / KD_SIMD_WIDTH;
+		int num_packets = (node.getNumTris() + KD_SIMD_WIDTH - 1) / KD_SIMD_WIDTH;
+
+		for (int i = 0; i < num_packets; ++i) {
+			if (mailbox && mailbox->skipPacket(packets[i], std::min(KD_SIMD_WIDTH, node.getNumTris() - i * KD_SIMD_WIDTH))) {
+				continue;
+			}
+
+			int lane;
+			if (Intersections::triIntersect4(ray, packets[i], ray->TMin, t, lane, u, v)) {
+				intersection_detected = true;
+				tri_index = packets[i].tri_index[lane];
+			}
+		}
+
+		return intersection_detected;
+	}
+
+	const KDTriRecord* node_tris = leaf_tris + node.tri_offset;
+	for (int i = 0; i < node.getNumTris(); ++i) {
+		if (mailbox && mailbox->skipTri(node_tris[i].tri_index)) {
+			continue;
+		}
+
+		// Perform ray/triangle intersection test.
+		float tmp_t = INFINITYY;
+		float tmp_u = 0.0f;
+		float tmp_v = 0.0f;
+		bool intersects_tri = Intersections::triIntersect(ray, node_tris[i], tmp_t, tmp_u, tmp_v);
+
+		if (intersects_tri && tmp_t < t && tmp_t >= ray->TMin) {
+			intersection_detected = true;
+			t = tmp_t;
+			tri_index = node_tris[i].tri_index;
+			u = tmp_u;
+			v = tmp_v;
+		}
+	}
+
+	return intersection_detected;
+}
+
+// A triangle tested in an earlier leaf didn't block the ray, or the query would have ended there.
+bool KDTreeCPU::occludedLeaf(const KDLinearNode& node, Ray* ray, KDMailbox* mailbox, float t_min, float t_max) const
+{
+	if (simd_leaves) {
+		const KDTriPacket* packets = leaf_packets + node.tri_offset / KD_SIMD_WIDTH;
+		int num_packets = (node.getNumTris() + KD_SIMD_WIDTH - 1) / KD_SIMD_WIDTH;
+
+		for (int i = 0; i < num_packets; ++i) {
+			if (mailbox && mailbox->skipPacket(packets[i], std::min(KD_SIMD_WIDTH, node.getNumTris() - i * KD_SIMD_WIDTH))) {
+				continue;
+			}
+
+			if (Intersections::triOccluded4(ray, packets[i], t_min, t_max)) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	const KDTriRecord* node_tris = leaf_tris + node.tri_offset;
+	for (int i = 0; i < node.getNumTris(); ++i) {
+		if (mailbox && mailbox->skipTri(node_tris[i].tri_index)) {
+			continue;
+		}
+
+		if (Intersections::triOccluded(ray, node_tris[i], t_min, t_max)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+////////////////////////////////////////////////////
+// Debug methods.
+////////////////////////////////////////////////////
+
+void KDTreeCPU::printNumTrianglesInEachNode(KDTreeNode* curr_node, int curr_depth)
+{
+	std::cout << "Level: " << curr_depth << ", Triangles: " << curr_node->num_tris << std::endl;
+
+	if (curr_node->left) {
+		printNumTrianglesInEachNode(curr_node->left, curr_depth + 1);
+	}
+	if (curr_node->right) {
+		printNumTrianglesInEachNode(curr_node->right, curr_depth + 1);
+	}
+}
+
+void KDTreeCPU::printNodeIdsAndBounds(KDTreeNode* curr_node)
 {
 	//std::cout << "Node ID: " << curr_node->id << std::endl;
 	//std::cout << "Node bbox min: ( " << curr_node->bbox.min.x << ", " << curr_node->bbox.min.y << ", " << curr_node->bbox.min.z << " )" << std::endl;
@@ -801,4 +2487,56 @@ void KDTreeCPU::printNodeIdsAndBounds(KDTreeNode* curr_node)
 	//if ( curr_node->right ) {
 	//	printNodeIdsAndBounds( curr_node->right );
 	//}
+}
+
+
+
+////////////////////////////////////////////////////
+// KDTreeTraversal.
+////////////////////////////////////////////////////
+
+KDTreeTraversal::KDTreeTraversal(const KDTreeCPU* tree, const KDTraversalOptions& options)
+{
+	this->tree = tree;
+	this->options = options;
+}
+
+bool KDTreeTraversal::closestHit(Ray* ray, float& t, uint32_t& tri_index, float& u, float& v) const
+{
+	return tree->closestHit(ray, t, tri_index, u, v, options);
+}
+
+bool KDTreeTraversal::occluded(Ray* ray, float t_max) const
+{
+	return tree->occluded(ray, t_max, options);
+}
+
+void KDTreeTraversal::getBounds(glm::vec3& bounds_min, glm::vec3& bounds_max) const
+{
+	tree->getBounds(bounds_min, bounds_max);
+}
+
+const char* KDTreeTraversal::getName(void) const
+{
+	return tree->getName();
+}
+
+float KDTreeTraversal::getBuildTime(void) const
+{
+	return tree->getBuildTime();
+}
+
+size_t KDTreeTraversal::getMemoryBytes(void) const
+{
+	return tree->getMemoryBytes();
+}
+
+const KDTreeCPU* KDTreeTraversal::getTree(void) const
+{
+	return tree;
+}
+
+const KDTraversalOptions& KDTreeTraversal::getOptions(void) const
+{
+	return options;
 }
\ No newline at end of file
@@ -3,8 +3,15 @@
 
 
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "KDTreeStructs.h"
+#include "KDBuildArena.h"
+#include "KDMappedFile.h"
 #include "../Ray.h"
+#include "../Accelerator.h"
 
 
 ////////////////////////////////////////////////////
@@ -16,25 +23,94 @@ const int MAX_DEPTH = 40;
 const bool USE_TIGHT_FITTING_BOUNDING_BOXES = false;
 const float INFINITYY = std::numeric_limits<float>::max();
 
+// SAH cost model.
+const float KD_COST_TRAVERSAL = 1.5f;
+const float KD_COST_INTERSECT = 1.0f;
+const float KD_EMPTY_SPACE_BONUS = 0.2f;	// Cost reduction for splits with one empty child, favors cutting off empty space.
+
+// Perfect splits: triangles are clipped to the node box before their extent is used, so a triangle whose bounding
+// box straddles a plane only lands on both sides if the triangle itself does.
+const bool KD_PERFECT_SPLITS = true;
+
+enum KDBuildMode {
+	KD_BUILD_GRID = 0,	// 99 fixed candidate planes per axis, every triangle rescanned per plane.
+	KD_BUILD_SWEEP = 1,	// Exact SAH, sweeping pre-sorted triangle min/max events.
+	KD_BUILD_BINNED = 2	// Approximate SAH, candidate planes at the borders of num_bins equally sized bins.
+};
+
+const int KD_DEFAULT_NUM_BINS = 32;
+
+// Parallel build thresholds.
+const int KD_PARALLEL_BUILD_MIN_TRIS = 4096;	// Smallest subtree that gets its own build task.
+const int KD_PARALLEL_SPLIT_MIN_TRIS = 16384;	// Smallest node whose axes are evaluated in parallel.
+
+const size_t KD_CACHE_LINE_SIZE = 64;
+const size_t KD_PAGE_SIZE = 4096;
+
+// Node layout: sibling pairs in van Emde Boas order down to page sized subtrees, so a ray descending the tree
+// touches fewer pages. Off by default, the pairs stay in depth-first order: the saved TLB misses didn't show in
+// trace times and node cache misses went up slightly.
+const bool KD_VEB_LAYOUT = false;
+
+// Leaf sizes in KDTreeStats::leaf_size_histogram, larger leaves share the last bin.
+const int KD_STATS_LEAF_SIZE_BINS = 2 * NUM_TRIS_PER_NODE + 1;
+
+// Entries of the fixed-size traversal stack used by intersectStackless().
+const int KD_SHORT_STACK_SIZE = 8;
+
+// Cached tree files. Bump the version whenever the build or the flattened layout changes.
+const char KD_CACHE_MAGIC[4] = { 'K', 'D', 'T', 'C' };
+const uint32_t KD_CACHE_VERSION = 6;
+
 
 ////////////////////////////////////////////////////
 // KDTreeCPU.
 ////////////////////////////////////////////////////
-class KDTreeCPU
+class KDTreeCPU : public Accelerator
 {
 public:
-	KDTreeCPU( int num_tris, glm::uvec3 *tris, int num_verts, glm::vec3 *verts );
+	// With a cache_dir the flattened tree is loaded from there if this mesh was built with the same parameters
+	// before, otherwise it is built and saved there. simd_leaves stores leaf triangles as SoA blocks of
+	// KD_SIMD_WIDTH triangles, otherwise as one record per triangle.
+	KDTreeCPU( int num_tris, glm::uvec3 *tris, int num_verts, glm::vec3 *verts, KDBuildMode build_mode = KD_BUILD_SWEEP, int num_bins = KD_DEFAULT_NUM_BINS, const char *cache_dir = NULL, bool simd_leaves = true );
 	~KDTreeCPU( void );
 
 	// Public traversal method that begins recursive search.
-	bool intersect( Ray* ray, float &t, uint32_t& tri_index, float& u, float& v) const;	
-	bool intersectStackless(Ray* ray, float& t, uint32_t& tri_index, float& u, float& v) const;
+	bool intersect( Ray* ray, float &t, uint32_t& tri_index, float& u, float& v, const KDTraversalOptions &options = KDTraversalOptions() ) const;
+	bool intersectStackless(Ray* ray, float& t, uint32_t& tri_index, float& u, float& v, const KDTraversalOptions &options = KDTraversalOptions() ) const;
+	bool intersectRopes(Ray* ray, float& t, uint32_t& tri_index, float& u, float& v, const KDTraversalOptions &options = KDTraversalOptions() ) const;
+
+	// Any-hit query for shadow and visibility rays: true as soon as some triangle is hit within [ray->TMin, t_max].
+	bool occluded(Ray* ray, float t_max, const KDTraversalOptions &options) const;
+	bool occluded(Ray* ray, float t_max) const override;
+
+	// Runs the stackless or the rope traversal. The Accelerator entry point uses the default options.
+	bool closestHit(Ray* ray, float& t, uint32_t& tri_index, float& u, float& v, const KDTraversalOptions &options) const;
+	bool closestHit(Ray* ray, float& t, uint32_t& tri_index, float& u, float& v) const override;
+	const char* getName( void ) const override;
 
 	// kd-tree getters.
 	KDTreeNode* getRootNode( void ) const;
 	int getNumLevels( void ) const;
 	int getNumLeaves( void ) const;
 	int getNumNodes( void ) const;
+	int getNumLinearNodes( void ) const;
+	size_t getMemoryBytes( void ) const override;
+	KDBuildMode getBuildMode( void ) const;
+	float getBuildTime( void ) const override;	// Load time if the tree came from the cache.
+	bool getLoadedFromCache( void ) const;
+	void getBounds( glm::vec3 &bounds_min, glm::vec3 &bounds_max ) const override;
+
+	// Build quality report, also for trees loaded from the cache.
+	const KDTreeStats& getStats( void ) const;
+	std::string getStatsJSON( void ) const;
+
+	// Leaf layout the tree was built with, selects the leaf kernel.
+	bool getSimdLeaves( void ) const;
+
+	// Triangle tests the mailboxes saved since the last reset.
+	KDMailboxStats getMailboxStats( void ) const;
+	void resetMailboxStats( void );
 
 	// Input mesh getters.
 	int getMeshNumVerts( void ) const;
@@ -51,17 +127,99 @@ private:
 	KDTreeNode *root;
 	int num_levels, num_leaves, num_nodes;
 
+	// Build memory: one arena per build thread for nodes and triangle index lists, all released once the tree
+	// is flattened.
+	std::vector<std::unique_ptr<KDBuildArena>> build_arenas;
+	std::mutex build_arenas_mutex;
+
+	// Flattened kd-tree used for traversal, compacted into the single cache line aligned tree_memory block.
+	// The pointer tree is released after flattening. A tree loaded from the cache is traced straight from the
+	// mapped file, tree_memory then points into cache_file.
+	KDMappedFile cache_file;
+	char *tree_memory;
+	size_t tree_memory_bytes;
+	KDLinearNode *linear_nodes;
+	int num_linear_nodes;
+	// Leaf triangles, only one of the two layouts is stored. Each leaf starts on a KD_SIMD_WIDTH boundary, packet i
+	// holds records [i * KD_SIMD_WIDTH, (i + 1) * KD_SIMD_WIDTH).
+	KDTriRecord *leaf_tris;		// Without simd_leaves.
+	KDTriPacket *leaf_packets;	// With simd_leaves.
+	int num_leaf_tris;
+	bool simd_leaves;
+	mutable KDMailboxStatSlot mailbox_stats[KD_MAILBOX_STAT_SLOTS];
+	KDLeafRank *leaf_ranks;		// One per 64 linear nodes.
+	KDRopeLeaf *rope_leaves;	// One per leaf, indexed by getLeafOrdinal().
+	int num_rope_leaves;
+	boundingBox bbox;
+	KDBuildMode build_mode;
+	int num_bins;
+	int parallel_build_depth;
+	float build_time;
+	bool loaded_from_cache;
+	KDTreeStats stats;
+
 	// Input mesh variables.
 	int num_verts, num_tris;
 	glm::vec3 *verts;
 	glm::uvec3* tris;
 
-	KDTreeNode* constructTreeMedianSpaceSplit( int num_tris, int *tri_indices, boundingBox bounds, int curr_depth );
+	KDTreeNode* constructTreeMedianSpaceSplit( int num_tris, int *tri_indices, boundingBox bounds, int curr_depth, KDBuildArena &arena, KDBuildArena &scratch );
+
+	KDTreeNode* constructTreeStackless(int num_tris, int *tri_indices, boundingBox bounds, KDBuildArena &arena );
+	int constructSubtree( KDBuildTask subtree_task, std::unique_ptr<KDBuildArena> event_arena );
+	KDBuildArena& createBuildArena( void );
+	void releaseBuildArenas( void );
 
-	KDTreeNode* constructTreeStackless(int num_tris, int *tri_indices, boundingBox bounds );
+	// Split plane search used by constructTreeStackless().
+	bool findSplitGrid( const KDTreeNode *node, SplitAxis &split_axis, float &split_value );
+	bool findSplitSAH( const KDBuildTask &task, SplitAxis &split_axis, float &split_value );
+	void findSplitSweep( const KDBuildTask &task, SplitAxis axis, float &min_cost, float &split_value ) const;
+	void findSplitBinned( const KDTreeNode *node, SplitAxis axis, float &min_cost, float &split_value ) const;
+	bool goesLeft( float tri_min, float tri_max, float plane ) const;
+	bool isSplitUseful( int num_tris, int num_left, int num_right ) const;
+	float getSplitCost( const boundingBox &bbox, SplitAxis axis, float plane, int num_left, int num_right ) const;
+	void allocSplitEvents( KDBuildTask &task, KDBuildArena &event_arena ) const;
+	void initSplitEvents( KDBuildTask &task, KDBuildArena &event_arena );
+	KDTriBounds clipTriBounds( int tri_index, const KDTriBounds &tri_bounds, const glm::vec3 &box_min, const glm::vec3 &box_max ) const;
 
-	// Private recursive traversal method.
-	bool intersect( KDTreeNode *curr_node, Ray* ray, float &t, uint32_t& tri_index, float& u, float& v) const;
+	// Flattening.
+	void flattenTree( KDTreeNode *curr_node, int node_index, std::vector<KDLinearNode> &nodes, std::vector<KDTriRecord> &tri_records );
+	void padLeafTris( std::vector<KDTriRecord> &tri_records );
+	void allocateTreeMemory( int num_nodes, int num_leaves, int num_tri_records );
+	size_t getTreeMemoryBytes( int num_nodes, int num_leaves, int num_tri_records ) const;
+	void placeTreeMemory( char *memory, int num_nodes, int num_leaves, int num_tri_records );
+	size_t getLeafTrisBytes( int num_tri_records ) const;
+	void storeLeafTris( const std::vector<KDTriRecord> &tri_records );
+	void buildLeafRanks( void );
+	int getLeafOrdinal( int node_index ) const;
+	void flattenRopes( KDTreeNode *curr_node, glm::vec3 node_min, glm::vec3 node_max );
+	void layoutNodes( std::vector<KDTriRecord> &tri_records );
+	void layoutSubtree( int root_pair, int height, const std::vector<int> &pair_heights, const std::vector<int> &pair_counts, std::vector<int> &pair_order, std::vector<int> &bottom_pairs ) const;
+	void layoutDepthFirst( int root_pair, std::vector<int> &pair_order ) const;
+
+	// Statistics.
+	void computeStats( void );
+
+	// Cache.
+	uint64_t computeCacheKey( void ) const;
+	std::string getCachePath( const char *cache_dir, uint64_t key ) const;
+	bool loadCache( const std::string &path, uint64_t key );
+	bool validateTreeMemory( void ) const;
+	bool saveCache( const std::string &path, uint64_t key ) const;
+
+	// Rope construction.
+	void buildRopeStructure( KDTreeNode *curr_node, KDTreeNode *ropes[6], bool is_single_ray_case );
+	void optimizeRopes( KDTreeNode *ropes[6], const boundingBox &bbox );
+
+	// Private recursive traversal method. mailbox is NULL with mailboxing off.
+	bool intersect( int node_index, float t_min, float t_max, Ray* ray, KDMailbox *mailbox, float &t, uint32_t& tri_index, float& u, float& v) const;
+
+	// True if the ray runs inside the inner node's split plane, so both children hold the same part of it.
+	bool isInSplitPlane( const KDLinearNode &node, const Ray* ray ) const;
+
+	// Leaf tests.
+	bool intersectLeaf( const KDLinearNode &node, Ray* ray, KDMailbox *mailbox, float &t, uint32_t& tri_index, float& u, float& v) const;
+	bool occludedLeaf( const KDLinearNode &node, Ray* ray, KDMailbox *mailbox, float t_min, float t_max ) const;
 
 	// Bounding box getters.
 	SplitAxis getLongestBoundingBoxSide(const boundingBox& bbox);
@@ -69,8 +227,34 @@ private:
 	boundingBox computeTightFittingBoundingBox( int num_tris, int *tri_indices );
 
 	// Triangle getters.
-	float getMinTriValue( int tri_index, SplitAxis axis );
-	float getMaxTriValue( int tri_index, SplitAxis axis );
+	float getMinTriValue( int tri_index, SplitAxis axis ) const;
+	float getMaxTriValue( int tri_index, SplitAxis axis ) const;
+};
+
+
+////////////////////////////////////////////////////
+// KDTreeTraversal.
+////////////////////////////////////////////////////
+
+// Accelerator over a shared kd-tree that traces with its own options, e.g. the ones a renderer's settings ask for.
+class KDTreeTraversal : public Accelerator
+{
+public:
+	KDTreeTraversal( const KDTreeCPU *tree = NULL, const KDTraversalOptions &options = KDTraversalOptions() );
+
+	bool closestHit( Ray* ray, float& t, uint32_t& tri_index, float& u, float& v ) const override;
+	bool occluded( Ray* ray, float t_max ) const override;
+	void getBounds( glm::vec3 &bounds_min, glm::vec3 &bounds_max ) const override;
+	const char* getName( void ) const override;
+	float getBuildTime( void ) const override;
+	size_t getMemoryBytes( void ) const override;
+
+	const KDTreeCPU* getTree( void ) const;
+	const KDTraversalOptions& getOptions( void ) const;
+
+private:
+	const KDTreeCPU *tree;
+	KDTraversalOptions options;
 };
 
 #endif
\ No newline at end of file
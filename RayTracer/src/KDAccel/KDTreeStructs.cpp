@@ -10,6 +10,9 @@ KDTreeNode::KDTreeNode()
 {
 	left = NULL;
 	right = NULL;
+	num_tris = 0;
+	tri_indices = NULL;
+	tri_bounds = NULL;
 	is_leaf_node = false;
 	for ( int i = 0; i < 6; ++i ) {
 		ropes[i] = NULL;
@@ -17,16 +20,81 @@ KDTreeNode::KDTreeNode()
 	id = -99;
 }
 
-KDTreeNode::~KDTreeNode()
+
+////////////////////////////////////////////////////
+// KDLinearNode.
+////////////////////////////////////////////////////
+
+void KDLinearNode::initLeaf( int tri_offset, int num_tris )
+{
+	this->tri_offset = tri_offset;
+	this->num_tris = ( num_tris << 2 ) | 3;
+}
+
+void KDLinearNode::initInner( SplitAxis axis, float split, int children )
+{
+	this->split = split;
+	this->children = ( children << 2 ) | (int)axis;
+}
+
+////////////////////////////////////////////////////
+// KDMailbox.
+////////////////////////////////////////////////////
+
+// Slot of the calling thread, handed out in the order threads first trace with mailboxing.
+static int getThreadStatSlot( void )
+{
+	static std::atomic<int> num_threads{ 0 };
+	thread_local int slot = num_threads.fetch_add( 1, std::memory_order_relaxed ) % KD_MAILBOX_STAT_SLOTS;
+	return slot;
+}
+
+KDMailbox::KDMailbox( KDMailboxStatSlot *stat_slots )
 {
-	if ( num_tris > 0 ) {
-		delete[] tri_indices;
+	for ( int i = 0; i < KD_MAILBOX_SIZE; ++i ) {
+		tri_ids[i] = -1;
 	}
+	num_tested = 0;
+	num_skipped = 0;
+	stats = stat_slots ? &stat_slots[getThreadStatSlot()] : NULL;
+}
 
-	if ( left ) {
-		delete left;
+KDMailbox::~KDMailbox()
+{
+	if ( stats && num_tested + num_skipped > 0 ) {
+		stats->num_tested.fetch_add( num_tested, std::memory_order_relaxed );
+		stats->num_skipped.fetch_add( num_skipped, std::memory_order_relaxed );
 	}
-	if ( right ) {
-		delete right;
+}
+
+bool KDMailbox::skipTri( int tri_index )
+{
+	int slot = getSlot( tri_index );
+	if ( tri_ids[slot] == tri_index ) {
+		++num_skipped;
+		return true;
 	}
-}
\ No newline at end of file
+
+	tri_ids[slot] = tri_index;
+	++num_tested;
+	return false;
+}
+
+bool KDMailbox::skipPacket( const KDTriPacket &packet, int num_lanes )
+{
+	bool all_tested = true;
+	for ( int lane = 0; lane < num_lanes && all_tested; ++lane ) {
+		all_tested = tri_ids[getSlot( packet.tri_index[lane] )] == packet.tri_index[lane];
+	}
+
+	if ( all_tested ) {
+		num_skipped += num_lanes;
+		return true;
+	}
+
+	for ( int lane = 0; lane < num_lanes; ++lane ) {
+		tri_ids[getSlot( packet.tri_index[lane] )] = packet.tri_index[lane];
+	}
+	num_tested += num_lanes;
+	return false;
+}
@@ -2,6 +2,10 @@
 #define KD_TREE_STRUCTS_H
 
 #include <glm/glm.hpp>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "KDBuildArena.h"
 
 
 ////////////////////////////////////////////////////
@@ -10,6 +14,22 @@
 
 const float KD_TREE_EPSILON = 0.00001f;
 
+// Triangles per SIMD leaf block.
+const int KD_SIMD_WIDTH = 4;
+
+// Triangle ids a ray's mailbox remembers, 1 << KD_MAILBOX_BITS slots.
+const int KD_MAILBOX_BITS = 4;
+const int KD_MAILBOX_SIZE = 1 << KD_MAILBOX_BITS;
+
+// Mailbox counters per tree, threads share one once there are more of them.
+const int KD_MAILBOX_STAT_SLOTS = 64;
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KD_USE_SSE 1
+#else
+#define KD_USE_SSE 0
+#endif
+
 
 ////////////////////////////////////////////////////
 // enums.
@@ -21,6 +41,11 @@ enum SplitAxis {
 	Z_AXIS = 2
 };
 
+enum KDEventType {
+	EVENT_END = 0,
+	EVENT_START = 1
+};
+
 enum AABBFace {
 	LEFT = 0,
 	FRONT = 1,
@@ -47,22 +72,39 @@ struct boundingBox
 	glm::vec3 center, extends;
 };
 
+// Start or end of a triangle's extent along one axis, used by the sweep SAH builder. tri_slot is the triangle's
+// position in its node's tri_indices.
+struct KDSplitEvent
+{
+	float position;
+	int tri_slot;
+	KDEventType type;
+};
+
+// Bounds of the part of a triangle that lies inside a node, the triangle clipped to the node's box.
+struct KDTriBounds
+{
+	glm::vec3 min, max;
+};
+
 
 ////////////////////////////////////////////////////
 // classes.
 ////////////////////////////////////////////////////
 
+// Node of the pointer tree the builders produce. Nodes and their triangle index lists live in KDBuildArenas
+// and are released together with them once the tree is flattened.
 class KDTreeNode
 {
 public:
 	KDTreeNode( void );
-	~KDTreeNode( void );
 
 	boundingBox bbox;
 	KDTreeNode *left;
 	KDTreeNode *right;
 	int num_tris;
 	int *tri_indices;
+	KDTriBounds *tri_bounds;	// Per triangle, parallel to tri_indices.
 
 	SplitAxis split_plane_axis;
 	float split_plane_value;
@@ -75,4 +117,160 @@ public:
 	int id;
 };
 
+// 8-byte node of the flattened kd-tree. The children of an inner node are stored as a sibling pair, below then
+// above, starting at an even index, so pairs can be placed anywhere in the node array and never straddle a cache
+// line. The root sits alone in the first pair. Leaves reference a range of the shared triangle record array.
+struct KDLinearNode
+{
+	union {
+		float split;		// Inner node.
+		int tri_offset;		// Leaf.
+	};
+	union {
+		int flags;			// Lower two bits: split axis, or 3 for leaves.
+		int num_tris;		// Leaf, upper 30 bits.
+		int children;		// Inner node, upper 30 bits: index of the below child.
+	};
+
+	void initLeaf( int tri_offset, int num_tris );
+	void initInner( SplitAxis axis, float split, int children );
+
+	bool isLeaf( void ) const { return ( flags & 3 ) == 3; }
+	SplitAxis getSplitAxis( void ) const { return (SplitAxis)( flags & 3 ); }
+	int getNumTris( void ) const { return num_tris >> 2; }
+	int getBelowChild( void ) const { return children >> 2; }
+	int getAboveChild( void ) const { return ( children >> 2 ) + 1; }
+};
+
+// Triangle as the leaf test wants it: first vertex and both edges, stored in leaf order so a leaf is one
+// contiguous read. tri_index refers back to the mesh for shading.
+struct KDTriRecord
+{
+	glm::vec3 v0, e1, e2;
+	int tri_index;
+};
+
+// KD_SIMD_WIDTH consecutive triangle records in SoA layout, [component][lane]. Unused lanes hold degenerate
+// triangles that never pass the determinant test.
+struct alignas(16) KDTriPacket
+{
+	float v0[3][KD_SIMD_WIDTH];
+	float e1[3][KD_SIMD_WIDTH];
+	float e2[3][KD_SIMD_WIDTH];
+	int tri_index[KD_SIMD_WIDTH];
+};
+
+// Leaf data for the rope traversal: exact leaf bounds and the node behind each face, -1 where the ray leaves the tree.
+struct KDRopeLeaf
+{
+	glm::vec3 min, max;
+	int ropes[6];
+};
+
+// Leaf ordinals of 64 consecutive linear nodes, so rope leaves are stored for leaves only: bit i of leaf_mask is set
+// if node 64 * word + i is a leaf, leaves_before counts the leaves of all earlier words.
+struct KDLeafRank
+{
+	uint64_t leaf_mask;
+	int leaves_before;
+	int pad;
+};
+
+// Traversal options, passed with every query so a shared tree is never reconfigured while others trace it.
+struct KDTraversalOptions
+{
+	bool use_ropes = false;		// Rope traversal instead of the short stack.
+	bool mailboxing = false;	// Per-ray mailboxes skip triangles already tested in an earlier leaf.
+};
+
+// Far child postponed by the short-stack traversal, with the part of the ray that lies inside it.
+struct KDStackEntry
+{
+	int node_index;
+	float t_min, t_max;
+};
+
+// Triangle tests over all rays traced with mailboxing: tests run and tests the mailboxes skipped.
+struct KDMailboxStats
+{
+	uint64_t num_tested = 0;
+	uint64_t num_skipped = 0;
+};
+
+// Mailbox counters of the threads mapped to one slot, on a cache line of their own so finished rays don't contend
+// across threads. Summed only when the stats are read, once per frame.
+struct alignas(64) KDMailboxStatSlot
+{
+	std::atomic<uint64_t> num_tested{ 0 };
+	std::atomic<uint64_t> num_skipped{ 0 };
+};
+
+// Quality report of a built tree, computed from the flattened nodes. Depths count from 0 at the root.
+struct KDTreeStats
+{
+	float sah_cost = 0.0f;			// Expected cost of a ray through the tree, relative to the root's surface area.
+	int num_nodes = 0;
+	int num_inner_nodes = 0;
+	int num_leaves = 0;
+	int num_empty_leaves = 0;
+	int max_depth = 0;
+	int num_tri_refs = 0;			// Triangle references over all leaves, without SIMD padding.
+	float duplication_factor = 0.0f;	// num_tri_refs per mesh triangle.
+	float empty_leaf_ratio = 0.0f;
+	float avg_leaf_tris = 0.0f;		// Over non-empty leaves.
+	std::vector<int> leaf_size_histogram;	// Leaves with i triangles, the last bin counts all larger leaves.
+	std::vector<int> depth_histogram;		// Leaves at depth i.
+	size_t memory_bytes = 0;
+	float build_time = 0.0f;
+};
+
+// Start of a cached kd-tree file, followed by the tree_memory block exactly as it is laid out in memory: linear
+// nodes, leaf triangles, leaf ranks and rope leaves. Padded to a cache line, so the block stays aligned in a mapping.
+// key hashes the mesh and every build parameter, a file is only used if it matches the tree about to be built.
+struct alignas(64) KDCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t key;
+	int32_t num_verts, num_tris;
+	int32_t num_linear_nodes, num_leaf_tris, num_rope_leaves;
+	float bbox_center[3], bbox_extends[3];
+};
+
+// Recently tested triangles of one ray, a hashed direct-mapped table living on the traversal's stack. Triangles
+// straddling split planes are referenced by several leaves along a ray, and a test's outcome doesn't depend on the
+// leaf it's made from, so repeated tests can be skipped. The ray's counts are added to the calling thread's slot of
+// stat_slots, KD_MAILBOX_STAT_SLOTS of them, when it's done.
+class KDMailbox
+{
+public:
+	KDMailbox( KDMailboxStatSlot *stat_slots );
+	~KDMailbox( void );
+
+	// True if the triangle was tested before, otherwise it's recorded as tested now.
+	bool skipTri( int tri_index );
+
+	// True if all num_lanes triangles of the packet were tested before. A packet is tested as a whole, so it only
+	// saves anything if none of its triangles are new.
+	bool skipPacket( const KDTriPacket &packet, int num_lanes );
+
+private:
+	int tri_ids[KD_MAILBOX_SIZE];
+	int num_tested;
+	int num_skipped;
+	KDMailboxStatSlot *stats;
+
+	static int getSlot( int tri_index ) { return (int)( ( (uint32_t)tri_index * 2654435761u ) >> ( 32 - KD_MAILBOX_BITS ) ); }
+};
+
+// Node waiting to be split, together with its per-axis sorted event lists of 2 * node->num_tris events each. The
+// lists live in the event arena of the thread building the node, events_end marks the arena right after them.
+struct KDBuildTask
+{
+	KDTreeNode *node = NULL;
+	int depth = 0;
+	KDSplitEvent *events[3] = { NULL, NULL, NULL };
+	KDArenaMark events_end;
+};
+
 #endif
\ No newline at end of file
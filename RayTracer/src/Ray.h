@@ -1,10 +1,15 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <limits>
 
 struct Ray
 {
 	glm::vec3 Origin;
 	glm::vec3 Direction;
 	glm::vec3 DirectionInverse;
+
+	// Valid hit distances along the ray
+	float TMin = 0.0f;
+	float TMax = std::numeric_limits<float>::max();
 };
\ No newline at end of file
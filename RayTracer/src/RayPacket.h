@@ -0,0 +1,58 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <limits>
+
+#include "Ray.h"
+
+// 4x4 block of rays traced together. Stored SoA so four consecutive rays fill one SSE register.
+struct alignas(16) RayPacket
+{
+	static const int Width = 4;
+	static const int Size = Width * Width;
+
+	float OriginX[Size], OriginY[Size], OriginZ[Size];
+	float DirectionX[Size], DirectionY[Size], DirectionZ[Size];
+	float DirectionInverseX[Size], DirectionInverseY[Size], DirectionInverseZ[Size];
+	float TMin[Size];
+
+	// In: TMax of each ray. Out: distance of the closest hit
+	float T[Size];
+
+	uint32_t PrimId[Size];
+	float U[Size], V[Size];
+	bool Hit[Size];
+
+	void SetRay(int i, const Ray& ray)
+	{
+		OriginX[i] = ray.Origin.x; OriginY[i] = ray.Origin.y; OriginZ[i] = ray.Origin.z;
+		DirectionX[i] = ray.Direction.x; DirectionY[i] = ray.Direction.y; DirectionZ[i] = ray.Direction.z;
+		DirectionInverseX[i] = ray.DirectionInverse.x; DirectionInverseY[i] = ray.DirectionInverse.y; DirectionInverseZ[i] = ray.DirectionInverse.z;
+		TMin[i] = ray.TMin;
+		T[i] = ray.TMax;
+		Hit[i] = false;
+	}
+
+	// Lanes without a pixel behind them get an empty interval and never hit anything
+	void SetInactive(int i)
+	{
+		Ray ray;
+		ray.Origin = glm::vec3(0.0f);
+		ray.Direction = glm::vec3(1.0f);
+		ray.DirectionInverse = glm::vec3(1.0f);
+		ray.TMin = std::numeric_limits<float>::max();
+		ray.TMax = -std::numeric_limits<float>::max();
+		SetRay(i, ray);
+	}
+
+	Ray GetRay(int i) const
+	{
+		Ray ray;
+		ray.Origin = glm::vec3(OriginX[i], OriginY[i], OriginZ[i]);
+		ray.Direction = glm::vec3(DirectionX[i], DirectionY[i], DirectionZ[i]);
+		ray.DirectionInverse = glm::vec3(DirectionInverseX[i], DirectionInverseY[i], DirectionInverseZ[i]);
+		ray.TMin = TMin[i];
+		ray.TMax = T[i];
+		return ray;
+	}
+};
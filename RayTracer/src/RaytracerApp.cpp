@@ -11,12 +11,29 @@
 //#include "KDtree.h"
 
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <execution>
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 
 using namespace Walnut;
 
+enum SceneType {
+	SCENE_MESH = 0,
+	SCENE_SPHERES,
+	SCENE_MESH_PARTICLES,
+	SCENE_INSTANCES,
+	SCENE_COUNT
+};
+
+// Spheres scattered through the mesh scene's bounds
+const int NUM_PARTICLE_SPHERES = 100000;
+
+// Copies of the mesh, INSTANCE_GRID_SIZE x INSTANCE_GRID_SIZE on the ground in front of the camera
+const int INSTANCE_GRID_SIZE = 32;
+
 class RaytracerLayer : public Walnut::Layer
 {
 public:
@@ -24,6 +41,9 @@ public:
 		m_camera(70.0f, 0.05f, 100.0f)
 	{
 
+		Scene& meshScene = m_scenes[SCENE_MESH];
+		Scene& sphereScene = m_scenes[SCENE_SPHERES];
+
 		// Load OBJ
 		tinyobj::ObjReader Reader;
 		tinyobj::ObjReaderConfig config;
@@ -37,7 +57,7 @@ public:
 
 			for each (const auto & _mat in materials)
 			{
-				Material& mat = m_scene.materials.emplace_back();
+				Material& mat = meshScene.materials.emplace_back();
 
 				mat.Albedo = glm::max(
 					glm::vec3(_mat.diffuse[0], _mat.diffuse[1], _mat.diffuse[2]),
@@ -51,9 +71,6 @@ public:
 			}
 
 
-			std::vector<glm::vec3> vertices;
-			std::vector<glm::uvec3> triindexes;
-
 			uint32_t currentVertexIndex = 0;
 
 			// Loop over shapes
@@ -78,7 +95,7 @@ public:
 
 						float scale = 1.0f;
 						glm::vec3 vertexPosition = glm::vec3(vx, vy, vz) * scale;
-						vertices.push_back(vertexPosition);
+						meshScene.vertices.push_back(vertexPosition);
 						tri.Vertices.push_back(vertexPosition);
 						avg_centroid += vertexPosition;
 
@@ -110,13 +127,13 @@ public:
 
 					glm::uvec3 triindex(currentVertexIndex, currentVertexIndex + 1, currentVertexIndex + 2);
 					currentVertexIndex += 3;
-					triindexes.push_back(triindex);
+					meshScene.triIndices.push_back(triindex);
 
 					//tri.Normal = glm::normalize(avg_normal);
 					tri.Centroid = avg_centroid / (float)fv;
 
 					tri.MaterialIndex = std::max(MatID, 0);
-					m_scene.triangles.push_back(tri);
+					meshScene.triangles.push_back(tri);
 
 
 					index_offset += fv;
@@ -125,31 +142,28 @@ public:
 					//shapes[s].mesh.material_ids[f];
 				}
 			}
-
-
-			m_scene.kd_tree = std::make_shared<KDTreeCPU>((int)triindexes.size(), &triindexes[0], (int)vertices.size(), &vertices[0]);
 		}
-		uint32_t matOffset = (uint32_t) m_scene.materials.size();
+		uint32_t matOffset = (uint32_t) sphereScene.materials.size();
 
 
 
 		// Materials
 		// Floor
 		{
-			Material& mat = m_scene.materials.emplace_back();
+			Material& mat = sphereScene.materials.emplace_back();
 			mat.Albedo = glm::vec3(0.8, 0.8, 0.8);
 			mat.Roughness = 1.0f;
 			mat.Name = "Sphere Floor";
 		}
 		// Left wall
 		{
-			Material& mat = m_scene.materials.emplace_back();
+			Material& mat = sphereScene.materials.emplace_back();
 			mat.Albedo = glm::vec3(0.35, 1.0, 0.17);
 			mat.Roughness = 1.0f;
 		}
 		// Right wall
 		{
-			Material& mat = m_scene.materials.emplace_back();
+			Material& mat = sphereScene.materials.emplace_back();
 			mat.Albedo = glm::vec3(1.0, 0.0, 0.0);
 			mat.Roughness = 1.0f;
 		}
@@ -158,13 +172,13 @@ public:
 		// Sphere mats
 		// Right
 		{
-			Material& mat = m_scene.materials.emplace_back();
+			Material& mat = sphereScene.materials.emplace_back();
 			mat.Albedo = { 0.0, 0.5, 1.0 };
 			mat.Roughness = 0.9f;
 		}
 		// Left
 		{
-			Material& mat = m_scene.materials.emplace_back();
+			Material& mat = sphereScene.materials.emplace_back();
 			mat.Albedo = glm::vec3(1.0, 0.8, 0.0);
 			mat.Roughness = 0.0f;
 			mat.Transparency = 1.0f;
@@ -174,13 +188,13 @@ public:
 
 		// Light
 		{
-			Material& mat = m_scene.materials.emplace_back();
+			Material& mat = sphereScene.materials.emplace_back();
 			mat.Albedo = glm::vec3(1.0, 1.0, 1.0);
 			mat.Emission = glm::vec3{ 5.0f };
 		}
 
 		{
-			Material& mat = m_scene.materials.emplace_back();
+			Material& mat = sphereScene.materials.emplace_back();
 			mat.Albedo = glm::vec3(1.0, 1.0, 1.0);
 			mat.Emission = glm::vec3{ 0.0f };
 			mat.Roughness = 0.0f;
@@ -195,33 +209,33 @@ public:
 			sphere.MaterialIndex = 0 + matOffset;
 
 			sphere.Position = glm::vec3(0.0, 1002.0, 0.0);
-			m_scene.spheres.push_back(sphere);
+			sphereScene.spheres.push_back(sphere);
 
 			sphere.Position = glm::vec3(0.0, -1000.0, 0.0);
-			m_scene.spheres.push_back(sphere);
+			sphereScene.spheres.push_back(sphere);
 
 			sphere.Position = glm::vec3(0.0, 0.0, -1002.0);
-			m_scene.spheres.push_back(sphere);
+			sphereScene.spheres.push_back(sphere);
 
 			// Front wall
 			if (0) {
 				sphere.Position = glm::vec3(0.0, 0.0, 1001.0);
-				m_scene.spheres.push_back(sphere);
+				sphereScene.spheres.push_back(sphere);
 			}
 
 			sphere.Position = glm::vec3(-1002.0, 0.0, 0.0);
 			sphere.MaterialIndex = 1 + matOffset;
-			m_scene.spheres.push_back(sphere);
+			sphereScene.spheres.push_back(sphere);
 
 			sphere.Position = glm::vec3(1002.0, 0.0, 0.0);
 			sphere.MaterialIndex = 2 + matOffset;
-			m_scene.spheres.push_back(sphere);
+			sphereScene.spheres.push_back(sphere);
 
 		}
 
 
 		{
-			Sphere& sphere = m_scene.spheres.emplace_back();
+			Sphere& sphere = sphereScene.spheres.emplace_back();
 			sphere.Radius = 0.3f;
 			sphere.MaterialIndex = 3 + matOffset;
 
@@ -229,7 +243,7 @@ public:
 		}
 
 		{
-			Sphere& sphere = m_scene.spheres.emplace_back();
+			Sphere& sphere = sphereScene.spheres.emplace_back();
 			sphere.Radius = 0.3f;
 			sphere.MaterialIndex = 4 + matOffset;
 
@@ -237,7 +251,7 @@ public:
 		}
 
 		{
-			Sphere& sphere = m_scene.spheres.emplace_back();
+			Sphere& sphere = sphereScene.spheres.emplace_back();
 			sphere.Radius = 0.5f;
 			sphere.MaterialIndex = 6 + matOffset;
 
@@ -246,14 +260,73 @@ public:
 
 		// Light
 		{
-			Sphere& sphere = m_scene.spheres.emplace_back();
+			Sphere& sphere = sphereScene.spheres.emplace_back();
 			sphere.Radius = 1.0;
 			sphere.MaterialIndex = 5 + matOffset;
 
 			sphere.Position = glm::vec3(0.0, 2.9, 0.0);
 		}
 
-		
+
+		// Mesh scene with a cloud of small spheres in it, both kinds of primitives in one structure
+		{
+			Scene& particleScene = m_scenes[SCENE_MESH_PARTICLES];
+			particleScene = meshScene;
+
+			glm::vec3 boundsMin(-1.0f, 0.0f, -1.0f), boundsMax(1.0f, 2.0f, 1.0f);
+			if (!meshScene.vertices.empty()) {
+				boundsMin = boundsMax = meshScene.vertices[0];
+				for (const glm::vec3& vertex : meshScene.vertices)
+				{
+					boundsMin = glm::min(boundsMin, vertex);
+					boundsMax = glm::max(boundsMax, vertex);
+				}
+			}
+
+			glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+			glm::vec3 extent = (boundsMax - boundsMin) * 0.45f;
+			float radius = 0.002f * glm::length(boundsMax - boundsMin);
+
+			Material& mat = particleScene.materials.emplace_back();
+			mat.Albedo = glm::vec3(0.9f, 0.9f, 0.9f);
+			mat.Roughness = 0.2f;
+			mat.Name = "Particles";
+
+			particleScene.spheres.resize(NUM_PARTICLE_SPHERES);
+			for (Sphere& sphere : particleScene.spheres)
+			{
+				sphere.Position = center + extent * Walnut::Random::Vec3(-1.0f, 1.0f);
+				sphere.Radius = radius;
+				sphere.MaterialIndex = (uint32_t)particleScene.materials.size() - 1;
+			}
+		}
+
+		// The mesh as a single asset, placed many times through the top-level structure
+		{
+			Scene& instanceScene = m_scenes[SCENE_INSTANCES];
+			instanceScene.materials = meshScene.materials;
+
+			Mesh& mesh = instanceScene.meshes.emplace_back();
+			mesh.triangles = meshScene.triangles;
+			mesh.vertices = meshScene.vertices;
+			mesh.triIndices = meshScene.triIndices;
+
+			for (int z = 0; z < INSTANCE_GRID_SIZE; z++)
+			{
+				for (int x = 0; x < INSTANCE_GRID_SIZE; x++)
+				{
+					glm::vec3 position((x - INSTANCE_GRID_SIZE / 2) * 2.5f, 0.0f, -3.0f - z * 2.5f);
+					float yaw = Walnut::Random::Float() * 0.6f - 0.3f;
+
+					MeshInstance& instance = instanceScene.instances.emplace_back();
+					instance.MeshIndex = 0;
+					instance.Transform = glm::translate(glm::mat4(1.0f), position) * glm::rotate(glm::mat4(1.0f), yaw, glm::vec3(0.0f, 1.0f, 0.0f));
+				}
+			}
+		}
+
+		for (Scene& scene : m_scenes)
+			scene.BuildAccelerators();
 	}
 
 	virtual void OnUpdate(float ts) override
@@ -264,27 +337,118 @@ public:
 
 	virtual void OnUIRender() override
 	{
+		Scene& scene = m_scenes[m_sceneType];
+
 		// Settings
 		ImGui::Begin("Settings");
 		ImGui::Text("Last render: %.3fms | %i", m_lastRenderTime, m_renderer.GetFrameIndex());
+		if (m_lastRenderTime > 0.0f)
+			ImGui::Text("%.2f MRays/s", m_renderer.GetRayCount() / (m_lastRenderTime * 1000.0f));
 		ImGui::Checkbox("Render", &m_renderer.GetSettings().Render);
 		ImGui::Checkbox("Accumulate", &m_renderer.GetSettings().Accumulate);
-		ImGui::Checkbox("Use Sphere Scene", &m_renderer.GetSettings().UseSphereScene);
+		const char* sceneNames[SCENE_COUNT] = { "Mesh", "Spheres", "Mesh + Particles", "Instances" };
+		if (ImGui::Combo("Scene", &m_sceneType, sceneNames, SCENE_COUNT))
+			m_renderer.ResetFrameIndex();
 		ImGui::Checkbox("Use ACE Color", &m_renderer.GetSettings().UseACE_Color);
 		ImGui::Checkbox("AA", &m_renderer.GetSettings().AntiAliasing);
+		const char* accelNames[ACCEL_COUNT] = { "KD-tree", "BVH2", "BVH4", "BVH4 8-bit" };
+		if (ImGui::Combo("Accelerator", (int*)&m_renderer.GetSettings().Accel, accelNames, ACCEL_COUNT))
+			m_renderer.ResetFrameIndex();
+		const char* bvhBuildNames[] = { "SAH", "LBVH" };
+		if (ImGui::Combo("BVH Build", (int*)&scene.bvhBuildMode, bvhBuildNames, IM_ARRAYSIZE(bvhBuildNames))) {
+			scene.BuildSphereAccelerators();
+			m_renderer.ResetFrameIndex();
+		}
+		ImGui::Checkbox("Primary Ray Packets", &m_renderer.GetSettings().UsePackets);
+		ImGui::Checkbox("Wavefront", &m_renderer.GetSettings().Wavefront);
+		if (ImGui::Checkbox("Sample Lights", &m_renderer.GetSettings().SampleLights))
+			m_renderer.ResetFrameIndex();
+		ImGui::Checkbox("KD Ropes", &m_renderer.GetSettings().UseKDRopes);
+		if (ImGui::Checkbox("KD SIMD Leaves", &scene.kdSimdLeaves)) {
+			scene.BuildKDTree();
+			m_renderer.ResetFrameIndex();
+		}
+		ImGui::Checkbox("KD Mailbox", &m_renderer.GetSettings().UseKDMailbox);
 		ImGui::DragInt("# Bounces", (int*)&m_renderer.GetSettings().Bounces, 0.05f, 0);
 
+		if (scene.kd_tree && ImGui::CollapsingHeader("KD-tree Stats"))
+		{
+			const KDTreeStats& stats = scene.kd_tree->getStats();
+			ImGui::Text("SAH cost: %.2f | build %.1fms | %zu KB", stats.sah_cost, stats.build_time, stats.memory_bytes / 1024);
+			ImGui::Text("Nodes: %i (%i inner, %i leaves) | max depth %i", stats.num_nodes, stats.num_inner_nodes, stats.num_leaves, stats.max_depth);
+			ImGui::Text("Empty leaves: %i (%.1f%%)", stats.num_empty_leaves, 100.0f * stats.empty_leaf_ratio);
+			ImGui::Text("Triangle refs: %i (%.2fx duplication) | %.2f per leaf", stats.num_tri_refs, stats.duplication_factor, stats.avg_leaf_tris);
+
+			std::vector<float> leafSizes(stats.leaf_size_histogram.begin(), stats.leaf_size_histogram.end());
+			ImGui::PlotHistogram("Leaf sizes", leafSizes.data(), (int)leafSizes.size(), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0.0f, 60.0f));
+			std::vector<float> depths(stats.depth_histogram.begin(), stats.depth_histogram.end());
+			ImGui::PlotHistogram("Leaf depths", depths.data(), (int)depths.size(), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0.0f, 60.0f));
+
+			if (ImGui::Button("Copy as JSON"))
+				ImGui::SetClipboardText(scene.kd_tree->getStatsJSON().c_str());
+		}
+
 
-		//ImGui::SliderFloat3("Light Position:", glm::value_ptr(m_scene.lightPosition), -10.0f, 10.0f, "%.2f");
-		//ImGui::SliderFloat("Light Power:", &m_scene.lightPower, -1.0f, 2.0f, "%.2f");
+		//ImGui::SliderFloat3("Light Position:", glm::value_ptr(scene.lightPosition), -10.0f, 10.0f, "%.2f");
+		//ImGui::SliderFloat("Light Power:", &scene.lightPower, -1.0f, 2.0f, "%.2f");
 		ImGui::End();
 
-		// Materials
+		// Acceleration structures
+		ImGui::Begin("Accelerators");
+		for (int i = 0; i < ACCEL_COUNT; i++)
+		{
+			const Accelerator* accel = scene.GetAccelerator((AcceleratorType)i);
+			if (!accel)
+				continue;
+
+			ImGui::Text("%s: build %.1fms | %zu KB", accel->getName(), accel->getBuildTime(), accel->getMemoryBytes() / 1024);
+			if (m_benchmarkMRays[i] > 0.0f) {
+				ImGui::SameLine();
+				if (m_benchmarkMRays[ACCEL_KD_TREE] > 0.0f)
+					ImGui::Text("| %.2f MRays/s (%.2fx KD) | packets %.2f MRays/s", m_benchmarkMRays[i], m_benchmarkMRays[i] / m_benchmarkMRays[ACCEL_KD_TREE], m_benchmarkPacketMRays[i]);
+				else
+					ImGui::Text("| %.2f MRays/s | packets %.2f MRays/s", m_benchmarkMRays[i], m_benchmarkPacketMRays[i]);
+			}
+		}
+		if (scene.kd_tree) {
+			ImGui::Text("KD-tree cache: %s", scene.kd_tree->getLoadedFromCache() ? "loaded" : "built");
+
+			KDMailboxStats mailbox = scene.kd_tree->getMailboxStats();
+			uint64_t tested = mailbox.num_tested, skipped = mailbox.num_skipped;
+			ImGui::Text("KD mailbox: %llu of %llu triangle tests skipped (%.1f%%)", (unsigned long long)skipped, (unsigned long long)(tested + skipped),
+				tested + skipped > 0 ? 100.0 * skipped / (tested + skipped) : 0.0);
+			ImGui::SameLine();
+			if (ImGui::SmallButton("Reset"))
+				scene.kd_tree->resetMailboxStats();
+		}
+		ImGui::Text("Refit: BVH2 %.2fms, SAH %.1f (build %.1f) | BVH4 %.2fms, SAH %.1f (build %.1f)",
+			scene.bvh2->getRefitTime(), scene.bvh2->getSAHCost(), scene.bvh2->getBuildSAHCost(),
+			scene.bvh4->getRefitTime(), scene.bvh4->getSAHCost(), scene.bvh4->getBuildSAHCost());
+		ImGui::Text("BVH nodes: BVH2 %i | BVH4 %i | BVH4 8-bit %i", scene.bvh2->getNumNodes(), scene.bvh4->getNumNodes(), scene.bvh4_compressed->getNumNodes());
+		ImGui::Text("BVH4 8-bit nodes: %zu KB vs %zu KB (%.2fx smaller)", scene.bvh4_compressed->getNodeMemoryBytes() / 1024, scene.bvh4->getNodeMemoryBytes() / 1024,
+			(float)scene.bvh4->getNodeMemoryBytes() / (float)std::max(scene.bvh4_compressed->getNodeMemoryBytes(), (size_t)1));
+		if (m_benchmarkMRays[ACCEL_BVH4] > 0.0f && m_benchmarkMRays[ACCEL_BVH4_COMPRESSED] > 0.0f) {
+			ImGui::SameLine();
+			ImGui::Text("| %.2fx BVH4 speed", m_benchmarkMRays[ACCEL_BVH4_COMPRESSED] / m_benchmarkMRays[ACCEL_BVH4]);
+		}
+		if (scene.tlas) {
+			size_t blasBytes = 0;
+			for (const Mesh& mesh : scene.meshes)
+				blasBytes += mesh.blas->getMemoryBytes();
+
+			ImGui::Text("TLAS: %i instances of %zu meshes | build %.1fms | %zu KB + %zu KB BLAS", scene.tlas->getNumInstances(), scene.meshes.size(), scene.tlas->getBuildTime(), scene.tlas->getMemoryBytes() / 1024, blasBytes / 1024);
+		}
+		if (ImGui::Button("Benchmark primary rays"))
+			BenchmarkAccelerators();
+		ImGui::End();
+
+		// Materials, the light list follows emission and material changes
+		bool lightsChanged = false;
 		ImGui::Begin("Materials");
 
-		for (size_t i = 0; i < m_scene.materials.size(); i++)
+		for (size_t i = 0; i < scene.materials.size(); i++)
 		{
-			Material& mat = m_scene.materials[i];
+			Material& mat = scene.materials[i];
 
 			ImGui::PushID((int)i);
 			if (!mat.Name.empty())
@@ -293,7 +457,7 @@ public:
 				ImGui::Text("Material %i", i);
 
 			ImGui::ColorEdit3("Albedo", glm::value_ptr(mat.Albedo));
-			ImGui::DragFloat3("Emission", glm::value_ptr(mat.Emission), 0.1f, 0.0f, 200.0f);
+			lightsChanged |= ImGui::DragFloat3("Emission", glm::value_ptr(mat.Emission), 0.1f, 0.0f, 200.0f);
 			ImGui::DragFloat("Roughness", &mat.Roughness, 0.01f, 0.0f, 1.0f);
 			ImGui::PopID();
 			ImGui::Separator();
@@ -304,32 +468,51 @@ public:
 
 		// Walls
 		ImGui::Begin("Walls");
-		for (size_t i = 0; i < m_scene.spheres.size(); i++)
+		ImGuiListClipper wallClipper;
+		wallClipper.Begin((int)scene.spheres.size());
+		while (wallClipper.Step())
 		{
-			ImGui::PushID((int)i);
-			ImGui::SliderInt("Material Index", (int*)&m_scene.spheres[i].MaterialIndex, 0, (int)m_scene.materials.size() - 1);
-			ImGui::PopID();
-			ImGui::Separator();
+			for (int i = wallClipper.DisplayStart; i < wallClipper.DisplayEnd; i++)
+			{
+				ImGui::PushID(i);
+				lightsChanged |= ImGui::SliderInt("Material Index", (int*)&scene.spheres[i].MaterialIndex, 0, (int)scene.materials.size() - 1);
+				ImGui::PopID();
+				ImGui::Separator();
+			}
 		}
 
 
 		ImGui::End();
 
-		// Spheres
+		// Spheres, moving or resizing one refits the structures indexing them
+		bool spheresChanged = false;
 		ImGui::Begin("Spheres");
-		for (size_t i = 0; i < m_scene.spheres.size(); i++)
+		ImGuiListClipper sphereClipper;
+		sphereClipper.Begin((int)scene.spheres.size());
+		while (sphereClipper.Step())
 		{
-			ImGui::PushID((int)i);
-			ImGui::DragFloat3("Position", glm::value_ptr(m_scene.spheres[i].Position), 0.1f);
-			ImGui::DragFloat("Radius", &m_scene.spheres[i].Radius, 0.01f, 0.1f, 5.0f);
-			ImGui::SliderInt("Material Index", (int*)&m_scene.spheres[i].MaterialIndex, 0, (int)m_scene.materials.size() - 1);
-			ImGui::PopID();
-			ImGui::Separator();
-			ImGui::Separator();
+			for (int i = sphereClipper.DisplayStart; i < sphereClipper.DisplayEnd; i++)
+			{
+				ImGui::PushID(i);
+				spheresChanged |= ImGui::DragFloat3("Position", glm::value_ptr(scene.spheres[i].Position), 0.1f);
+				spheresChanged |= ImGui::DragFloat("Radius", &scene.spheres[i].Radius, 0.01f, 0.1f, 5.0f);
+				lightsChanged |= ImGui::SliderInt("Material Index", (int*)&scene.spheres[i].MaterialIndex, 0, (int)scene.materials.size() - 1);
+				ImGui::PopID();
+				ImGui::Separator();
+				ImGui::Separator();
+			}
 		}
 
 		ImGui::End();
 
+		if (spheresChanged) {
+			scene.RefitSphereAccelerators();
+			m_renderer.ResetFrameIndex();
+		}
+
+		if (lightsChanged)
+			scene.BuildLights();
+
 		ImGui::PushStyleVar(ImGuiStyleVar_WindowPadding, ImVec2(0.0f, 0.0f));
 		ImGui::Begin("Viewport");
 
@@ -360,15 +543,96 @@ public:
 		m_camera.OnResize(m_viewportWidth, m_viewportHeight);
 
 		// render
-		m_renderer.Render(m_scene, m_camera);
+		m_renderer.Render(m_scenes[m_sceneType], m_camera);
 
 		m_lastRenderTime = timer.ElapsedMillis();
 	}
 
 
+	// Traces the current camera's primary rays through every accelerator, closest hit only.
+	void BenchmarkAccelerators() {
+		const std::vector<glm::vec3>& directions = m_camera.GetRayDirections();
+		if (directions.empty())
+			return;
+
+		const int repetitions = 4;
+
+		for (int i = 0; i < ACCEL_COUNT; i++)
+		{
+			const Accelerator* accel = m_scenes[m_sceneType].GetAccelerator((AcceleratorType)i);
+			m_benchmarkMRays[i] = 0.0f;
+			m_benchmarkPacketMRays[i] = 0.0f;
+			if (!accel)
+				continue;
+
+			Timer timer;
+			for (int r = 0; r < repetitions; r++)
+			{
+				std::for_each(std::execution::par, directions.begin(), directions.end(), [&](const glm::vec3& direction)
+				{
+					Ray ray;
+					ray.Origin = m_camera.GetPosition();
+					ray.Direction = direction;
+					ray.DirectionInverse = 1.0f / ray.Direction;
+					ray.TMin = m_camera.GetNearClip();
+					ray.TMax = m_camera.GetFarClip();
+
+					float t, u, v;
+					uint32_t triIndex;
+					accel->closestHit(&ray, t, triIndex, u, v);
+				});
+			}
+
+			m_benchmarkMRays[i] = (float)directions.size() * repetitions / (timer.ElapsedMillis() * 1000.0f);
+
+			// Same rays as 4x4 packets
+			uint32_t width = m_viewportWidth, height = m_viewportHeight;
+			if (directions.size() != (size_t)width * height)
+				continue;
+
+			std::vector<uint32_t> tileRows((height + RayPacket::Width - 1) / RayPacket::Width);
+			for (uint32_t y = 0; y < tileRows.size(); y++)
+				tileRows[y] = y * RayPacket::Width;
+
+			timer.Reset();
+			for (int r = 0; r < repetitions; r++)
+			{
+				std::for_each(std::execution::par, tileRows.begin(), tileRows.end(), [&](uint32_t y0)
+				{
+					for (uint32_t x0 = 0; x0 < width; x0 += RayPacket::Width)
+					{
+						RayPacket packet;
+						for (int k = 0; k < RayPacket::Size; k++)
+						{
+							uint32_t x = x0 + k % RayPacket::Width;
+							uint32_t y = y0 + k / RayPacket::Width;
+							if (x >= width || y >= height) {
+								packet.SetInactive(k);
+								continue;
+							}
+
+							Ray ray;
+							ray.Origin = m_camera.GetPosition();
+							ray.Direction = directions[y * width + x];
+							ray.DirectionInverse = 1.0f / ray.Direction;
+							ray.TMin = m_camera.GetNearClip();
+							ray.TMax = m_camera.GetFarClip();
+							packet.SetRay(k, ray);
+						}
+
+						accel->closestHitPacket(packet);
+					}
+				});
+			}
+
+			m_benchmarkPacketMRays[i] = (float)directions.size() * repetitions / (timer.ElapsedMillis() * 1000.0f);
+		}
+	}
+
 private:
 	Camera m_camera;
-	Scene m_scene;
+	Scene m_scenes[SCENE_COUNT];
+	int m_sceneType = SCENE_MESH;
 	Renderer m_renderer;
 
 
@@ -376,6 +640,8 @@ private:
 
 	// Gui vars
 	float m_lastRenderTime = 0.0f;
+	float m_benchmarkMRays[ACCEL_COUNT] = {};
+	float m_benchmarkPacketMRays[ACCEL_COUNT] = {};
 };
 
 
@@ -7,11 +7,20 @@
 #include <execution>
 
 #include "Ray.h"
+#include "KDAccel/Intersections.h"
 
 
 using namespace Walnut;
 
 const float EPSILON = 0.0002f;
+const glm::vec3 AMBIENT_COLOR{ 0.0f, 0.0f, 0.0f };
+
+// Queue entries handed to one task in the wavefront stages. A multiple of RayPacket::Size so primary-ray
+// chunks are whole packets.
+const uint32_t WAVEFRONT_CHUNK_SIZE = 4 * RayPacket::Size;
+
+// Shadow rays stop this fraction of the distance short of the light sample, so they don't hit the light itself
+const float SHADOW_RAY_END = 0.999f;
 
 Renderer::Renderer()
 {
@@ -39,6 +48,15 @@ void Renderer::OnResize(uint32_t width, uint32_t height)
 	for (uint32_t i = 0; i < height; i++)
 		m_ImageVerticalIter[i] = i;
 
+	m_ImageTileRowIter.resize((height + RayPacket::Width - 1) / RayPacket::Width);
+	for (uint32_t i = 0; i < m_ImageTileRowIter.size(); i++)
+		m_ImageTileRowIter[i] = i * RayPacket::Width;
+
+	m_paths.resize(width * height);
+	m_pathHits.resize(width * height);
+	m_pathAlive.resize(width * height);
+	m_shadowRays.resize(width * height);
+
 	ResetFrameIndex();
 }
 
@@ -47,6 +65,35 @@ void Renderer::Render(const Scene& scene, const Camera& camera)
 	m_activeScene = &scene;
 	m_activeCamera = &camera;
 
+	// Fall back to the first structure built for this scene if the selected one wasn't
+	m_accelerator = m_activeScene->GetAccelerator(m_settings.Accel);
+	for (int i = 0; i < ACCEL_COUNT && !m_accelerator; i++)
+		m_accelerator = m_activeScene->GetAccelerator((AcceleratorType)i);
+
+	// A structure that only indexes triangles would leave every sphere to a linear test per ray, switch to one
+	// that indexes them too if the scene has any
+	size_t numSpheres = m_activeScene->spheres.size();
+	for (int i = 0; i < ACCEL_COUNT && m_accelerator->getNumSpheres() < (int)numSpheres; i++)
+	{
+		const Accelerator* accelerator = m_activeScene->GetAccelerator((AcceleratorType)i);
+		if (accelerator && accelerator->getNumSpheres() >= (int)numSpheres)
+			m_accelerator = accelerator;
+	}
+
+	// The kd-tree is shared between renderers, it's traced with this renderer's options instead of being set up
+	if (m_accelerator == m_activeScene->kd_tree.get()) {
+		KDTraversalOptions options;
+		options.use_ropes = m_settings.UseKDRopes;
+		options.mailboxing = m_settings.UseKDMailbox;
+		m_kdTraversal = KDTreeTraversal(m_activeScene->kd_tree.get(), options);
+		m_accelerator = &m_kdTraversal;
+	}
+
+	// Only if no structure built for this scene indexes the spheres
+	m_linearSpheres = m_accelerator->getNumSpheres() < (int)numSpheres;
+
+	m_rayCount = 0;
+
 	uint32_t width = m_Image->GetWidth();
 	uint32_t height = m_Image->GetHeight();
 
@@ -56,29 +103,31 @@ void Renderer::Render(const Scene& scene, const Camera& camera)
 		memset(m_AccumulationBuffer, 0, width * height * sizeof(glm::vec3));
 
 
-	std::for_each(std::execution::par_unseq, m_ImageVerticalIter.begin(), m_ImageVerticalIter.end(),[this, width](uint32_t y)
-	{
-		for (uint32_t x = 0; x < width; x++)
+	// par rather than par_unseq, rows add to the atomic ray counter
+	if (m_settings.Wavefront) {
+		RenderWavefront();
+	}
+	else if (m_settings.UsePackets && !m_linearSpheres) {
+		// Primary rays go out as 4x4 packets, the bounces after that one by one
+		std::for_each(std::execution::par, m_ImageTileRowIter.begin(), m_ImageTileRowIter.end(), [this, width](uint32_t y)
 		{
-			uint32_t pixelIndex = y * width + x;
-			glm::vec3 pixelColor = PerPixel(x, y);
-
-			m_AccumulationBuffer[pixelIndex] += pixelColor;
-
-			glm::vec3 accumulatedColor;
-			if (m_settings.UseACE_Color)
-				accumulatedColor = Util::LinearToSRGB(Util::ACESFilm(m_AccumulationBuffer[pixelIndex] / (float)m_frameindex));
-			else
-				accumulatedColor = m_AccumulationBuffer[pixelIndex] / (float)m_frameindex;
+			uint32_t rowRays = 0;
+			for (uint32_t x = 0; x < width; x += RayPacket::Width)
+				RenderTile(x, y, rowRays);
 
+			m_rayCount += rowRays;
+		});
+	}
+	else {
+		std::for_each(std::execution::par, m_ImageVerticalIter.begin(), m_ImageVerticalIter.end(), [this, width](uint32_t y)
+		{
+			uint32_t rowRays = 0;
+			for (uint32_t x = 0; x < width; x++)
+				AccumulatePixel(y * width + x, PerPixel(x, y, rowRays));
 
-			uint32_t px = pixelIndex * 4;
-			m_ImageData[px] = accumulatedColor.r;
-			m_ImageData[px + 1] = accumulatedColor.g;
-			m_ImageData[px + 2] = accumulatedColor.b;
-			m_ImageData[px + 3] = 1.0f;
-		}
-	});
+			m_rayCount += rowRays;
+		});
+	}
 
 	// Anti alias
 	if (m_settings.AntiAliasing) {
@@ -135,169 +184,535 @@ void Renderer::Render(const Scene& scene, const Camera& camera)
 }
 
 
-glm::vec3 Renderer::PerPixel(uint32_t x, uint32_t y) {
+void Renderer::AccumulatePixel(uint32_t pixelIndex, const glm::vec3& pixelColor)
+{
+	m_AccumulationBuffer[pixelIndex] += pixelColor;
+
+	glm::vec3 accumulatedColor;
+	if (m_settings.UseACE_Color)
+		accumulatedColor = Util::LinearToSRGB(Util::ACESFilm(m_AccumulationBuffer[pixelIndex] / (float)m_frameindex));
+	else
+		accumulatedColor = m_AccumulationBuffer[pixelIndex] / (float)m_frameindex;
+
+
+	uint32_t px = pixelIndex * 4;
+	m_ImageData[px] = accumulatedColor.r;
+	m_ImageData[px + 1] = accumulatedColor.g;
+	m_ImageData[px + 2] = accumulatedColor.b;
+	m_ImageData[px + 3] = 1.0f;
+}
+
+void Renderer::RenderTile(uint32_t x0, uint32_t y0, uint32_t& rayCount)
+{
+	uint32_t width = m_Image->GetWidth();
+	uint32_t height = m_Image->GetHeight();
+
+	RayPacket packet;
+	for (int i = 0; i < RayPacket::Size; i++)
+	{
+		uint32_t x = x0 + i % RayPacket::Width;
+		uint32_t y = y0 + i / RayPacket::Width;
+
+		if (x < width && y < height)
+			packet.SetRay(i, PrimaryRay(x, y));
+		else
+			packet.SetInactive(i);
+	}
+
+	m_accelerator->closestHitPacket(packet);
+
+	for (int i = 0; i < RayPacket::Size; i++)
+	{
+		uint32_t x = x0 + i % RayPacket::Width;
+		uint32_t y = y0 + i / RayPacket::Width;
+		if (x >= width || y >= height)
+			continue;
+
+		Ray ray = packet.GetRay(i);
+		HitData primaryHit = packet.Hit[i]
+			? ClosestHit(&ray, packet.T[i], packet.PrimId[i], packet.U[i], packet.V[i])
+			: Miss();
+		TraceInstances(&ray, primaryHit);
+
+		AccumulatePixel(y * width + x, PerPixel(x, y, rayCount, &primaryHit));
+	}
+}
+
+Ray Renderer::PrimaryRay(uint32_t x, uint32_t y) const
+{
 	Ray ray;
 	ray.Origin = m_activeCamera->GetPosition();
 	ray.Direction = m_activeCamera->GetRayDirections()[y * m_Image->GetWidth() + x];
+	ray.DirectionInverse = glm::vec3(1.0f / ray.Direction.x, 1.0f / ray.Direction.y, 1.0f / ray.Direction.z);
 
+	// Camera rays only see what lies between the clip planes
+	ray.TMin = m_activeCamera->GetNearClip();
+	ray.TMax = m_activeCamera->GetFarClip();
 
-	glm::vec3 ambientColor{ 0.0f, 0.0f, 0.0f};
-	glm::vec3 finalColor{ 0.0f };
-	glm::vec3 contribution{ 1.0f };
+	return ray;
+}
+
+glm::vec3 Renderer::PerPixel(uint32_t x, uint32_t y, uint32_t& rayCount, const HitData* primaryHit) {
+	PathState path;
+	path.PathRay = PrimaryRay(x, y);
+	path.Color = glm::vec3(0.0f);
+	path.Contribution = glm::vec3(1.0f);
+	path.SampledLights = false;
 
 
 	for (size_t i = 0; i < m_settings.Bounces; i++)
 	{
+		Ray& ray = path.PathRay;
 		ray.DirectionInverse = glm::vec3(1.0f / ray.Direction.x, 1.0f / ray.Direction.y, 1.0f / ray.Direction.z);
 
-		// Shoot ray into scene
-		HitData hitdata = TraceRay(&ray);
+		// Shoot ray into scene, unless the first hit came from a packet
+		HitData hitdata = (i == 0 && primaryHit) ? *primaryHit : TraceRay(&ray);
+		rayCount++;
 
 		// no hit
 		if (hitdata.Distance < 0.0f) {
-			finalColor += contribution * ambientColor;
+			path.Color += path.Contribution * AMBIENT_COLOR;
 			break;
 		}
 
-		// What material did we hit?
-		Material mat = m_activeScene->materials[hitdata.MaterialIndex];
-
-
+		ShadowRay shadow;
+		bool alive = ShadeHit(path, hitdata, shadow);
 
+		if (shadow.Active) {
+			rayCount++;
+			if (!Occluded(&shadow.VisibilityRay, shadow.TMax))
+				path.Color += shadow.Radiance;
+		}
 
-		bool doTransmission = false;
-		bool hitInside = glm::dot(ray.Direction, hitdata.Normal) > 0.0f;
-		glm::vec3 normalSurface = hitInside ? -hitdata.Normal : hitdata.Normal;
+		if (!alive)
+			break;
+	}
 
-		// New ray origin offset from last hit position along surface normal
-		ray.Origin = hitdata.Position + normalSurface * EPSILON;
+	return path.Color;
+}
 
+// Runs func(begin, end) over [0, count) in WAVEFRONT_CHUNK_SIZE pieces, in parallel.
+template<typename Func>
+void Renderer::ForEachChunk(uint32_t count, Func func)
+{
+	m_waveChunks.resize((count + WAVEFRONT_CHUNK_SIZE - 1) / WAVEFRONT_CHUNK_SIZE);
+	for (uint32_t i = 0; i < m_waveChunks.size(); i++)
+		m_waveChunks[i] = i * WAVEFRONT_CHUNK_SIZE;
 
-		if (mat.Transparency > 0.0f) {
-			// fresnel term    0: no reflect   1: full reflect
-			float fresnel = glm::dot(ray.Direction, -normalSurface);
+	std::for_each(std::execution::par, m_waveChunks.begin(), m_waveChunks.end(), [count, &func](uint32_t begin)
+	{
+		func(begin, std::min(begin + WAVEFRONT_CHUNK_SIZE, count));
+	});
+}
 
-			//if (Random::Float() < fresnel) {
-				doTransmission = true;
-			//}
-		}
+// Wavefront integrator: instead of following one path to the end, every stage runs over the whole frame.
+// Each bounce traces the ray queue in bulk, orders the hits by material, shades them in that order, traces the
+// light samples of the shaded hits as a shadow queue and compacts the surviving paths into the next queue.
+// Uses the same ShadeHit() as PerPixel(), so both converge to the same image.
+void Renderer::RenderWavefront()
+{
+	uint32_t width = m_Image->GetWidth();
+	uint32_t height = m_Image->GetHeight();
 
+	// Camera rays in 4x4 tile order, consecutive queue entries form coherent packets
+	m_rayQueue.clear();
+	for (uint32_t y0 = 0; y0 < height; y0 += RayPacket::Width)
+	{
+		for (uint32_t x0 = 0; x0 < width; x0 += RayPacket::Width)
+		{
+			for (int i = 0; i < RayPacket::Size; i++)
+			{
+				uint32_t x = x0 + i % RayPacket::Width;
+				uint32_t y = y0 + i / RayPacket::Width;
+				if (x >= width || y >= height)
+					continue;
 
-		// Transmission or reflection ray?
-		if (doTransmission) {
-			//// glsl way (me no workeee, why?)
-			//ray.Direction = glm::refract(ray.Direction, hitdata.Normal, hitInside ? mat.IOR : 1.0f / mat.IOR);
-			//continue;
+				uint32_t pathIndex = (uint32_t)m_rayQueue.size();
+				PathState& path = m_paths[pathIndex];
+				path.PathRay = PrimaryRay(x, y);
+				path.Color = glm::vec3(0.0f);
+				path.Contribution = glm::vec3(1.0f);
+				path.PixelIndex = y * width + x;
+				path.SampledLights = false;
 
-			Ray refractionRay;
-			if (RefractionRay(ray.Direction, hitdata.Normal, hitdata.Position, mat.IOR, refractionRay)) {
-				ray = refractionRay;
-				continue;
+				m_rayQueue.push_back(pathIndex);
 			}
 		}
-		else {
-			glm::vec3 diffuseRayDir = glm::normalize(hitdata.Normal + Util::RandomUnitVector());
-			glm::vec3 reflectedVector = glm::reflect(ray.Direction, hitdata.Normal);
-			reflectedVector = glm::normalize(glm::mix(reflectedVector, diffuseRayDir, mat.Roughness * mat.Roughness));
+	}
+	uint32_t numPaths = (uint32_t)m_rayQueue.size();
 
+	for (uint32_t bounce = 0; bounce < m_settings.Bounces && !m_rayQueue.empty(); bounce++)
+	{
+		m_rayCount += m_rayQueue.size();
 
-			//glm::vec3 randomHemisphereVector = glm::normalize(Util::RandomHemisphere(hitdata.Normal, mat.Roughness));
-			//glm::vec3 reflectedVector = glm::reflect(ray.Direction, randomHemisphereVector);
+		TraceWave(m_settings.UsePackets && !m_linearSpheres);
 
-			ray.Direction = reflectedVector;
+		// Counting sort of the hits by material, misses leave the wavefront here
+		std::vector<uint32_t>& materialOffsets = m_materialOffsets;
+		materialOffsets.assign(m_activeScene->materials.size() + 1, 0);
+		for (uint32_t pathIndex : m_rayQueue)
+		{
+			const HitData& hit = m_pathHits[pathIndex];
+			if (hit.Distance < 0.0f)
+				m_paths[pathIndex].Color += m_paths[pathIndex].Contribution * AMBIENT_COLOR;
+			else
+				materialOffsets[hit.MaterialIndex + 1]++;
 		}
+		for (size_t m = 1; m < materialOffsets.size(); m++)
+			materialOffsets[m] += materialOffsets[m - 1];
 
+		m_shadeQueue.resize(materialOffsets.back());
+		for (uint32_t pathIndex : m_rayQueue)
+		{
+			const HitData& hit = m_pathHits[pathIndex];
+			if (hit.Distance >= 0.0f)
+				m_shadeQueue[materialOffsets[hit.MaterialIndex]++] = pathIndex;
+		}
 
-		finalColor += mat.Emission * contribution;
-		contribution *= mat.Albedo;
+		// Shade, one material after another. Light samples go to the shadow queue instead of being traced here
+		ForEachChunk((uint32_t)m_shadeQueue.size(), [this](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t i = begin; i < end; i++)
+			{
+				uint32_t pathIndex = m_shadeQueue[i];
+				m_pathAlive[pathIndex] = ShadeHit(m_paths[pathIndex], m_pathHits[pathIndex], m_shadowRays[pathIndex]);
+			}
+		});
 
+		// Shadow queue in image order, so neighbouring entries test neighbouring points against the same light
+		m_shadowQueue.clear();
+		for (uint32_t pathIndex : m_rayQueue)
+		{
+			if (m_pathHits[pathIndex].Distance >= 0.0f && m_shadowRays[pathIndex].Active)
+				m_shadowQueue.push_back(pathIndex);
+		}
+		m_rayCount += m_shadowQueue.size();
+		TraceShadowWave();
 
-		// Russian Roulette
-		// As the throughput gets smaller, the ray is more likely to get terminated early.
-		// Survivors have their value boosted to make up for fewer samples being in the average.
+		// Survivors form the next bounce's queue, bucketed by direction octant (image order within an octant)
+		// so consecutive entries share direction signs and trace well as packets
+		uint32_t octantOffsets[9] = {};
+		for (uint32_t pathIndex : m_rayQueue)
 		{
-			float p = std::max(contribution.r, std::max(contribution.g, contribution.b));
-			if (Random::Float() > p)
-				break;
+			if (m_pathHits[pathIndex].Distance >= 0.0f && m_pathAlive[pathIndex])
+				octantOffsets[DirectionOctant(m_paths[pathIndex].PathRay.Direction) + 1]++;
+		}
+		for (int o = 1; o < 9; o++)
+			octantOffsets[o] += octantOffsets[o - 1];
 
-			// Add the energy we 'lose' by randomly terminating paths
-			contribution *= 1.0f / p;
+		m_nextRayQueue.resize(octantOffsets[8]);
+		for (uint32_t pathIndex : m_rayQueue)
+		{
+			if (m_pathHits[pathIndex].Distance >= 0.0f && m_pathAlive[pathIndex])
+				m_nextRayQueue[octantOffsets[DirectionOctant(m_paths[pathIndex].PathRay.Direction)]++] = pathIndex;
 		}
+		std::swap(m_rayQueue, m_nextRayQueue);
 	}
 
-	return finalColor;
+	ForEachChunk(numPaths, [this](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; i++)
+			AccumulatePixel(m_paths[i].PixelIndex, m_paths[i].Color);
+	});
 }
 
-Renderer::HitData Renderer::TraceRay(Ray* ray)
+// Trace stage of the wavefront: closest hit for every queued path, as packets of consecutive queue entries if enabled.
+void Renderer::TraceWave(bool usePackets)
 {
-	float closestDistSpheres = FLT_MAX;
-	int closestSphereIndex = -1;
+	ForEachChunk((uint32_t)m_rayQueue.size(), [this, usePackets](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; i++)
+		{
+			Ray& ray = m_paths[m_rayQueue[i]].PathRay;
+			ray.DirectionInverse = glm::vec3(1.0f / ray.Direction.x, 1.0f / ray.Direction.y, 1.0f / ray.Direction.z);
+		}
 
-	float closestDistTriangles = FLT_MAX;
-	int closestTriangleIndex = -1;
-	float closestTriangle_u = 0.0f;
-	float closestTriangle_v = 0.0f;
+		if (!usePackets) {
+			for (uint32_t i = begin; i < end; i++)
+				m_pathHits[m_rayQueue[i]] = TraceRay(&m_paths[m_rayQueue[i]].PathRay);
+			return;
+		}
 
+		for (uint32_t first = begin; first < end; first += RayPacket::Size)
+		{
+			RayPacket packet;
+			for (int k = 0; k < RayPacket::Size; k++)
+			{
+				if (first + k < end)
+					packet.SetRay(k, m_paths[m_rayQueue[first + k]].PathRay);
+				else
+					packet.SetInactive(k);
+			}
 
+			m_accelerator->closestHitPacket(packet);
 
-	if (m_settings.UseSphereScene) {
-		// Sphere intersections
-		// Only dependant on ray direction
-		float a = glm::dot(ray->Direction, ray->Direction);
-		float dbl_a = (2.0f * a);
+			for (int k = 0; k < RayPacket::Size && first + k < end; k++)
+			{
+				Ray ray = packet.GetRay(k);
+				HitData& hit = m_pathHits[m_rayQueue[first + k]];
+				hit = packet.Hit[k]
+					? ClosestHit(&ray, packet.T[k], packet.PrimId[k], packet.U[k], packet.V[k])
+					: Miss();
+				TraceInstances(&ray, hit);
+			}
+		}
+	});
+}
 
-		// Loop through scene to find closest hit (if any)
-		for (int i = 0; i < m_activeScene->spheres.size(); i++)
+// Shadow stage of the wavefront: adds the radiance of every queued light sample that nothing blocks
+void Renderer::TraceShadowWave()
+{
+	ForEachChunk((uint32_t)m_shadowQueue.size(), [this](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; i++)
 		{
-			const Sphere& sphere = m_activeScene->spheres[i];
+			uint32_t pathIndex = m_shadowQueue[i];
+			ShadowRay& shadow = m_shadowRays[pathIndex];
+			if (!Occluded(&shadow.VisibilityRay, shadow.TMax))
+				m_paths[pathIndex].Color += shadow.Radiance;
+		}
+	});
+}
+
+// Index 0-7 from the signs of the direction components
+uint32_t Renderer::DirectionOctant(const glm::vec3& direction)
+{
+	return (direction.x < 0.0f ? 1 : 0) | (direction.y < 0.0f ? 2 : 0) | (direction.z < 0.0f ? 4 : 0);
+}
 
-			glm::vec3 rayOrigin = ray->Origin - sphere.Position;
+// Applies the material at a hit to the path and turns its ray into the next bounce. Lambertian hits (roughness 1,
+// opaque) also sample a light, the caller traces shadow and adds its radiance if the light is visible. Returns false
+// once the path is terminated by Russian roulette.
+bool Renderer::ShadeHit(PathState& path, const HitData& hitdata, ShadowRay& shadow)
+{
+	Ray& ray = path.PathRay;
+	glm::vec3& finalColor = path.Color;
+	glm::vec3& contribution = path.Contribution;
+	shadow.Active = false;
 
-			float b = 2.0f * glm::dot(rayOrigin, ray->Direction);
-			float c = glm::dot(rayOrigin, rayOrigin) - sphere.Radius * sphere.Radius;
+	// What material did we hit?
+	Material mat = m_activeScene->materials[hitdata.MaterialIndex];
 
-			float discriminant = b * b - 4.0f * a * c;
+	// Light sampling at the previous hit already accounted for light from world space emitters
+	bool countEmission = !(path.SampledLights && hitdata.WorldSpace);
+	path.SampledLights = false;
 
-			// hit
-			if (discriminant >= 0.0f) {
-				float t = (-b - glm::sqrt(discriminant)) / dbl_a;
 
-				if (t > 0.0f && t < closestDistSpheres){
-					closestDistSpheres = t;
-					closestSphereIndex = i;
-				}
-			}
+
+
+	bool doTransmission = false;
+	bool hitInside = glm::dot(ray.Direction, hitdata.Normal) > 0.0f;
+	glm::vec3 normalSurface = hitInside ? -hitdata.Normal : hitdata.Normal;
+
+	// New ray origin offset from last hit position along surface normal
+	ray.Origin = hitdata.Position + normalSurface * EPSILON;
+	ray.TMin = 0.0f;
+	ray.TMax = FLT_MAX;
+
+
+	if (mat.Transparency > 0.0f) {
+		// fresnel term    0: no reflect   1: full reflect
+		float fresnel = glm::dot(ray.Direction, -normalSurface);
+
+		//if (Random::Float() < fresnel) {
+			doTransmission = true;
+		//}
+	}
+
+
+	// Transmission or reflection ray?
+	if (doTransmission) {
+		//// glsl way (me no workeee, why?)
+		//ray.Direction = glm::refract(ray.Direction, hitdata.Normal, hitInside ? mat.IOR : 1.0f / mat.IOR);
+		//continue;
+
+		Ray refractionRay;
+		if (RefractionRay(ray.Direction, hitdata.Normal, hitdata.Position, mat.IOR, refractionRay)) {
+			ray = refractionRay;
+			return true;
 		}
 	}
 	else {
-		// Triangle intersections
-		float t = 0.0f;
-		float u = 0.0f;
-		float v = 0.0f;
-
-		uint32_t hitIndex = 0;
-
-		if (m_activeScene->kd_tree->intersect(ray, t, hitIndex, u, v)) {
-			closestDistTriangles = t;
-			closestTriangleIndex = hitIndex;
-			closestTriangle_u = u;
-			closestTriangle_v = v;
+		// Cosine weighted diffuse bounces of a fully rough surface sample the Lambertian BRDF, its direct light can
+		// be sampled separately
+		if (m_settings.SampleLights && mat.Roughness >= 1.0f)
+			path.SampledLights = SampleLight(ray.Origin, normalSurface, contribution * mat.Albedo, shadow);
+
+		glm::vec3 diffuseRayDir = glm::normalize(hitdata.Normal + Util::RandomUnitVector());
+		glm::vec3 reflectedVector = glm::reflect(ray.Direction, hitdata.Normal);
+		reflectedVector = glm::normalize(glm::mix(reflectedVector, diffuseRayDir, mat.Roughness * mat.Roughness));
+
+
+		//glm::vec3 randomHemisphereVector = glm::normalize(Util::RandomHemisphere(hitdata.Normal, mat.Roughness));
+		//glm::vec3 reflectedVector = glm::reflect(ray.Direction, randomHemisphereVector);
+
+		ray.Direction = reflectedVector;
+	}
+
+
+	if (countEmission)
+		finalColor += mat.Emission * contribution;
+	contribution *= mat.Albedo;
+
+
+	// Russian Roulette
+	// As the throughput gets smaller, the ray is more likely to get terminated early.
+	// Survivors have their value boosted to make up for fewer samples being in the average.
+	{
+		float p = std::max(contribution.r, std::max(contribution.g, contribution.b));
+		if (Random::Float() > p)
+			return false;
+
+		// Add the energy we 'lose' by randomly terminating paths
+		contribution *= 1.0f / p;
+	}
+
+	return true;
+}
+
+// Next event estimation: picks one of the scene's lights uniformly and a point uniformly on its surface, and sets up
+// the shadow ray towards it. weight is the path's contribution times the albedo at the hit. Returns false if the scene
+// has no lights, then the next hit's emission has to be counted instead.
+bool Renderer::SampleLight(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& weight, ShadowRay& shadow)
+{
+	const std::vector<Light>& lights = m_activeScene->lights;
+	if (lights.empty())
+		return false;
+
+	const Light& light = lights[std::min((size_t)(Random::Float() * lights.size()), lights.size() - 1)];
+
+	glm::vec3 lightPoint, lightNormal;
+	float area;
+	uint32_t materialIndex;
+	bool twoSided;
+	if (light.Type == PRIM_SPHERE) {
+		const Sphere& sphere = m_activeScene->spheres[light.Index];
+		lightNormal = Util::RandomUnitVector();
+		lightPoint = sphere.Position + sphere.Radius * lightNormal;
+		area = 2.0f * TwoPi * sphere.Radius * sphere.Radius;
+		materialIndex = sphere.MaterialIndex;
+		twoSided = false;
+	}
+	else {
+		const Triangle& triangle = m_activeScene->triangles[light.Index];
+		float b1 = Random::Float();
+		float b2 = Random::Float();
+		if (b1 + b2 > 1.0f) {
+			b1 = 1.0f - b1;
+			b2 = 1.0f - b2;
 		}
+
+		glm::vec3 edge1 = triangle.Vertices[1] - triangle.Vertices[0];
+		glm::vec3 edge2 = triangle.Vertices[2] - triangle.Vertices[0];
+		glm::vec3 cross = glm::cross(edge1, edge2);
+		lightPoint = triangle.Vertices[0] + b1 * edge1 + b2 * edge2;
+		area = 0.5f * glm::length(cross);
+		lightNormal = cross / std::max(2.0f * area, FLT_MIN);
+		materialIndex = triangle.MaterialIndex;
+		twoSided = true;
 	}
 
+	// Points on the far side of a sphere light are hidden by the sphere itself, triangles emit from both faces
+	glm::vec3 toLight = lightPoint - position;
+	float distance = glm::length(toLight);
+	glm::vec3 direction = toLight / distance;
+	float cosSurface = glm::dot(normal, direction);
+	float cosLight = twoSided ? std::abs(glm::dot(lightNormal, direction)) : -glm::dot(lightNormal, direction);
+	if (cosSurface <= 0.0f || cosLight <= 0.0f || distance <= 0.0f)
+		return true;
+
+	// Lambertian BRDF albedo / pi, area pdf 1 / (lights * area)
+	float geometry = cosSurface * cosLight / (distance * distance);
+	shadow.Radiance = weight * m_activeScene->materials[materialIndex].Emission * (geometry * area * (float)lights.size() / Pi);
+
+	shadow.VisibilityRay.Origin = position;
+	shadow.VisibilityRay.Direction = direction;
+	shadow.VisibilityRay.DirectionInverse = glm::vec3(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+	shadow.VisibilityRay.TMin = 0.0f;
+	shadow.TMax = distance * SHADOW_RAY_END;
+	shadow.VisibilityRay.TMax = shadow.TMax;
+	shadow.Active = true;
+
+	return true;
+}
+
+Renderer::HitData Renderer::TraceRay(Ray* ray)
+{
+	float t = 0.0f;
+	float u = 0.0f;
+	float v = 0.0f;
+	uint32_t primId = 0;
+
+	bool hit = m_accelerator->closestHit(ray, t, primId, u, v);
+
+	if (m_linearSpheres) {
+		float closestDist = hit ? t : ray->TMax;
+
+		for (int i = 0; i < m_activeScene->spheres.size(); i++)
+		{
+			const Sphere& sphere = m_activeScene->spheres[i];
+
+			float sphereDist;
+			if (Intersections::sphereIntersect(ray, sphere.Position, sphere.Radius, sphereDist) && sphereDist >= ray->TMin && sphereDist < closestDist) {
+				closestDist = sphereDist;
+				primId = ACCEL_PRIM_SPHERE_BIT | i;
+				hit = true;
+			}
+		}
 
+		t = closestDist;
+	}
 
+	HitData hitdata = hit ? ClosestHit(ray, t, primId, u, v) : Miss();
+	TraceInstances(ray, hitdata);
 
+	return hitdata;
+}
 
-	if (closestSphereIndex < 0 && closestTriangleIndex < 0)
-		return Miss();
+// Instanced meshes sit in the scene's top-level structure, next to the world space primitives. Replaces hit
+// if an instance is closer.
+void Renderer::TraceInstances(Ray* ray, HitData& hit)
+{
+	if (!m_activeScene->tlas)
+		return;
 
-	// Sphere is closer
-	if (closestDistSpheres < closestDistTriangles)
-		return ClosestHitSphere(ray, closestDistSpheres, closestSphereIndex);
+	Ray instanceRay = *ray;
+	if (hit.Distance >= 0.0f)
+		instanceRay.TMax = hit.Distance;
 
-	// triangle closer
-	return ClosestHitTriangle(ray, closestDistTriangles, closestTriangleIndex, closestTriangle_u, closestTriangle_v);
+	float t, u, v;
+	uint32_t instanceIndex, primId;
+	if (m_activeScene->tlas->closestHit(&instanceRay, t, instanceIndex, primId, u, v))
+		hit = ClosestHitInstance(ray, t, instanceIndex, primId, u, v);
+}
+
+// Visibility test for shadow/AO style rays: stops at the first blocker in [ray->TMin, tMax] instead of
+// searching for the closest one.
+bool Renderer::Occluded(Ray* ray, float tMax)
+{
+	if (m_accelerator->occluded(ray, tMax))
+		return true;
+
+	if (m_activeScene->tlas && m_activeScene->tlas->occluded(ray, tMax))
+		return true;
+
+	if (m_linearSpheres) {
+		for (const Sphere& sphere : m_activeScene->spheres)
+		{
+			if (Intersections::sphereOccluded(ray, sphere.Position, sphere.Radius, ray->TMin, tMax))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+Renderer::HitData Renderer::ClosestHit(Ray* ray, float distance, uint32_t primId, float u, float v)
+{
+	if (getPrimitiveType(primId) == PRIM_SPHERE)
+		return ClosestHitSphere(ray, distance, getPrimitiveIndex(primId));
+
+	return ClosestHitTriangle(ray, distance, primId, u, v);
 }
 
 Renderer::HitData Renderer::ClosestHitSphere(Ray* ray, float distance, uint32_t objectIndex)
@@ -312,6 +727,7 @@ Renderer::HitData Renderer::ClosestHitSphere(Ray* ray, float distance, uint32_t
 	hitdata.Position = hitPoint;
 	hitdata.Normal = normal;
 	hitdata.MaterialIndex = m_activeScene->spheres[objectIndex].MaterialIndex;
+	hitdata.WorldSpace = true;
 
 	return hitdata;
 }
@@ -327,6 +743,26 @@ Renderer::HitData Renderer::ClosestHitTriangle(Ray* ray, float distance, uint32_
 	hitdata.Position = hitPoint;
 	hitdata.Normal = glm::normalize(nrm);
 	hitdata.MaterialIndex = m_activeScene->triangles[objectIndex].MaterialIndex;
+	hitdata.WorldSpace = true;
+
+	return hitdata;
+}
+
+Renderer::HitData Renderer::ClosestHitInstance(Ray* ray, float distance, uint32_t instanceIndex, uint32_t primId, float u, float v)
+{
+	const MeshInstance& instance = m_activeScene->instances[instanceIndex];
+	const Triangle& triangle = m_activeScene->meshes[instance.MeshIndex].triangles[primId];
+
+	// Object space normal to world space with the inverse transpose
+	glm::vec3 nrm = (1.0f - u - v) * triangle.Normals[0] + u * triangle.Normals[1] + v * triangle.Normals[2];
+	nrm = glm::transpose(glm::mat3(m_activeScene->tlas->getWorldToObject(instanceIndex))) * nrm;
+
+	HitData hitdata;
+	hitdata.Distance = distance;
+	hitdata.Position = ray->Origin + ray->Direction * distance;
+	hitdata.Normal = glm::normalize(nrm);
+	hitdata.MaterialIndex = triangle.MaterialIndex;
+	hitdata.WorldSpace = false;
 
 	return hitdata;
 }
@@ -366,6 +802,7 @@ Renderer::HitData Renderer::Miss()
 {
 	HitData hitdata;
 	hitdata.Distance = -1.0f;
+	hitdata.WorldSpace = false;
 
 	return hitdata;
 }
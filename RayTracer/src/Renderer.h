@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <vector>
 
@@ -8,6 +9,7 @@
 #include "Scene.h"
 #include "Camera.h"
 #include "Ray.h"
+#include "RayPacket.h"
 
 float const Pi = std::atan(1.0f) * 4.0f;
 float const TwoPi = 2.0f * Pi;
@@ -103,9 +105,14 @@ public:
 	struct Settings {
 		bool Render = true;
 		bool Accumulate = true;
-		bool UseSphereScene = false;
 		bool UseACE_Color = true;
 		bool AntiAliasing = false;
+		bool UseKDRopes = false;
+		bool UseKDMailbox = false;
+		bool SampleLights = true;
+		AcceleratorType Accel = ACCEL_KD_TREE;
+		bool UsePackets = true;
+		bool Wavefront = false;
 		uint32_t Bounces = 8;
 	};
 	Settings& GetSettings() { return m_settings; }
@@ -121,6 +128,9 @@ public:
 	void ResetFrameIndex() { m_frameindex = 1; }
 	uint32_t GetFrameIndex() { return m_frameindex; }
 
+	// Rays traced during the last Render() call
+	uint64_t GetRayCount() const { return m_rayCount; }
+
 
 private:
 	struct HitData {
@@ -129,16 +139,50 @@ private:
 		glm::vec3 Normal;
 
 		int MaterialIndex;
+		bool WorldSpace;	// Not an instance. Only world space emitters are in the scene's light list
+	};
+
+	// Wavefront integrator state of one pixel's path
+	struct PathState {
+		Ray PathRay;
+		glm::vec3 Color;
+		glm::vec3 Contribution;
+		uint32_t PixelIndex;
+		bool SampledLights;	// Direct light at the last hit was sampled, the next hit's emission is already counted
+	};
+
+	// Visibility ray towards a light sample, Radiance is added to the path if nothing blocks it
+	struct ShadowRay {
+		Ray VisibilityRay;
+		float TMax;
+		glm::vec3 Radiance;
+		bool Active;
 	};
 
 
 	// Methods
-	glm::vec3 PerPixel(uint32_t x, uint32_t y);
+	glm::vec3 PerPixel(uint32_t x, uint32_t y, uint32_t& rayCount, const HitData* primaryHit = nullptr);
+	void RenderTile(uint32_t x0, uint32_t y0, uint32_t& rayCount);
+	void AccumulatePixel(uint32_t pixelIndex, const glm::vec3& pixelColor);
+
+	void RenderWavefront();
+	void TraceWave(bool usePackets);
+	void TraceShadowWave();
+	static uint32_t DirectionOctant(const glm::vec3& direction);
+	template<typename Func>
+	void ForEachChunk(uint32_t count, Func func);
+	Ray PrimaryRay(uint32_t x, uint32_t y) const;
 	HitData TraceRay(Ray* ray);
+	void TraceInstances(Ray* ray, HitData& hit);
+	bool ShadeHit(PathState& path, const HitData& hitdata, ShadowRay& shadow);
+	bool SampleLight(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& weight, ShadowRay& shadow);
+	bool Occluded(Ray* ray, float tMax);
 
 	HitData Miss();
+	HitData ClosestHit(Ray* ray, float distance, uint32_t primId, float u, float v);
 	HitData ClosestHitSphere(Ray* ray, float distance, uint32_t objectIndex);
 	HitData ClosestHitTriangle(Ray* ray, float distance, uint32_t objectIndex, float u, float v);
+	HitData ClosestHitInstance(Ray* ray, float distance, uint32_t instanceIndex, uint32_t primId, float u, float v);
 
 	bool RefractionRay(const glm::vec3& ray_dir_in, const glm::vec3& normal, const glm::vec3& intersection_point, float IOR, Ray& ray_out);
 
@@ -150,12 +194,29 @@ private:
 	// Members
 	const Camera* m_activeCamera = nullptr;
 	const Scene* m_activeScene = nullptr;
+	const Accelerator* m_accelerator = nullptr;
+	KDTreeTraversal m_kdTraversal;
+	bool m_linearSpheres = false;
 	Settings m_settings = Settings();
 
 	std::shared_ptr<Walnut::Image> m_Image;
 	float* m_ImageData = nullptr;
 	glm::vec3* m_AccumulationBuffer = nullptr;
 	std::vector<uint32_t> m_ImageVerticalIter;
+	std::vector<uint32_t> m_ImageTileRowIter;
+
+	// Wavefront integrator
+	std::vector<PathState> m_paths;
+	std::vector<HitData> m_pathHits;
+	std::vector<uint8_t> m_pathAlive;
+	std::vector<ShadowRay> m_shadowRays;
+	std::vector<uint32_t> m_rayQueue;
+	std::vector<uint32_t> m_nextRayQueue;
+	std::vector<uint32_t> m_shadeQueue;
+	std::vector<uint32_t> m_shadowQueue;
+	std::vector<uint32_t> m_materialOffsets;
+	std::vector<uint32_t> m_waveChunks;
 
 	uint32_t m_frameindex = 1;
+	std::atomic<uint64_t> m_rayCount = 0;
 };
\ No newline at end of file
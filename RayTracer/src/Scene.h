@@ -4,9 +4,16 @@
 #include <Walnut/Random.h>
 
 #include "KDAccel/KDTreeCPU.h"
+#include "BVHAccel/BVH2.h"
+#include "BVHAccel/BVH4.h"
+#include "BVHAccel/CompressedBVH4.h"
+#include "BVHAccel/TopLevelBVH.h"
 
 #include <vector>
 
+// Built kd-trees, keyed by mesh and build parameters
+const char* const KD_CACHE_DIRECTORY = "Cache";
+
 struct Sphere {
 	glm::vec3 Position{ 0.0f };
 	float Radius = 1.0f;
@@ -23,6 +30,26 @@ struct Triangle
 	glm::vec3 Centroid;
 };
 
+// Mesh asset with its own bottom-level structure, placed in the scene any number of times by MeshInstances
+struct Mesh {
+	std::vector<Triangle> triangles;
+	std::vector<glm::vec3> vertices;
+	std::vector<glm::uvec3> triIndices;
+
+	std::shared_ptr<BVH4> blas = nullptr;
+};
+
+struct MeshInstance {
+	uint32_t MeshIndex = 0;
+	glm::mat4 Transform{ 1.0f };
+};
+
+// Emissive world space primitive, sampled for direct light at diffuse hits
+struct Light {
+	PrimitiveType Type;
+	uint32_t Index;
+};
+
 struct Material {
 	std::string Name;
 
@@ -40,5 +67,129 @@ struct Scene {
 
 	std::vector<Triangle> triangles;
 
+	// Indexed triangle mesh the accelerators are built from, triIndices[i] is triangles[i]
+	std::vector<glm::vec3> vertices;
+	std::vector<glm::uvec3> triIndices;
+
 	std::shared_ptr<KDTreeCPU> kd_tree = nullptr;
+	std::shared_ptr<BVH2> bvh2 = nullptr;
+	std::shared_ptr<BVH4> bvh4 = nullptr;
+	std::shared_ptr<CompressedBVH4> bvh4_compressed = nullptr;
+
+	// kd-tree leaf layout, SoA packets of KD_SIMD_WIDTH triangles or one record per triangle
+	bool kdSimdLeaves = true;
+
+	// Builder of the structures indexing spheres. LBVH builds are cheap enough to rebuild on every change
+	// instead of refitting
+	BVHBuildMode bvhBuildMode = BVH_BUILD_SAH;
+
+	// Emissive world space triangles and spheres. Emitters on instanced meshes aren't sampled, bounces still pick up
+	// their emission
+	std::vector<Light> lights;
+
+	// Instanced geometry, traced next to the world space primitives above
+	std::vector<Mesh> meshes;
+	std::vector<MeshInstance> instances;
+	std::shared_ptr<TopLevelBVH> tlas = nullptr;
+
+	// The kd-tree only indexes triangles, the BVHs index triangles and spheres. The kd-tree is reused from
+	// KD_CACHE_DIRECTORY when this mesh was built before
+	void BuildAccelerators() {
+		BuildKDTree();
+		BuildSphereAccelerators();
+		BuildInstanceAccelerators();
+		BuildLights();
+	}
+
+	void BuildKDTree() {
+		kd_tree = nullptr;
+		if (!triIndices.empty())
+			kd_tree = std::make_shared<KDTreeCPU>((int)triIndices.size(), triIndices.data(), (int)vertices.size(), vertices.data(), KD_BUILD_BINNED, 32, KD_CACHE_DIRECTORY, kdSimdLeaves);
+	}
+
+	// After emission or the material of a primitive changed
+	void BuildLights() {
+		lights.clear();
+		for (uint32_t i = 0; i < (uint32_t)triangles.size(); i++)
+		{
+			if (IsEmissive(triangles[i].MaterialIndex))
+				lights.push_back({ PRIM_TRIANGLE, i });
+		}
+		for (uint32_t i = 0; i < (uint32_t)spheres.size(); i++)
+		{
+			if (IsEmissive(spheres[i].MaterialIndex))
+				lights.push_back({ PRIM_SPHERE, i });
+		}
+	}
+
+	bool IsEmissive(uint32_t materialIndex) const {
+		if (materialIndex >= materials.size())
+			return false;
+
+		const glm::vec3& emission = materials[materialIndex].Emission;
+		return emission.r > 0.0f || emission.g > 0.0f || emission.b > 0.0f;
+	}
+
+	// After spheres were moved or resized: refits the spheres and the nodes above them in the structures indexing
+	// them, and rebuilds them instead once refitting has degraded their SAH cost too far. Quantized bounds can't be
+	// refitted in place, the compressed BVH4 is encoded again from the refitted BVH4
+	void RefitSphereAccelerators() {
+		if (bvhBuildMode == BVH_BUILD_LBVH) {
+			BuildSphereAccelerators();
+			return;
+		}
+
+		std::vector<glm::vec4> sphereData = GetSphereData();
+
+		bvh2->refitSpheres(sphereData.data());
+		bvh4->refitSpheres(sphereData.data());
+
+		if (bvh2->getSAHCost() > BVH_REFIT_MAX_SAH_RATIO * bvh2->getBuildSAHCost() || bvh4->getSAHCost() > BVH_REFIT_MAX_SAH_RATIO * bvh4->getBuildSAHCost())
+			BuildSphereAccelerators();
+		else
+			bvh4_compressed = std::make_shared<CompressedBVH4>(*bvh4);
+	}
+
+	// Center and radius of each sphere, as the accelerators take them
+	std::vector<glm::vec4> GetSphereData() const {
+		std::vector<glm::vec4> sphereData(spheres.size());
+		for (size_t i = 0; i < spheres.size(); i++)
+			sphereData[i] = glm::vec4(spheres[i].Position, spheres[i].Radius);
+
+		return sphereData;
+	}
+
+	void BuildInstanceAccelerators() {
+		tlas = nullptr;
+		if (instances.empty())
+			return;
+
+		for (Mesh& mesh : meshes)
+			mesh.blas = std::make_shared<BVH4>((int)mesh.triIndices.size(), mesh.triIndices.data(), mesh.vertices.data());
+
+		std::vector<BVHInstance> blasInstances(instances.size());
+		for (size_t i = 0; i < instances.size(); i++)
+			blasInstances[i] = { meshes[instances[i].MeshIndex].blas.get(), instances[i].Transform };
+
+		tlas = std::make_shared<TopLevelBVH>((int)blasInstances.size(), blasInstances.data());
+	}
+
+	// Structures that index spheres, BVH4 is collapsed from the BVH2 build
+	void BuildSphereAccelerators() {
+		std::vector<glm::vec4> sphereData = GetSphereData();
+
+		bvh2 = std::make_shared<BVH2>((int)triIndices.size(), triIndices.data(), vertices.data(), (int)sphereData.size(), sphereData.data(), bvhBuildMode);
+		bvh4 = std::make_shared<BVH4>(*bvh2);
+		bvh4_compressed = std::make_shared<CompressedBVH4>(*bvh4);
+	}
+
+	const Accelerator* GetAccelerator(AcceleratorType type) const {
+		switch (type) {
+		case ACCEL_KD_TREE:	return kd_tree.get();
+		case ACCEL_BVH2:	return bvh2.get();
+		case ACCEL_BVH4:	return bvh4.get();
+		case ACCEL_BVH4_COMPRESSED:	return bvh4_compressed.get();
+		default:			return nullptr;
+		}
+	}
 };
\ No newline at end of file